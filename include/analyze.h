@@ -0,0 +1,48 @@
+//
+// Created by aagu on 20-4-22.
+//
+
+#ifndef SQLMINI_ANALYZE_H
+#define SQLMINI_ANALYZE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "table.h"
+
+/*
+ * Tree health for ".analyze": one walk over the tree and one along the
+ * leaf chain, reading no cell contents. Fill is cells (leaves) or children
+ * (internal nodes) over what the node can hold. A step along the leaf chain
+ * is in order when the next leaf is the next page of the file; anything
+ * else is a jump a sequential scan pays for with a seek.
+ */
+#define ANALYZE_FILL_BUCKETS 10
+
+typedef struct {
+    uint32_t num_nodes;
+    uint64_t num_entries; // cells of leaves, children of internal nodes
+    double fill_sum;
+    double min_fill;
+    uint32_t fill_histogram[ANALYZE_FILL_BUCKETS];
+} NodeFill;
+
+typedef struct {
+    uint32_t height;
+    uint32_t nodes_per_level[TREE_MAX_HEIGHT];
+    NodeFill leaves;
+    NodeFill internal_nodes;
+    uint64_t num_tombstones;
+    uint32_t chain_steps;
+    uint32_t chain_in_order; // next leaf is the next page
+    uint32_t chain_forward_jumps;
+    uint32_t chain_backward_jumps;
+    uint32_t chain_leaves; // leaves reached along the chain, should be leaves.num_nodes
+    uint32_t num_pages; // in the file, header included
+    uint32_t tree_pages;
+    uint32_t free_pages; // in the pager's free map, see pager_allocate_near()
+} TreeHealth;
+
+void analyze_tree(Table* table, TreeHealth* health);
+
+void print_tree_health(TreeHealth* health, bool histogram);
+#endif //SQLMINI_ANALYZE_H
@@ -0,0 +1,39 @@
+//
+// Created by aagu on 20-4-08.
+//
+
+#ifndef SQLMINI_ARENA_H
+#define SQLMINI_ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Statement-scoped bump allocator. Everything allocated while executing a
+ * statement (cursors, scratch buffers) is released at once by arena_reset().
+ * After the first few statements the arena has grown to fit and the hot
+ * path does no heap allocation at all.
+ */
+static const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+static const size_t ARENA_ALIGNMENT = 16;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+    uint64_t num_allocations;      // arena_alloc() calls
+    uint64_t num_heap_allocations; // mallocs made to grow the arena
+} Arena;
+
+Arena* arena_new();
+
+void* arena_alloc(Arena* arena, size_t size);
+
+void arena_reset(Arena* arena);
+
+void arena_free(Arena* arena);
+#endif //SQLMINI_ARENA_H
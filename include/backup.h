@@ -0,0 +1,51 @@
+//
+// Created by aagu on 20-4-14.
+//
+
+#ifndef SQLMINI_BACKUP_H
+#define SQLMINI_BACKUP_H
+
+#include <stdint.h>
+#include "table.h"
+
+/*
+ * Online backup of the database file. Pages are copied in order: cached
+ * pages from memory, since they are newer than the file, and runs of pages
+ * never loaded straight from the database file with copy_file_range().
+ *
+ * A backup may be taken in steps with statements running in between. It
+ * copies the tree as of backup_begin(): the pager keeps a snapshot (see
+ * PagerSnapshot in pager.h) and saves a page the backup has not copied yet
+ * before a statement may change it, so steps never start over however much
+ * is written meanwhile. One backup runs at a time. The copy is written to
+ * "<path>.tmp" and renamed over path once complete, so neither may be the
+ * open database or its hash index file. The hash index file is not copied,
+ * it can be recreated with .hashindex. A compressed database is backed up
+ * as plain pages.
+ */
+static const uint32_t BACKUP_RUN_PAGES = 64; // pages per write
+
+typedef enum {
+    BACKUP_DONE,
+    BACKUP_MORE,
+    BACKUP_ERROR
+} BackupResult;
+
+typedef struct {
+    Table* table;
+    char* path;
+    char* temp_path;
+    int file_descriptor;
+    void* buffer; // BACKUP_RUN_PAGES pages
+    uint32_t num_pages; // size of the snapshot being copied
+    uint32_t next_page_num;
+} Backup;
+
+Backup* backup_begin(Table* table, const char* path);
+
+BackupResult backup_step(Backup* backup, uint32_t max_pages);
+
+BackupResult backup_finish(Backup* backup);
+
+BackupResult table_backup(Table* table, const char* path, uint32_t* num_pages);
+#endif //SQLMINI_BACKUP_H
@@ -0,0 +1,36 @@
+//
+// Created by aagu on 20-4-05.
+//
+
+#ifndef SQLMINI_BLOOM_FILTER_H
+#define SQLMINI_BLOOM_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Counting Bloom filter over Row.id. It lives only in memory and is rebuilt
+ * from the leaves when the database is opened. Counters instead of bits let
+ * deletes take keys out again.
+ */
+static const uint32_t BLOOM_FILTER_COUNTERS_PER_KEY = 10;
+static const uint32_t BLOOM_FILTER_NUM_HASHES = 4;
+static const uint32_t BLOOM_FILTER_MIN_CAPACITY = 4096;
+
+typedef struct {
+    uint32_t capacity; // keys the filter is sized for before it should be rebuilt
+    uint32_t num_keys;
+    uint32_t mask;
+    uint8_t* counters;
+} BloomFilter;
+
+BloomFilter* bloom_filter_new(uint32_t capacity);
+
+void bloom_filter_free(BloomFilter* filter);
+
+void bloom_filter_add(BloomFilter* filter, uint32_t key);
+
+void bloom_filter_remove(BloomFilter* filter, uint32_t key);
+
+bool bloom_filter_may_contain(BloomFilter* filter, uint32_t key);
+#endif //SQLMINI_BLOOM_FILTER_H
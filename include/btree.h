@@ -14,10 +14,14 @@ static const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
 static const uint32_t NODE_TYPE_OFFSET = 0;
 static const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 static const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
-static const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-static const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-static const uint8_t COMMON_NODE_HEADER_SIZE =
-        NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+// Bits of the is_root byte
+static const uint8_t NODE_FLAG_ROOT = 1;
+static const uint8_t NODE_FLAG_PAX = 2; // leaf stored column by column, see below
+/*
+ * Nodes keep no parent pointer, the path recorded while descending
+ * (Cursor.path) says where a node hangs.
+ */
+static const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE;
 
 /*
  * Leaf Node Header Layout
@@ -34,16 +38,36 @@ static const uint32_t LEAF_NODE_HEADER_SIZE =
  */
 static const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
 static const uint32_t LEAF_NODE_KEY_OFFSET = 0;
+static const uint32_t LEAF_NODE_FLAGS_SIZE = sizeof(uint8_t);
+static const uint32_t LEAF_NODE_FLAGS_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
 static const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
 static const uint32_t LEAF_NODE_VALUE_OFFSET =
-        LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-static const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-static const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-static const uint32_t LEAF_NODE_MAX_CELLS =
-        LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-static const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-static const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-        (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+        LEAF_NODE_FLAGS_OFFSET + LEAF_NODE_FLAGS_SIZE;
+static const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_FLAGS_SIZE + LEAF_NODE_VALUE_SIZE;
+// A tombstoned cell was deleted lazily and is skipped by readers until purged
+static const uint8_t LEAF_CELL_TOMBSTONE = 1;
+
+/*
+ * PAX Leaf Node Layout
+ *
+ * A leaf with NODE_FLAG_PAX set keeps the same fields as a row leaf, but
+ * grouped into one minipage per column: capacity keys, then capacity cell
+ * flags, then usernames, then emails. The key doubles as the id column.
+ * A scan that wants some columns only reads their minipages.
+ */
+static const uint32_t PAX_LEAF_NODE_CAPACITY_SIZE = sizeof(uint32_t);
+static const uint32_t PAX_LEAF_NODE_CAPACITY_OFFSET = LEAF_NODE_HEADER_SIZE;
+// Padded so the key minipage is 4-byte aligned
+static const uint32_t PAX_LEAF_NODE_HEADER_SIZE = 16;
+static const uint32_t PAX_LEAF_NODE_KEYS_OFFSET = PAX_LEAF_NODE_HEADER_SIZE;
+
+typedef enum {
+    PAX_MINIPAGE_KEY,
+    PAX_MINIPAGE_FLAGS,
+    PAX_MINIPAGE_USERNAME,
+    PAX_MINIPAGE_EMAIL,
+    PAX_NUM_MINIPAGES
+} PaxMinipage;
 
 /*
  * Internal Node Header Layout
@@ -65,16 +89,28 @@ static const uint32_t INTERNAL_NODE_NUM_CELLS_OFFSET =
         INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE;
 static const uint32_t INTERNAL_NODE_CELL_SIZE =
         INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-static const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
-static const uint32_t INTERNAL_NODE_RIGHT_SPILT_COUNT = (INTERNAL_NODE_MAX_CELLS + 1) / 2;
-static const uint32_t INTERNAL_NODE_LEFT_SPILT_COUNT =
-        (INTERNAL_NODE_MAX_CELLS + 1) - INTERNAL_NODE_RIGHT_SPILT_COUNT;
+/*
+ * Cells are addressed the same way whatever the page size, only how many
+ * fit changes. Capacities live in Table.layout, see node_layout_init().
+ * 4096-byte pages keep the tiny internal fanout the tree was developed
+ * with, so small tables still grow several levels.
+ */
+static const uint32_t INTERNAL_NODE_MAX_CELLS_4K = 3;
+/*
+ * With subtree counts, internal_max_cells + 1 uint32 counts follow the cell
+ * area, one per child with the right child last: how many live rows the
+ * child's subtree holds. They give O(height) rank lookups, see
+ * table_rank() and table_seek_rank().
+ */
+static const uint32_t INTERNAL_NODE_COUNT_SIZE = sizeof(uint32_t);
 
 typedef enum {
     NODE_INTERNAL,
     NODE_LEAF
 } NodeType;
 
+void node_layout_init(NodeLayout* layout, uint32_t page_size, LeafFormat leaf_format, bool subtree_counts);
+
 NodeType get_node_type(void* node);
 
 void set_node_type(void* node, NodeType type);
@@ -85,34 +121,63 @@ void set_node_root(void* node, bool is_root);
 
 Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key);
 
-void internal_node_delete(Table* table, uint32_t page_num, uint32_t key, uint32_t old_max_key);
-
 void initialize_internal_node(void* node);
 
 uint32_t* internal_node_num_keys(void* node);
 
 uint32_t* internal_node_child(void* node, uint32_t child_num);
 
-uint32_t get_node_max_key(void* node);
+uint32_t get_node_max_key(Pager* pager, void* node);
 
 uint32_t* internal_node_key(void* node, uint32_t key_num);
 
+uint32_t internal_node_find_child(void* node, uint32_t key);
+
+uint32_t* internal_node_count(NodeLayout* layout, void* node, uint32_t child_num);
+
+uint32_t node_subtree_count(Table* table, uint32_t page_num);
+
+void internal_node_recount(Table* table, void* node, uint32_t child_num);
+
+void tree_path_add_count(Table* table, TreePath* path, int32_t delta);
+
+void tree_path_recount(Table* table, TreePath* path);
+
 uint32_t* internal_node_right_child(void* node);
 
-//void internal_node_delete(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+void internal_node_remove_child(Table* table, void* node, uint32_t child_index);
+
+void internal_node_balance(Table* table, void* parent, uint32_t left_index);
+
+void internal_node_merge(Table* table, void* parent, uint32_t left_index);
+
+void internal_node_rebalance(Table* table, TreePath* path, uint32_t level);
+
+void internal_node_fill(Table* table, uint32_t page_num, uint32_t* children, uint32_t* keys, uint32_t* counts,
+                        uint32_t num_children);
+
+void internal_node_split_and_insert(Table* table, TreePath* path, uint32_t level,
+                                    uint32_t left_max_key, uint32_t new_child_page_num);
 
-void internal_node_merge(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+void internal_node_insert(Table* table, TreePath* path, uint32_t level,
+                          uint32_t left_max_key, uint32_t new_child_page_num);
 
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+void initialize_leaf_node(void* node, NodeLayout* layout);
 
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+void leaf_node_reindex_cells(Table* table, uint32_t page_num, uint32_t from_cell, uint32_t to_cell);
 
-void initialize_leaf_node(void* node);
+void leaf_node_reindex(Table* table, uint32_t page_num);
 
 Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key);
 
 Cursor* leaf_node_delete(Cursor* cursor, uint32_t key);
 
+bool leaf_node_is_pax(void* node);
+
+uint32_t* pax_leaf_node_capacity(void* node);
+
+void* pax_leaf_node_minipage(void* node, PaxMinipage minipage);
+
 void* leaf_node_cell(void* node, uint32_t cell_num);
 
 uint32_t* leaf_node_num_cells(void* node);
@@ -121,15 +186,63 @@ uint32_t* leaf_node_key(void* node, uint32_t cell_num);
 
 void* leaf_node_value(void* node, uint32_t cell_num);
 
+uint8_t* leaf_node_flags(void* node, uint32_t cell_num);
+
+bool leaf_node_is_tombstone(void* node, uint32_t cell_num);
+
+uint32_t layout_leaf_key(NodeLayout* layout, void* node, uint32_t cell_num);
+
+bool layout_leaf_is_tombstone(NodeLayout* layout, void* node, uint32_t cell_num);
+
+void leaf_node_read_row(void* node, uint32_t cell_num, Row* row, uint32_t columns);
+
+void leaf_node_set_cell(void* node, uint32_t cell_num, uint32_t key, Row* row);
+
+void leaf_node_copy_cells(void* destination, uint32_t to, void* source, uint32_t from, uint32_t count);
+
+uint32_t leaf_node_purge(Table* table, uint32_t page_num);
+
+uint32_t compact_group_size(uint32_t remaining, uint32_t max_size, uint32_t min_size);
+
+/*
+ * Where build_internal_levels() takes pages for new internal nodes: the top
+ * node goes to top_page_num unless it is 0, any other node to the next of
+ * spare_pages and, once those are used up, to a new page at the end of the
+ * file.
+ */
+typedef struct {
+    uint32_t top_page_num;
+    uint32_t* spare_pages;
+    uint32_t num_spare_pages;
+    uint32_t num_spare_used;
+} InternalPageSupply;
+
+uint32_t build_internal_levels(Table* table, uint32_t* pages, uint32_t* max_keys, uint32_t* counts,
+                               uint32_t num_pages, uint32_t max_children, InternalPageSupply* supply);
+
+uint32_t compact_tree(Table* table);
+
 void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value);
 
 uint32_t* leaf_node_next_leaf(void* node);
 
-void leaf_node_merge(Table* table, uint32_t left_node_page, uint32_t right_node_page);
+void leaf_node_balance(Table* table, void* parent, uint32_t left_index);
+
+void leaf_node_merge(Table* table, void* parent, uint32_t left_index);
 
-void create_new_root(Table* table, uint32_t right_child_page_num);
+void leaf_node_rebalance(Cursor* cursor);
+
+void collapse_root(Table* table);
+
+void create_new_root(Table* table, uint32_t right_child_page_num, uint32_t left_max_key);
+
+void cursor_ensure_path(Cursor* cursor, uint32_t key);
 
 void leaf_node_insert(Cursor* cursor, uint32_t key, Row* row);
 
+void leaf_node_insert_batch(Cursor* cursor, Row* rows, uint32_t num_rows);
+
+bool tree_path_upper_bound(Table* table, TreePath* path, uint32_t* key);
+
 void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
 #endif //SQLMINI_BTREE_H
@@ -16,6 +16,7 @@ typedef struct {
 
 typedef enum {
     STATEMENT_INSERT,
+    STATEMENT_INSERT_BATCH,
     STATEMENT_SELECT,
     STATEMENT_DELETE
 } StatementType;
@@ -34,10 +35,37 @@ typedef struct {
     uint32_t id;
 } WhereClause;
 
+// Column sets, e.g. the columns a select projects
+static const uint32_t COLUMN_ID = 1 << 0;
+static const uint32_t COLUMN_USERNAME = 1 << 1;
+static const uint32_t COLUMN_EMAIL = 1 << 2;
+static const uint32_t COLUMN_ALL = (1 << 0) | (1 << 1) | (1 << 2);
+
+typedef enum {
+    AGGREGATE_NONE,
+    AGGREGATE_COUNT, // count(*)
+    AGGREGATE_MIN, // min(id)
+    AGGREGATE_MAX, // max(id)
+    AGGREGATE_SUM // sum(id)
+} AggregateType;
+
+typedef enum {
+    EXPLAIN_NONE,
+    EXPLAIN_PLAN, // explain: print how the select would run without running it
+    EXPLAIN_ANALYZE // explain analyze: run it, discard the rows and print what it cost
+} ExplainMode;
+
 typedef struct {
     StatementType type;
     Row row_to_manipulate; // only used by insert statement
+    Row* rows; // only used by insert values, owned by the statement
+    uint32_t num_rows;
     WhereClause clause;
+    uint32_t columns; // only used by select
+    AggregateType aggregate; // only used by select
+    uint32_t limit; // only used by select, UINT32_MAX when there is no limit
+    uint32_t offset; // only used by select
+    ExplainMode explain; // only used by select
 } Statement;
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
@@ -50,6 +78,16 @@ static const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
 static const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 static const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
-static const uint32_t PAGE_SIZE = 4096;
+/*
+ * Page size is chosen per database when its file is created and recorded
+ * in the file header: a power of two from MIN_PAGE_SIZE to MAX_PAGE_SIZE.
+ * The default for new files can be set at build time,
+ * e.g. -DDEFAULT_PAGE_SIZE=16384.
+ */
+#ifndef DEFAULT_PAGE_SIZE
+#define DEFAULT_PAGE_SIZE 4096
+#endif
+static const uint32_t MIN_PAGE_SIZE = 4096;
+static const uint32_t MAX_PAGE_SIZE = 65536;
 
 #endif //SQLMINI_CONSTANTS_H
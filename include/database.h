@@ -0,0 +1,76 @@
+//
+// Created by aagu on 20-4-10.
+//
+
+#ifndef SQLMINI_DATABASE_H
+#define SQLMINI_DATABASE_H
+
+#include "table.h"
+
+typedef enum {
+    EXECUTE_SUCCESS,
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_TABLE_FULL
+} ExecuteResult;
+
+/*
+ * How a select reaches its rows.
+ */
+typedef enum {
+    ACCESS_FULL_SCAN, // the leaf chain from table_start()
+    ACCESS_SEEK, // a descent to the lower bound, then the leaf chain
+    ACCESS_POINT_LOOKUP, // id=N through table_lookup()
+    ACCESS_PARALLEL_SCAN, // the leaf chain split across scan threads
+    ACCESS_SUBTREE_COUNTS, // count(*) as the difference of two ranks
+    ACCESS_RIGHTMOST_LEAF // max(id) without a where clause
+} AccessPath;
+
+/*
+ * Choices made when a database file is created. An existing file keeps
+ * the ones recorded in its header. direct_io and huge_pages are not
+ * recorded, they apply to the open they are given to.
+ */
+typedef struct {
+    uint32_t page_size;
+    LeafFormat leaf_format;
+    bool subtree_counts;
+    bool direct_io; // bypass the OS page cache, see pager_set_direct_io()
+    bool huge_pages; // cache pages in the hugetlbfs pool, see pager_map_frames()
+} DbOptions;
+
+char* hash_index_filename(const char* filename);
+
+void db_options_init(DbOptions* options);
+
+Table* db_open(const char* filename, DbOptions* options);
+
+void db_close(Table* table);
+
+void create_hash_index(Table* table);
+
+void print_row(Row* row);
+
+void print_row_columns(Row* row, uint32_t columns);
+
+void fprint_row_columns(FILE* output, Row* row, uint32_t columns);
+
+void print_row_count(uint64_t row_count);
+
+ExecuteResult execute_insert(Statement* statement, Table* table);
+
+ExecuteResult execute_insert_batch(Table* table, Row* rows, uint32_t num_rows);
+
+uint64_t count_in_range(Table* table, WhereClause clause);
+
+AccessPath select_access_path(Statement* statement, Table* table);
+
+Cursor* access_path_start(AccessPath path, Statement* statement, Table* table);
+
+ExecuteResult execute_aggregate(Statement* statement, Table* table);
+
+ExecuteResult execute_select(Statement* statement, Table* table);
+
+ExecuteResult execute_delete(Statement* statement, Table* table);
+
+ExecuteResult execute_statement(Statement* statement, Table* table);
+#endif //SQLMINI_DATABASE_H
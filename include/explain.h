@@ -0,0 +1,19 @@
+//
+// Created by aagu on 20-4-20.
+//
+
+#ifndef SQLMINI_EXPLAIN_H
+#define SQLMINI_EXPLAIN_H
+
+#include "database.h"
+
+/*
+ * "explain <select>" prints the access path the select would take, one
+ * "name: value" line per property. "explain analyze <select>" then runs it
+ * with the rows discarded and prints what it cost, from the pager counters
+ * and Table.counters taken before and after.
+ */
+void print_plan(Statement* statement, Table* table);
+
+ExecuteResult execute_explain(Statement* statement, Table* table);
+#endif //SQLMINI_EXPLAIN_H
@@ -0,0 +1,50 @@
+//
+// Created by aagu on 20-4-02.
+//
+
+#ifndef SQLMINI_HASH_INDEX_H
+#define SQLMINI_HASH_INDEX_H
+
+#include <stdbool.h>
+#include "pager.h"
+
+/*
+ * Linear hash index mapping Row.id to the leaf page holding the row.
+ * It is stored in its own file next to the database and managed by a
+ * second Pager. The B+tree stays authoritative for ranges, the index only
+ * answers point lookups and duplicate-key checks.
+ */
+
+/*
+ * Header Page Layout (page 1, right after the file header)
+ */
+static const uint32_t HASH_INDEX_HEADER_PAGE_NUM = 1;
+static const uint32_t HASH_INDEX_LEVEL_OFFSET = 0;
+static const uint32_t HASH_INDEX_NEXT_SPLIT_OFFSET = HASH_INDEX_LEVEL_OFFSET + sizeof(uint32_t);
+static const uint32_t HASH_INDEX_NUM_BUCKETS_OFFSET = HASH_INDEX_NEXT_SPLIT_OFFSET + sizeof(uint32_t);
+static const uint32_t HASH_INDEX_NUM_ENTRIES_OFFSET = HASH_INDEX_NUM_BUCKETS_OFFSET + sizeof(uint32_t);
+static const uint32_t HASH_INDEX_DIRECTORY_OFFSET = HASH_INDEX_NUM_ENTRIES_OFFSET + sizeof(uint32_t);
+static const uint32_t HASH_INDEX_INITIAL_BUCKETS = 4;
+
+/*
+ * Bucket Page Layout
+ */
+static const uint32_t HASH_BUCKET_NUM_ENTRIES_OFFSET = 0;
+static const uint32_t HASH_BUCKET_OVERFLOW_OFFSET = HASH_BUCKET_NUM_ENTRIES_OFFSET + sizeof(uint32_t);
+static const uint32_t HASH_BUCKET_HEADER_SIZE = HASH_BUCKET_OVERFLOW_OFFSET + sizeof(uint32_t);
+static const uint32_t HASH_BUCKET_ENTRY_SIZE = 2 * sizeof(uint32_t); // key, leaf page
+
+uint32_t hash_index_max_buckets(Pager* index);
+
+uint32_t hash_bucket_max_entries(Pager* index);
+
+Pager* hash_index_open(const char* filename, uint32_t page_size);
+
+void hash_index_close(Pager* index);
+
+bool hash_index_find(Pager* index, uint32_t key, uint32_t* page_num);
+
+void hash_index_put(Pager* index, uint32_t key, uint32_t page_num);
+
+void hash_index_remove(Pager* index, uint32_t key);
+#endif //SQLMINI_HASH_INDEX_H
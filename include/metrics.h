@@ -0,0 +1,82 @@
+//
+// Created by aagu on 20-4-21.
+//
+
+#ifndef SQLMINI_METRICS_H
+#define SQLMINI_METRICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "table.h"
+
+/*
+ * Always-on engine metrics: statement counts and latencies, and structural
+ * changes to the tree. Every thread that records gets a shard of its own,
+ * so recording is a plain increment with no atomics or shared cache lines.
+ * Readers add the shards up; a total may miss an update in flight, never
+ * an earlier one. Past METRICS_MAX_SHARDS threads, the rest share one last
+ * shard and update it atomically.
+ *
+ * Page requests, reads and writes are already kept by each Pager and are
+ * read from there.
+ *
+ * Latencies go into HDR style histograms: values below 2^HISTOGRAM_SUB_BITS
+ * ns have a bucket each, and every power of two above is split into
+ * 2^HISTOGRAM_SUB_BITS buckets, so a bucket is within about 6% of any value
+ * in it, up to 2^HISTOGRAM_MAX_EXPONENT ns (about 2.4 hours).
+ */
+#define METRICS_MAX_SHARDS 64
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAX_EXPONENT 43
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 2) << HISTOGRAM_SUB_BITS)
+
+typedef enum {
+    METRIC_LEAF_SPLITS,
+    METRIC_INTERNAL_SPLITS,
+    METRIC_LEAF_MERGES,
+    METRIC_INTERNAL_MERGES,
+    METRIC_LEAF_BORROWS, // rebalancing that moved cells between sibling leaves
+    METRIC_INTERNAL_BORROWS,
+    METRIC_ROOT_COLLAPSES,
+    METRIC_COMPACTIONS,
+    METRIC_REBUILDS,
+    METRIC_NUM_COUNTERS
+} MetricCounter;
+
+// One histogram per statement type, indexed by StatementType
+#define METRICS_NUM_STATEMENT_TYPES 4
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+typedef struct {
+    uint64_t counters[METRIC_NUM_COUNTERS];
+    Histogram statements[METRICS_NUM_STATEMENT_TYPES];
+    bool shared; // the overflow shard, updated atomically
+} __attribute__((aligned(64))) MetricsShard;
+
+typedef enum {
+    METRICS_TEXT,
+    METRICS_JSON,
+    METRICS_PROMETHEUS
+} MetricsFormat;
+
+uint64_t metrics_now_ns();
+
+void metrics_count(MetricCounter counter, uint64_t value);
+
+void metrics_record_statement(StatementType type, uint64_t elapsed_ns);
+
+void metrics_sum(MetricsShard* total);
+
+uint64_t histogram_percentile(Histogram* histogram, double percentile);
+
+bool metrics_parse_format(const char* name, MetricsFormat* format);
+
+void metrics_write(Table* table, FILE* output, MetricsFormat format);
+#endif //SQLMINI_METRICS_H
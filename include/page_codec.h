@@ -0,0 +1,31 @@
+//
+// Created by aagu on 20-4-16.
+//
+
+#ifndef SQLMINI_PAGE_CODEC_H
+#define SQLMINI_PAGE_CODEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Page compression for files written with compression on. Rows are fixed
+ * width, so most of a page is the zero padding after usernames and emails
+ * plus the unused tail of the page. The codec is a run-length code aimed at
+ * exactly that, a stream of tokens:
+ *
+ *   0x00-0x7F  literal, the next (token + 1) bytes are copied as they are
+ *   0x80-0xFE  (token - 0x7F) zero bytes
+ *   0xFF       zero bytes, count in the next two bytes (little endian)
+ */
+static const uint8_t PAGE_CODEC_MAX_LITERAL = 128;
+static const uint8_t PAGE_CODEC_SHORT_ZEROS = 0x80;
+static const uint8_t PAGE_CODEC_LONG_ZEROS = 0xFF;
+static const uint32_t PAGE_CODEC_MAX_SHORT_ZEROS = PAGE_CODEC_LONG_ZEROS - PAGE_CODEC_SHORT_ZEROS;
+static const uint32_t PAGE_CODEC_MAX_LONG_ZEROS = UINT16_MAX;
+static const uint32_t PAGE_CODEC_MIN_ZERO_RUN = 3; // shorter runs cost less as literals
+
+uint32_t page_compress(const uint8_t* source, uint32_t size, uint8_t* destination);
+
+bool page_decompress(const uint8_t* source, uint32_t length, uint8_t* destination, uint32_t size);
+#endif //SQLMINI_PAGE_CODEC_H
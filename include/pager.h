@@ -5,26 +5,183 @@
 #ifndef SQLMINI_PAGER_H
 #define SQLMINI_PAGER_H
 
-#define TABLE_MAX_PAGES 100
+#define TABLE_MAX_PAGES 16384
 
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include "constants.h"
 
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+static const uint32_t PAGE_WRITE_BUFFER_PAGES = 64;
+
+/*
+ * File Header Layout (page 0 of every file opened by a Pager)
+ *
+ * Written when the file is created and validated on open. Page 0 never
+ * holds a node, so page number 0 still works as "no page" in sibling and
+ * chain pointers. The rest of the page is reserved for engine metadata.
+ */
+static const char FILE_HEADER_MAGIC[8] = {'S', 'Q', 'L', 'M', 'I', 'N', 'I', '\0'};
+static const uint32_t FILE_FORMAT_VERSION = 1;
+static const uint32_t FILE_HEADER_MAGIC_OFFSET = 0;
+static const uint32_t FILE_HEADER_VERSION_OFFSET = FILE_HEADER_MAGIC_OFFSET + sizeof(FILE_HEADER_MAGIC);
+static const uint32_t FILE_HEADER_PAGE_SIZE_OFFSET = FILE_HEADER_VERSION_OFFSET + sizeof(uint32_t);
+static const uint32_t FILE_HEADER_ROOT_PAGE_OFFSET = FILE_HEADER_PAGE_SIZE_OFFSET + sizeof(uint32_t);
+// Reserved, always 0. Free pages are tracked in the free map below, not chained
+static const uint32_t FILE_HEADER_RESERVED_OFFSET = FILE_HEADER_ROOT_PAGE_OFFSET + sizeof(uint32_t);
+static const uint32_t FILE_HEADER_FLAGS_OFFSET = FILE_HEADER_RESERVED_OFFSET + sizeof(uint32_t);
+static const uint32_t FILE_HEADER_EXTENT_MAP_OFFSET = FILE_HEADER_FLAGS_OFFSET + sizeof(uint32_t);
+static const uint32_t FILE_HEADER_NUM_EXTENTS_OFFSET = FILE_HEADER_EXTENT_MAP_OFFSET + sizeof(uint32_t);
+static const uint32_t FILE_HEADER_DATA_VERSION_OFFSET = FILE_HEADER_NUM_EXTENTS_OFFSET + sizeof(uint32_t);
+static const uint32_t FILE_HEADER_METADATA_OFFSET = FILE_HEADER_DATA_VERSION_OFFSET + sizeof(uint32_t);
+static const uint32_t FILE_HEADER_PAGE_NUM = 0;
+
+/*
+ * One bit per page, set while the page is free: freed by a merge or
+ * reserved with an extent and not handed out yet. It fills the second half
+ * of a MIN_PAGE_SIZE header page. Files written before it have zeros here,
+ * meaning no free pages.
+ */
+static const uint32_t FILE_HEADER_FREE_MAP_OFFSET = 2048;
+static const uint32_t FILE_HEADER_FREE_MAP_SIZE = TABLE_MAX_PAGES / 8;
+
+/*
+ * New leaves are placed near the leaf they split from. When there is no
+ * free page close by, an extent of pages is reserved at the end of the file
+ * in one go and preallocated on disk, and the new leaf takes the first of
+ * them. Extents grow with the file, an eighth of it, from
+ * PAGER_MIN_EXTENT_PAGES up to PAGER_EXTENT_PAGES, so a small database
+ * stays small.
+ */
+static const uint32_t PAGER_MIN_EXTENT_PAGES = 4;
+static const uint32_t PAGER_EXTENT_PAGES = 64;
+
+/*
+ * With FILE_FLAG_COMPRESSED set, pages other than the header are stored
+ * compressed (see page_codec.h) one after another, and an extent map at the
+ * end of the file says where each one is. The header page itself is always
+ * stored as it is at offset 0. Later closes append changed pages and a new
+ * map instead of rewriting the file, see pager_append_compressed().
+ */
+static const uint32_t FILE_FLAG_COMPRESSED = 1;
+// Leaves of the table are PAX leaves, chosen when the database is created
+static const uint32_t FILE_FLAG_PAX_LEAVES = 2;
+// Internal nodes keep live row counts per child, chosen when the database is created
+static const uint32_t FILE_FLAG_SUBTREE_COUNTS = 4;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t length; // page size when the page is stored uncompressed
+} PageExtent;
+
+/*
+ * The pages as they were at one moment, kept for a reader that takes them
+ * one by one while the pager goes on changing them, see backup.h. Before a
+ * page the reader has yet to take is handed out by get_page() or loses its
+ * frame, its image is saved, so the reader never sees a later version.
+ */
+typedef struct {
+    uint32_t num_pages; // pages in the snapshot
+    uint64_t* pending; // bit per page not taken by the reader yet
+    void** saved; // image of each pending page the pager has touched since
+    uint32_t num_saved;
+} PagerSnapshot;
+
+/*
+ * Page frames are carved out of one region reserved up front instead of
+ * being malloc'ed one by one. The region is made of huge pages, explicit or
+ * transparent, so a large cache does not thrash the TLB, and is interleaved
+ * across NUMA nodes on machines that have several, see pager_map_frames().
+ */
 typedef struct {
     int file_descriptor;
+    uint32_t page_size; // from the file header, or given when the file is created
     uint32_t file_length;
     uint32_t num_pages;
     void* pages[TABLE_MAX_PAGES];
+    void* frames_region;
+    size_t frames_region_size;
+    void* frames; // first frame, huge page aligned
+    bool huge_tlb; // frames come from the hugetlbfs pool
+    bool interleaved; // frames are spread over the NUMA nodes
+    uint32_t num_frames_used;
+    uint32_t free_frames[TABLE_MAX_PAGES];
+    uint32_t num_free_frames;
+    uint64_t num_page_requests; // get_page() calls
+    uint64_t num_page_reads;    // cache misses served from the file
+    uint64_t num_page_writes;
+    bool compress; // write the file compressed when the pager is closed
+    bool direct_io; // file opened with O_DIRECT, see pager_set_direct_io()
+    PageExtent* extents; // where pages are in a compressed file, NULL when stored in place
+    uint32_t num_extents;
+    void* compressed_buffer; // one page of scratch for reading and writing extents
+    PagerSnapshot* snapshot; // NULL unless a backup is running
 } Pager;
 
 void* get_page(Pager* pager, uint32_t page_num);
 
+void* pager_read_page(Pager* pager, uint32_t page_num, void* buffer, void* compressed_buffer);
+
+uint32_t* file_header_version(void* header);
+
+uint32_t* file_header_page_size(void* header);
+
+uint32_t* file_header_root_page(void* header);
+
+uint32_t* file_header_flags(void* header);
+
+uint32_t* file_header_extent_map(void* header);
+
+uint32_t* file_header_num_extents(void* header);
+
+uint32_t* file_header_data_version(void* header);
+
+uint64_t* file_header_free_map(void* header);
+
 void serialize_row(Row* source, void* destination);
 
 uint32_t get_unused_page_num(Pager* pager);
 
+uint32_t pager_extent_pages(Pager* pager);
+
+uint32_t pager_allocate_near(Pager* pager, uint32_t near_page_num);
+
+bool pager_page_is_free(Pager* pager, uint32_t page_num);
+
+uint32_t pager_num_free_pages(Pager* pager);
+
 void deserialize_row(void* source, Row* destination);
 
-Pager *pager_open(const char *filename);
+bool page_size_valid(uint32_t page_size);
+
+bool pager_interleave_frames(void* frames, size_t frames_size);
+
+void pager_map_frames(Pager* pager, bool huge_pages);
+
+Pager *pager_open(const char *filename, uint32_t page_size, bool huge_pages);
 
 void pager_flush(Pager* pager, uint32_t page_num);
+
+bool pager_set_direct_io(Pager* pager, bool direct_io);
+
+bool pager_snapshot_begin(Pager* pager);
+
+void pager_snapshot_save(Pager* pager, uint32_t page_num);
+
+bool pager_snapshot_in_file(Pager* pager, uint32_t page_num);
+
+void* pager_snapshot_page(Pager* pager, uint32_t page_num, void* buffer);
+
+void pager_snapshot_taken(Pager* pager, uint32_t first, uint32_t last);
+
+void pager_snapshot_end(Pager* pager);
+
+void pager_close(Pager* pager);
+
+void pager_free_page(Pager* pager, uint32_t page_num);
+
+void pager_move_page(Pager* pager, uint32_t from_page_num, uint32_t to_page_num);
+
+void pager_truncate(Pager* pager, uint32_t num_pages);
 #endif //SQLMINI_PAGER_H
@@ -0,0 +1,65 @@
+//
+// Created by aagu on 20-4-19.
+//
+
+#ifndef SQLMINI_PARALLEL_SCAN_H
+#define SQLMINI_PARALLEL_SCAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "table.h"
+
+/*
+ * Range scans split across worker threads. The internal nodes under the
+ * root are walked breadth first until a level has SCAN_SUBTREES_PER_THREAD
+ * subtrees per thread, so runs come out close in size, and the subtrees are
+ * dealt out in key order as one run per thread. A run is a contiguous
+ * stretch of the leaf chain. Runs outside the where clause are dropped
+ * before any thread starts.
+ *
+ * Workers only read: cached pages are shared, anything else is read into a
+ * buffer of the worker's own with pager_read_page(). The tree must not
+ * change while a scan runs, which holds as statements run one at a time.
+ * Results are put back together in key order by the calling thread.
+ */
+#define SCAN_MAX_THREADS 64
+static const uint32_t SCAN_SUBTREES_PER_THREAD = 4;
+static const uint32_t SCAN_MAX_SUBTREES = 4096;
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint32_t min_key; // valid when count > 0
+    uint32_t max_key;
+} ScanTotals;
+
+typedef struct {
+    Table* table;
+    WhereClause clause;
+    uint32_t first_page_num;
+    uint32_t first_cell_num;
+    uint32_t end_page_num; // first leaf of the next run, 0 for the end of the chain
+    bool count_only; // totals.count is all that is needed
+    uint32_t columns; // rows to print, 0 to only total keys
+    FILE* output; // rows as printed, in a buffer of the worker's own
+    char* output_buffer;
+    size_t output_size;
+    ScanTotals totals;
+    uint64_t leaves_visited; // leaves reached by following the leaf chain
+    uint64_t rows_examined;
+    uint64_t num_page_requests; // pager_read_page() calls
+    uint64_t num_page_reads; // pages read outside the cache
+    pthread_t thread;
+    bool started; // false when the run is scanned by the calling thread
+} ScanRun;
+
+uint32_t scan_partition(Table* table, WhereClause clause, uint32_t num_threads, ScanRun* runs);
+
+void* scan_run(void* argument);
+
+void parallel_aggregate(Table* table, WhereClause clause, bool count_only, ScanTotals* totals);
+
+uint64_t parallel_select(Table* table, WhereClause clause, uint32_t columns, FILE* output);
+#endif //SQLMINI_PARALLEL_SCAN_H
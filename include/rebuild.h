@@ -0,0 +1,56 @@
+//
+// Created by aagu on 20-4-23.
+//
+
+#ifndef SQLMINI_REBUILD_H
+#define SQLMINI_REBUILD_H
+
+#include <stdint.h>
+#include "table.h"
+
+/*
+ * Online rebuild of the tree. Live cells are copied in key order into fresh
+ * leaves at the end of the file, filled to a target percentage, so after
+ * splits and deletes have scattered the leaf chain it runs through
+ * consecutive pages again. The old tree is left alone until the copy is
+ * complete, so statements keep reading it between steps.
+ *
+ * A rebuild may be taken in steps. A step that sees Table.data_version
+ * changed drops the leaves copied so far and starts over. The last step
+ * lays internal levels over the new leaves and swaps the root in one go,
+ * then slides the new tree down to page 1 and cuts the file after it,
+ * which gives back the pages of the old tree.
+ */
+static const uint32_t REBUILD_DEFAULT_FILL_PERCENT = 90;
+static const uint32_t REBUILD_MIN_FILL_PERCENT = 50;
+
+typedef enum {
+    REBUILD_DONE,
+    REBUILD_MORE,
+    REBUILD_TABLE_FULL // no room for the old and the new tree side by side
+} RebuildResult;
+
+typedef struct {
+    Table* table;
+    uint32_t leaf_cells; // cells per new leaf
+    uint32_t internal_children; // children per new internal node
+    uint32_t data_version; // Table.data_version when the copy (re)started
+    uint32_t source_page_num; // old leaf holding the next live cell, 0 once all are copied
+    uint32_t source_cell_num;
+    uint32_t first_page_num; // new pages run from here to the end of the file
+    uint32_t num_leaves;
+    uint32_t capacity;
+    uint32_t* pages; // per new leaf, and per node of the level being built
+    uint32_t* max_keys;
+    uint32_t* counts; // NULL without subtree counts
+    uint32_t num_restarts;
+} Rebuild;
+
+Rebuild* rebuild_begin(Table* table, uint32_t fill_percent);
+
+RebuildResult rebuild_step(Rebuild* rebuild, uint32_t max_leaves);
+
+void rebuild_free(Rebuild* rebuild);
+
+RebuildResult table_rebuild(Table* table, uint32_t fill_percent);
+#endif //SQLMINI_REBUILD_H
@@ -9,10 +9,79 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "pager.h"
+#include "bloom_filter.h"
+#include "arena.h"
+
+/*
+ * Internal nodes passed on the way from the root down to a leaf, root first,
+ * and the index of the child taken in each. Rebalancing walks it backwards
+ * instead of searching the tree for parents and siblings.
+ */
+#define TREE_MAX_HEIGHT 32
 
 typedef struct {
+    uint32_t depth;
+    uint32_t page_num[TREE_MAX_HEIGHT];
+    uint32_t child_index[TREE_MAX_HEIGHT];
+} TreePath;
+
+typedef enum {
+    LEAF_FORMAT_ROW, // cells of key, flags and serialized row
+    LEAF_FORMAT_PAX // one minipage per column, see btree.h
+} LeafFormat;
+
+/*
+ * How many cells fit in a node for the database's page size and leaf format.
+ */
+typedef struct {
+    uint32_t page_size;
+    LeafFormat leaf_format;
+    uint32_t leaf_space_for_cells;
+    uint32_t leaf_max_cells;
+    uint32_t leaf_left_split_count;
+    uint32_t leaf_min_cells;
+    uint32_t internal_max_cells;
+    uint32_t internal_left_split_count;
+    uint32_t internal_min_keys;
+    bool subtree_counts; // internal nodes keep a row count per child, see btree.h
+    // Where cell keys and flags are in a leaf of leaf_format, see layout_leaf_key()
+    uint32_t leaf_keys_offset;
+    uint32_t leaf_key_stride;
+    uint32_t leaf_flags_offset;
+    uint32_t leaf_flags_stride;
+} NodeLayout;
+
+/*
+ * Work done on the tree, for explain analyze. Counters only grow; what a
+ * statement cost is the difference across it.
+ */
+typedef struct {
+    uint64_t descents; // searches from the root down to a leaf
+    uint64_t internal_nodes_visited; // internal nodes passed by those searches
+    uint64_t hot_leaf_hits; // searches answered by the last leaf reached instead
+    uint64_t index_lookups; // point lookups through the hash index
+    uint64_t leaves_visited; // leaves reached by following the leaf chain
+    uint64_t rows_examined; // rows or keys read by a scan, whether selected or not
+    uint64_t rows_returned;
+} QueryCounters;
+
+typedef struct {
+    const char* filename;
     Pager* pager;
     uint32_t root_page_num;
+    NodeLayout layout;
+    Pager* hash_index; // NULL when the hash index is disabled
+    BloomFilter* key_filter;
+    uint32_t hot_leaf_page_num; // last leaf reached by a descent, 0 when unknown
+    TreePath hot_leaf_path;
+    uint32_t hot_leaf_version; // tree_version when hot_leaf_path was recorded
+    uint32_t tree_version; // bumped whenever children move between internal nodes
+    uint32_t data_version; // bumped by every statement that changes rows, see rebuild.h
+    Arena* arena; // cursors and scratch memory, reset after every statement
+    bool lazy_delete; // delete marks tombstones and leaves rebalancing to compact_tree()
+    uint32_t num_tombstones;
+    uint32_t scan_threads; // threads a large select or aggregate is split across, see parallel_scan.h
+    QueryCounters counters;
 } Table;
 
 typedef struct {
@@ -20,17 +89,38 @@ typedef struct {
     uint32_t page_num;
     uint32_t cell_num;
     bool end_of_table; // Indicates a position one past the last element
+    TreePath path; // depth 0 for a leaf reached without a descent
 } Cursor;
 
 Cursor* table_start(Table* table);
 
+uint32_t leftmost_leaf(Table* table, uint32_t page_num);
+
 Cursor* table_find(Table* table, uint32_t key);
 
+Cursor* table_index_find(Table* table, uint32_t key);
+
+Cursor* table_lookup(Table* table, uint32_t key);
+
+bool table_max_key(Table* table, uint32_t* key);
+
+uint64_t table_count_rows(Table* table);
+
+uint64_t table_rank(Table* table, uint32_t key);
+
+Cursor* table_seek_rank(Table* table, uint64_t rank);
+
+void cursor_skip_rows(Cursor* cursor, uint64_t num_rows);
+
+void table_rebuild_filter(Table* table);
+
 Cursor* table_remove(Table* table, uint32_t key);
 
-void* cursor_value(Cursor* cursor);
+void cursor_read_row(Cursor* cursor, Row* row, uint32_t columns);
 
 void cursor_advance(Cursor* cursor);
 
+void cursor_skip_tombstones(Cursor* cursor);
+
 void cursor_delete(Cursor* cursor);
 #endif //SQLMINI_TABLE_H
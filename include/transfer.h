@@ -0,0 +1,50 @@
+//
+// Created by aagu on 20-4-12.
+//
+
+#ifndef SQLMINI_TRANSFER_H
+#define SQLMINI_TRANSFER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "table.h"
+
+/*
+ * Streaming import and export of whole tables, as CSV (id,username,email
+ * with RFC 4180 quoting) or as a compact binary row format:
+ *
+ *   "SQLMROW1" then per row: id (uint32), username length (uint8) and bytes,
+ *   email length (uint8) and bytes.
+ *
+ * Files go through large buffers and fields are parsed by hand. Imported
+ * rows are fed to execute_insert_batch() TRANSFER_BATCH_ROWS at a time.
+ */
+static const uint32_t TRANSFER_BUFFER_SIZE = 1 << 20;
+static const uint32_t TRANSFER_BATCH_ROWS = 4096;
+static const char TRANSFER_BINARY_MAGIC[8] = {'S', 'Q', 'L', 'M', 'R', 'O', 'W', '1'};
+
+typedef enum {
+    TRANSFER_CSV,
+    TRANSFER_BINARY
+} TransferFormat;
+
+typedef enum {
+    TRANSFER_SUCCESS,
+    TRANSFER_IO_ERROR,
+    TRANSFER_PARSE_ERROR,
+    TRANSFER_DUPLICATE_KEY
+} TransferResult;
+
+typedef struct {
+    uint64_t num_rows; // rows written to the table or the file
+    uint64_t line; // CSV line or binary row number where parsing stopped
+} TransferStats;
+
+bool transfer_parse_format(const char* name, TransferFormat* format);
+
+TransferResult table_import(Table* table, const char* path, TransferFormat format, TransferStats* stats);
+
+TransferResult table_export(Table* table, const char* path, TransferFormat format, TransferStats* stats);
+
+void transfer_print_result(const char* verb, const char* path, TransferResult result, TransferStats* stats);
+#endif //SQLMINI_TRANSFER_H
@@ -0,0 +1,36 @@
+//
+// Created by aagu on 20-4-27.
+//
+
+#ifndef SQLMINI_UPGRADE_H
+#define SQLMINI_UPGRADE_H
+
+#include <stdint.h>
+#include "table.h"
+
+/*
+ * Files written before file headers (format version 0) cannot be opened,
+ * see pager_read_header(). Their layout is fixed: 4096 byte pages, the root
+ * at page 0, a 6 byte common node header that still holds a parent pointer,
+ * and leaf cells of key and serialized row with no flags. table_upgrade()
+ * walks the leaf chain of such a file and inserts its rows into a table,
+ * TRANSFER_BATCH_ROWS at a time.
+ */
+static const uint32_t LEGACY_PAGE_SIZE = 4096;
+static const uint32_t LEGACY_NODE_HEADER_SIZE = 6;
+static const uint32_t LEGACY_LEAF_NODE_NUM_CELLS_OFFSET = LEGACY_NODE_HEADER_SIZE;
+static const uint32_t LEGACY_LEAF_NODE_NEXT_LEAF_OFFSET = LEGACY_LEAF_NODE_NUM_CELLS_OFFSET + sizeof(uint32_t);
+static const uint32_t LEGACY_LEAF_NODE_HEADER_SIZE = LEGACY_LEAF_NODE_NEXT_LEAF_OFFSET + sizeof(uint32_t);
+static const uint32_t LEGACY_INTERNAL_NODE_NUM_KEYS_OFFSET = LEGACY_NODE_HEADER_SIZE;
+static const uint32_t LEGACY_INTERNAL_NODE_HEADER_SIZE = LEGACY_INTERNAL_NODE_NUM_KEYS_OFFSET + 2 * sizeof(uint32_t);
+
+typedef enum {
+    UPGRADE_SUCCESS,
+    UPGRADE_IO_ERROR,
+    UPGRADE_NOT_LEGACY, // has a file header already, or is empty
+    UPGRADE_CORRUPT,
+    UPGRADE_INSERT_FAILED // the table is full or already holds one of the ids
+} UpgradeResult;
+
+UpgradeResult table_upgrade(Table* table, const char* legacy_path, uint64_t* num_rows);
+#endif //SQLMINI_UPGRADE_H
@@ -10,4 +10,6 @@
 void apply_where(char* where_clause, Statement* statement);
 
 uint8_t where_constrain_satisfied(Row* row, WhereClause clause);
+
+uint8_t where_key_satisfied(uint32_t id, WhereClause clause);
 #endif //SQLMINI_UTILS_H
@@ -1,11 +1,11 @@
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db.hidx test.csv test_backup.db test_stats.json`
   end
 
-  def run_script(commands)
+  def run_script(commands, options = "")
     raw_output = nil
-    IO.popen("./db test.db", "r+") do |pipe|
+    IO.popen("./db test.db #{options}", "r+") do |pipe|
       commands.each do |command|
         begin
           pipe.puts command
@@ -166,7 +166,7 @@ describe 'database' do
     expect(result[14...(result.length)]).to match_array([
       "db > Tree:",
       "- internal (size 1)",
-      "  - leaf (size 7)",
+      "  - leaf (size 13)",
       "    - 1",
       "    - 2",
       "    - 3",
@@ -174,14 +174,14 @@ describe 'database' do
       "    - 5",
       "    - 6",
       "    - 7",
-      "  - key 7",
-      "  - leaf (size 7)",
       "    - 8",
       "    - 9",
       "    - 10",
       "    - 11",
       "    - 12",
       "    - 13",
+      "  - key 13",
+      "  - leaf (size 1)",
       "    - 14",
       "db > Executed.",
       "db > ",
@@ -279,15 +279,342 @@ describe 'database' do
     expect(result).to match_array([
       "db > Constants:",
       "ROW_SIZE: 293",
-      "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 14",
-      "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4082",
+      "COMMON_NODE_HEADER_SIZE: 2",
+      "LEAF_NODE_HEADER_SIZE: 10",
+      "LEAF_NODE_CELL_SIZE: 298",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4086",
       "LEAF_NODE_MAX_CELLS: 13",
       "db > ",
     ])
   end
 
+  it 'keeps the page size chosen when the database was created' do
+    run_script([".exit"], "--page-size 16384")
+    result = run_script([".constants", ".exit"])
+
+    expect(result).to match_array([
+      "db > Constants:",
+      "ROW_SIZE: 293",
+      "COMMON_NODE_HEADER_SIZE: 2",
+      "LEAF_NODE_HEADER_SIZE: 10",
+      "LEAF_NODE_CELL_SIZE: 298",
+      "LEAF_NODE_SPACE_FOR_CELLS: 16374",
+      "LEAF_NODE_MAX_CELLS: 54",
+      "db > ",
+    ])
+  end
+
+  it 'selects only the columns asked for' do
+    script = (1..3).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "select email,id where id>=2"
+    script << "select username"
+    script << "select name"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[3...result.length]).to match_array([
+      "db > (2, person2@example.com)",
+      "(3, person3@example.com)",
+      "2 rows",
+      "Executed.",
+      "db > (user1)",
+      "(user2)",
+      "(user3)",
+      "3 rows",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'reads and writes the same rows with direct io' do
+    script = (1..40).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".exit"
+    run_script(script, "--direct-io")
+
+    result = run_script(["select id,username where id>=39", ".exit"], "--direct-io")
+    expect(result).to match_array([
+      "db > (39, user39)",
+      "(40, user40)",
+      "2 rows",
+      "Executed.",
+      "db > ",
+    ])
+
+    result = run_script(["select id,username where id=40", ".exit"])
+    expect(result).to match_array([
+      "db > (40, user40)",
+      "1 row",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps rows in pax leaves across splits and reopening' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "delete 7"
+    script << ".exit"
+    run_script(script, "--pax")
+
+    result = run_script(["select id,username where id>=28", "select * where id=7", ".exit"])
+    expect(result).to match_array([
+      "db > (28, user28)",
+      "(29, user29)",
+      "(30, user30)",
+      "3 rows",
+      "Executed.",
+      "db > 0 row",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'answers aggregates over id' do
+    script = (1..20).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "delete 20"
+    script << "select count(*)"
+    script << "select min(id)"
+    script << "select max(id)"
+    script << "select sum(id) where id<=4"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[21...result.length]).to match_array([
+      "db > (19)",
+      "1 row",
+      "Executed.",
+      "db > (1)",
+      "1 row",
+      "Executed.",
+      "db > (19)",
+      "1 row",
+      "Executed.",
+      "db > (10)",
+      "1 row",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'gives the same answers with a parallel scan' do
+    script = (1..60).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "delete 30"
+    script << ".parallel 4"
+    script << "select id where id>=26"
+    script << "select count(*)"
+    script << "select sum(id) where id<10"
+    script << ".parallel 0"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[61...result.length]).to eq([
+      "db > db > (26)",
+      "(27)",
+      "(28)",
+      "(29)",
+      "(31)",
+      "(32)",
+      "(33)",
+      "(34)",
+      "(35)",
+      "(36)",
+      "(37)",
+      "(38)",
+      "(39)",
+      "(40)",
+      "(41)",
+      "(42)",
+      "(43)",
+      "(44)",
+      "(45)",
+      "(46)",
+      "(47)",
+      "(48)",
+      "(49)",
+      "(50)",
+      "(51)",
+      "(52)",
+      "(53)",
+      "(54)",
+      "(55)",
+      "(56)",
+      "(57)",
+      "(58)",
+      "(59)",
+      "(60)",
+      "34 rows",
+      "Executed.",
+      "db > (59)",
+      "1 row",
+      "Executed.",
+      "db > (45)",
+      "1 row",
+      "Executed.",
+      "db > Error: scan threads must be from 1 to 64.",
+      "db > ",
+    ])
+  end
+
+  it 'explains how a select runs and what it cost' do
+    script = (1..20).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "delete 7"
+    script << "explain select id,email where id>=5 limit 2"
+    script << "explain analyze select count(*) where id<=10"
+    script << "explain update 1"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[21...result.length].reject { |line| line.start_with?("time:") }).to eq([
+      "db > plan: seek to id 5, then scan the leaf chain",
+      "limit: 2 rows",
+      "columns: id email",
+      "tree: height 2, row leaves",
+      "Executed.",
+      "db > plan: full scan from the first leaf",
+      "stop: at the first id not <= 10",
+      "aggregate: count(*)",
+      "tree: height 2, row leaves",
+      "rows: 1 returned, 10 examined",
+      "pages: 8 requested, 0 read from the file, 100.0% cache hits",
+      "descents: 1 through 1 internal nodes, 0 hot leaf hits, 0 index lookups",
+      "leaves followed: 0",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps statement and tree metrics' do
+    script = (1..20).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "select count(*)"
+    script << ".stats"
+    script << ".stats json test_stats.json"
+    script << ".exit"
+    result = run_script(script)
+    counts = result.map { |line| line.sub("db > ", "").split[0..1] }
+    expect(counts).to include(["insert", "20"], ["insert_values", "0"], ["select", "1"], ["delete", "0"])
+    expect(result).to include(
+      "tree: 1 leaf_splits, 0 internal_splits, 0 leaf_merges, 0 internal_merges, " \
+      "0 leaf_borrows, 0 internal_borrows, 0 root_collapses, 0 compactions, 0 rebuilds",
+      "db > Wrote stats to 'test_stats.json'.",
+    )
+    expect(File.read("test_stats.json")).to include('"insert": {"count": 20,', '"leaf_splits": 1,')
+  end
+
+  it 'reports the health of the tree' do
+    script = (1..30).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".lazydelete on"
+    script << "delete 3"
+    script << ".analyze"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[31...result.length]).to eq([
+      "db > height: 2",
+      "level 0: 1 internal node",
+      "level 1: 3 leaves",
+      "leaves: 3, fill avg 76.9% min 30.8%",
+      "internal nodes: 1, fill avg 75.0% min 75.0%",
+      "cells: 30, 1 tombstones",
+      "leaf chain: 2 steps, 0 to the next page, 1 forward jumps, 1 backward jumps, 100.0% out of order",
+      "pages: 6 in the file, 4 in the tree, 1 free, 0 unused (0.0%)",
+      "db > ",
+    ])
+  end
+
+  it 'places new leaves next to their neighbours and reuses freed pages' do
+    script = (1..100).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".analyze"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include(
+      "leaf chain: 7 steps, 5 to the next page, 1 forward jumps, 1 backward jumps, 28.6% out of order",
+      "pages: 13 in the file, 12 in the tree, 0 free, 0 unused (0.0%)",
+    )
+
+    script = (1..60).map { |i| "delete #{i}" }
+    script << ".analyze"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include("pages: 13 in the file, 7 in the tree, 5 free, 0 unused (0.0%)")
+  end
+
+  it 'rebuilds the tree into consecutive pages' do
+    script = 60.downto(1).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".rebuild 40"
+    script << ".rebuild"
+    script << ".analyze"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include(
+      "db > Error: fill must be from 50 to 100 percent.",
+      "db > Rebuilt tree in 9 pages, was 12.",
+      "leaves: 6, fill avg 76.9% min 61.5%",
+      "leaf chain: 5 steps, 5 to the next page, 0 forward jumps, 0 backward jumps, 0.0% out of order",
+      "pages: 10 in the file, 9 in the tree, 0 free, 0 unused (0.0%)",
+    )
+
+    result = run_script(["select count(*)", "select * where id=37", ".exit"])
+    expect(result).to include("db > (60)", "db > (37, user37, person37@example.com)")
+  end
+
+  it 'restarts a stepped rebuild after a write and ends with the rows written' do
+    script = 60.downto(1).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".rebuild 90 1"
+    script << ".rebuild"
+    script << "insert 61 user61 person61@example.com"
+    script << "delete 30"
+    script += ["select count(*)"] * 8
+    script << ".analyze"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include(
+      "db > Rebuilding tree, 1 leaves per step.",
+      "db > Error: a rebuild is already running.",
+      "Rebuilt tree in 9 pages, was 12, after 2 restarts.",
+      "leaf chain: 5 steps, 5 to the next page, 0 forward jumps, 0 backward jumps, 0.0% out of order",
+    )
+
+    result = run_script(["select count(*)", "select * where id=30", "select * where id=61", ".exit"])
+    expect(result).to include("db > (60)", "db > 0 row", "db > (61, user61, person61@example.com)")
+  end
+
+  it 'counts rows when the first leaf holds only tombstones' do
+    script = (1..40).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".lazydelete on"
+    script += (1..13).map { |i| "delete #{i}" }
+    script << ".count"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[-2...result.length]).to eq(["db > 27 rows", "db > "])
+  end
+
+  it 'pages through rows with limit and offset' do
+    script = (1..40).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "delete 5"
+    script << ".exit"
+    run_script(script, "--counts")
+
+    result = run_script([
+      "select id limit 3 offset 4",
+      "select id where id>=30 limit 2 offset 5",
+      ".count",
+      "select count(*) where id<=10",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > (6)",
+      "(7)",
+      "(8)",
+      "3 rows",
+      "Executed.",
+      "db > (35)",
+      "(36)",
+      "2 rows",
+      "Executed.",
+      "db > 39 rows",
+      "db > (9)",
+      "1 row",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
   it 'prints all rows in a multi-level tree' do
     script = []
     (1..15).each do |i|
@@ -315,4 +642,284 @@ describe 'database' do
       "Executed.", "db > ",
     ])
   end
+
+  it 'answers point lookups and duplicate checks through the hash index' do
+    script = [
+      ".hashindex",
+    ]
+    (1..20).each do |i|
+      script << "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "insert 7 user7 person7@example.com"
+    script << "select * where id=7"
+    script << "select * where id=21"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[20...result.length]).to match_array([
+      "db > Error: Duplicate key.",
+      "db > (7, user7, person7@example.com)",
+      "1 row",
+      "Executed.",
+      "db > 0 row",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'collapses the tree back into a single leaf after deleting most rows' do
+    script = (1..40).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    (1..35).each do |i|
+      script << "delete #{i}"
+    end
+    script << ".btree"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[75...result.length]).to match_array([
+      "db > Tree:",
+      "- leaf (size 5)",
+      "  - 36",
+      "  - 37",
+      "  - 38",
+      "  - 39",
+      "  - 40",
+      "db > (36, user36, person36@example.com)",
+      "(37, user37, person37@example.com)",
+      "(38, user38, person38@example.com)",
+      "(39, user39, person39@example.com)",
+      "(40, user40, person40@example.com)",
+      "5 rows",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'hides lazily deleted rows until compaction removes them' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".lazydelete on"
+    (1..8).each do |i|
+      script << "delete #{i}"
+    end
+    script << "select * where id=3"
+    script << ".compact"
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[28...result.length]).to match_array([
+      "db > 0 row",
+      "Executed.",
+      "db > Freed 2 pages.",
+      "db > Tree:",
+      "- leaf (size 12)",
+      "  - 9",
+      "  - 10",
+      "  - 11",
+      "  - 12",
+      "  - 13",
+      "  - 14",
+      "  - 15",
+      "  - 16",
+      "  - 17",
+      "  - 18",
+      "  - 19",
+      "  - 20",
+      "db > ",
+    ])
+  end
+
+  it 'compacts away a leading leaf of tombstones' do
+    script = (1..40).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".lazydelete on"
+    script += (1..13).map { |i| "delete #{i}" }
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([".parallel 2", "select count(*)", ".compact", ".analyze", ".exit"])
+    expect(result).to include(
+      "db > db > (27)",
+      "db > Freed 1 pages.",
+      "cells: 27, 0 tombstones",
+      "pages: 6 in the file, 4 in the tree, 1 free, 0 unused (0.0%)",
+    )
+  end
+
+  it 'inserts several rows with one insert values statement' do
+    script = [
+      "insert values (3, user3, person3@example.com), (1, user1, person1@example.com), (2, user2, person2@example.com)",
+      "insert values (4, user4, person4@example.com), (2, user2, person2@example.com)",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "(3, user3, person3@example.com)",
+      "3 rows",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'exports rows to csv and imports them back' do
+    script = [
+      "insert 2 user2 person2@example.com",
+      "insert 1 user1 person1@example.com",
+      ".export csv test.csv",
+      ".exit",
+    ]
+    run_script(script)
+    expect(File.read("test.csv")).to eq("id,username,email\n1,user1,person1@example.com\n2,user2,person2@example.com\n")
+
+    `rm -rf test.db test.db.hidx`
+    script = [
+      ".import csv test.csv",
+      ".import csv test.csv",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Imported 2 rows.",
+      "db > Error: Duplicate key. Imported 0 rows.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "2 rows",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'backs up a snapshot of the database while it stays open' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      ".backup test_backup.db",
+      "insert 3 user3 person3@example.com",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Backed up 2 pages.",
+      "db > Executed.",
+      "db > ",
+    ])
+
+    `mv test_backup.db test.db`
+    result = run_script(["select", ".exit"])
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "2 rows",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps the snapshot of a stepped backup while statements change the tree' do
+    script = (1..100).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".backup test_backup.db 1"
+    script << "delete 1"
+    script << "delete 50"
+    script << ".compact"
+    script += (101..120).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include(
+      "db > Backing up 13 pages, 1 per step.",
+      "db > Freed 1 pages.",
+      "Backed up 13 pages.",
+    )
+
+    result = run_script(["select count(*)", "select * where id=1", ".exit"])
+    expect(result).to include("db > (118)", "db > 0 row")
+
+    `mv test_backup.db test.db`
+    result = run_script([
+      "select count(*)",
+      "select * where id=50",
+      "select * where id=101",
+      ".exit",
+    ])
+    expect(result).to include("db > (100)", "db > (50, user50, person50@example.com)", "db > 0 row")
+  end
+
+  it 'refuses to back up over the open database or its hash index' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      ".backup test.db",
+      ".backup test.db.hidx",
+      "insert 2 user2 person2@example.com",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Error: could not back up to 'test.db'.",
+      "db > Error: could not back up to 'test.db.hidx'.",
+      "db > Executed.",
+      "db > ",
+    ])
+
+    result = run_script(["select", ".exit"])
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "2 rows",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'rebuilds the hash index when a backup is restored under it' do
+    script = [
+      ".hashindex",
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      ".backup test_backup.db",
+      "delete 2",
+      ".exit",
+    ]
+    run_script(script)
+
+    `mv test_backup.db test.db`
+    result = run_script([
+      "select * where id=2",
+      "insert 2 user2 person2@example.com",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > (2, user2, person2@example.com)",
+      "1 row",
+      "Executed.",
+      "db > Error: Duplicate key.",
+      "db > ",
+    ])
+  end
+
+  it 'stores pages compressed and reads them back' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".compression on"
+    script << ".exit"
+    run_script(script)
+    expect(File.size("test.db")).to be < 4096 * 2
+
+    result = run_script(["select * where id=30", ".exit"])
+    expect(result).to match_array([
+      "db > (30, user30, person30@example.com)",
+      "1 row",
+      "Executed.",
+      "db > ",
+    ])
+  end
 end
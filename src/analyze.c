@@ -0,0 +1,121 @@
+//
+// Created by aagu on 20-4-22.
+//
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "analyze.h"
+#include "btree.h"
+
+void node_fill_add(NodeFill* fill, uint32_t num_entries, uint32_t capacity) {
+    double ratio = capacity > 0 ? (double) num_entries / capacity : 0;
+    uint32_t bucket = (uint32_t) (ratio * ANALYZE_FILL_BUCKETS);
+    if (bucket >= ANALYZE_FILL_BUCKETS) bucket = ANALYZE_FILL_BUCKETS - 1;
+
+    if (fill->num_nodes == 0 || ratio < fill->min_fill) fill->min_fill = ratio;
+    fill->num_nodes += 1;
+    fill->num_entries += num_entries;
+    fill->fill_sum += ratio;
+    fill->fill_histogram[bucket] += 1;
+}
+
+void analyze_node(Table* table, uint32_t page_num, uint32_t level, TreeHealth* health) {
+    void* node = get_page(table->pager, page_num);
+    health->tree_pages += 1;
+    health->nodes_per_level[level] += 1;
+    if (level + 1 > health->height) health->height = level + 1;
+
+    if (get_node_type(node) == NODE_LEAF) {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        node_fill_add(&health->leaves, num_cells, table->layout.leaf_max_cells);
+        for (uint32_t i = 0; i < num_cells; i++) {
+            if (layout_leaf_is_tombstone(&table->layout, node, i)) health->num_tombstones += 1;
+        }
+        return;
+    }
+
+    uint32_t num_keys = *internal_node_num_keys(node);
+    node_fill_add(&health->internal_nodes, num_keys + 1, table->layout.internal_max_cells + 1);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        analyze_node(table, *internal_node_child(node, i), level + 1, health);
+    }
+}
+
+void analyze_tree(Table* table, TreeHealth* health) {
+    memset(health, 0, sizeof(TreeHealth));
+    analyze_node(table, table->root_page_num, 0, health);
+    health->num_pages = table->pager->num_pages;
+    health->free_pages = pager_num_free_pages(table->pager);
+
+    uint32_t page_num = leftmost_leaf(table, table->root_page_num);
+    while (page_num != 0) {
+        health->chain_leaves += 1;
+        uint32_t next_page_num = *leaf_node_next_leaf(get_page(table->pager, page_num));
+        if (next_page_num != 0) {
+            health->chain_steps += 1;
+            if (next_page_num == page_num + 1) {
+                health->chain_in_order += 1;
+            } else if (next_page_num > page_num) {
+                health->chain_forward_jumps += 1;
+            } else {
+                health->chain_backward_jumps += 1;
+            }
+        }
+        page_num = next_page_num;
+    }
+}
+
+void print_node_fill(const char* name, NodeFill* fill, bool histogram) {
+    if (fill->num_nodes == 0) {
+        printf("%s: 0\n", name);
+        return;
+    }
+    printf("%s: %d, fill avg %.1f%% min %.1f%%\n", name, fill->num_nodes,
+           100.0 * fill->fill_sum / fill->num_nodes, 100.0 * fill->min_fill);
+    if (!histogram) return;
+
+    uint32_t fullest = 1;
+    for (uint32_t i = 0; i < ANALYZE_FILL_BUCKETS; i++) {
+        if (fill->fill_histogram[i] > fullest) fullest = fill->fill_histogram[i];
+    }
+    for (uint32_t i = 0; i < ANALYZE_FILL_BUCKETS; i++) {
+        uint32_t low = i * 100 / ANALYZE_FILL_BUCKETS;
+        uint32_t high = (i + 1) * 100 / ANALYZE_FILL_BUCKETS;
+        printf("  %3d-%3d%% %8d ", low, high, fill->fill_histogram[i]);
+        // Bars scaled to 40 characters for the fullest bucket
+        uint32_t width = (uint32_t) ((uint64_t) fill->fill_histogram[i] * 40 / fullest);
+        for (uint32_t w = 0; w < width; w++) putchar('#');
+        putchar('\n');
+    }
+}
+
+void print_tree_health(TreeHealth* health, bool histogram) {
+    printf("height: %d\n", health->height);
+    for (uint32_t level = 0; level < health->height; level++) {
+        uint32_t num_nodes = health->nodes_per_level[level];
+        const char* kind = level + 1 == health->height ? (num_nodes == 1 ? "leaf" : "leaves") :
+                           (num_nodes == 1 ? "internal node" : "internal nodes");
+        printf("level %d: %d %s\n", level, num_nodes, kind);
+    }
+    print_node_fill("leaves", &health->leaves, histogram);
+    print_node_fill("internal nodes", &health->internal_nodes, histogram);
+    printf("cells: %" PRIu64 ", %" PRIu64 " tombstones\n", health->leaves.num_entries, health->num_tombstones);
+
+    double out_of_order = health->chain_steps > 0 ?
+                          100.0 * (health->chain_steps - health->chain_in_order) / health->chain_steps : 0;
+    printf("leaf chain: %d steps, %d to the next page, %d forward jumps, %d backward jumps, %.1f%% out of order\n",
+           health->chain_steps, health->chain_in_order, health->chain_forward_jumps,
+           health->chain_backward_jumps, out_of_order);
+    if (health->chain_leaves != health->leaves.num_nodes) {
+        printf("warning: %d leaves along the chain but %d in the tree\n",
+               health->chain_leaves, health->leaves.num_nodes);
+    }
+
+    // Page 0 is the file header. Unused pages are neither in the tree nor free to reuse.
+    uint32_t used = health->tree_pages + health->free_pages;
+    uint32_t unused = health->num_pages > used ? health->num_pages - 1 - used : 0;
+    printf("pages: %d in the file, %d in the tree, %d free, %d unused (%.1f%%)\n", health->num_pages,
+           health->tree_pages, health->free_pages, unused,
+           health->num_pages > 1 ? 100.0 * unused / (health->num_pages - 1) : 0);
+}
@@ -0,0 +1,78 @@
+//
+// Created by aagu on 20-4-08.
+//
+
+#include <stdlib.h>
+#include "arena.h"
+
+// Block header rounded up so the data area is aligned like malloc's
+static const size_t ARENA_BLOCK_HEADER_SIZE =
+        (sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+ArenaBlock* arena_block_new(Arena* arena, size_t size) {
+    ArenaBlock* block = malloc(ARENA_BLOCK_HEADER_SIZE + size);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    arena->num_heap_allocations += 1;
+    return block;
+}
+
+void* arena_block_data(ArenaBlock* block) {
+    return (char*)block + ARENA_BLOCK_HEADER_SIZE;
+}
+
+Arena* arena_new() {
+    Arena* arena = malloc(sizeof(Arena));
+    arena->num_allocations = 0;
+    arena->num_heap_allocations = 0;
+    arena->head = arena_block_new(arena, ARENA_BLOCK_SIZE);
+    return arena;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    arena->num_allocations += 1;
+
+    ArenaBlock* block = arena->head;
+    if (block->used + size > block->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = arena_block_new(arena, block_size);
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    void* pointer = (char*)arena_block_data(block) + block->used;
+    block->used += size;
+    return pointer;
+}
+
+/*
+ * Release everything allocated since the last reset. If the statement
+ * needed more than one block, replace them with a single block big enough
+ * for all of it so the next statement fits without growing.
+ */
+void arena_reset(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    if (block->next != NULL) {
+        size_t total_size = 0;
+        while (block != NULL) {
+            ArenaBlock* next = block->next;
+            total_size += block->size;
+            free(block);
+            block = next;
+        }
+        arena->head = arena_block_new(arena, total_size);
+    }
+    arena->head->used = 0;
+}
+
+void arena_free(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
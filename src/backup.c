@@ -0,0 +1,236 @@
+//
+// Created by aagu on 20-4-14.
+//
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zconf.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "backup.h"
+#include "database.h"
+
+bool same_file(struct stat* a, struct stat* b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+/*
+ * Whether writing path would clobber the open database or its hash index.
+ * The pager keeps writing through its file descriptor, so a copy renamed
+ * over the database leaves every later change in an unlinked file.
+ */
+bool backup_overwrites_table(Table* table, const char* path) {
+    char* index_filename = hash_index_filename(table->filename);
+    bool overwrites = strcmp(path, table->filename) == 0 || strcmp(path, index_filename) == 0;
+
+    struct stat target;
+    struct stat live;
+    if (!overwrites && stat(path, &target) == 0) {
+        overwrites = (fstat(table->pager->file_descriptor, &live) == 0 && same_file(&target, &live)) ||
+                     (table->hash_index != NULL && fstat(table->hash_index->file_descriptor, &live) == 0 &&
+                      same_file(&target, &live)) ||
+                     (stat(index_filename, &live) == 0 && same_file(&target, &live));
+    }
+    free(index_filename);
+    return overwrites;
+}
+
+/*
+ * Start a backup of table into path. Returns NULL when the temporary file
+ * cannot be created, path or its temporary file is the database or its
+ * hash index, or another backup is running.
+ */
+Backup* backup_begin(Table* table, const char* path) {
+    if (table->pager->snapshot != NULL || backup_overwrites_table(table, path)) {
+        return NULL;
+    }
+    Backup* backup = malloc(sizeof(Backup));
+    backup->table = table;
+    backup->path = strdup(path);
+    backup->temp_path = malloc(strlen(path) + strlen(".tmp") + 1);
+    strcpy(backup->temp_path, path);
+    strcat(backup->temp_path, ".tmp");
+    if (backup_overwrites_table(table, backup->temp_path)) {
+        free(backup->temp_path);
+        free(backup->path);
+        free(backup);
+        return NULL;
+    }
+
+    backup->file_descriptor = open(backup->temp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (backup->file_descriptor == -1) {
+        free(backup->temp_path);
+        free(backup->path);
+        free(backup);
+        return NULL;
+    }
+
+    // pread() on an O_DIRECT file needs an aligned buffer
+    if (posix_memalign(&backup->buffer, table->pager->page_size, BACKUP_RUN_PAGES * table->pager->page_size) != 0) {
+        printf("Unable to allocate a backup buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+    pager_snapshot_begin(table->pager);
+    backup->num_pages = table->pager->num_pages;
+    backup->next_page_num = 0;
+    return backup;
+}
+
+bool backup_write(int fd, void* source, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t bytes_written = pwrite(fd, source, size, offset);
+        if (bytes_written <= 0) {
+            return false;
+        }
+        source += bytes_written;
+        size -= bytes_written;
+        offset += bytes_written;
+    }
+    return true;
+}
+
+/*
+ * Copy pages that are only on disk without passing them through user
+ * space where the kernel allows it.
+ */
+bool backup_copy_from_file(Backup* backup, uint32_t page_num, uint32_t num_pages) {
+    Pager* pager = backup->table->pager;
+    off_t offset = (off_t) page_num * pager->page_size;
+    size_t size = (size_t) num_pages * pager->page_size;
+
+#ifdef __linux__
+    off_t in_offset = offset;
+    off_t out_offset = offset;
+    while (size > 0) {
+        ssize_t bytes_copied = copy_file_range(pager->file_descriptor, &in_offset,
+                                               backup->file_descriptor, &out_offset, size, 0);
+        if (bytes_copied <= 0) break;
+        size -= bytes_copied;
+    }
+    if (size == 0) {
+        return true;
+    }
+    offset = in_offset;
+#endif
+
+    // Not supported here (or cut short), copy through the buffer
+    while (size > 0) {
+        size_t buffer_size = BACKUP_RUN_PAGES * pager->page_size;
+        size_t chunk = size < buffer_size ? size : buffer_size;
+        ssize_t bytes_read = pread(pager->file_descriptor, backup->buffer, chunk, offset);
+        if (bytes_read <= 0 || !backup_write(backup->file_descriptor, backup->buffer, bytes_read, offset)) {
+            return false;
+        }
+        size -= bytes_read;
+        offset += bytes_read;
+    }
+    return true;
+}
+
+/*
+ * Copy up to max_pages more pages. Returns BACKUP_MORE while pages are left,
+ * BACKUP_DONE once the snapshot is complete.
+ */
+BackupResult backup_step(Backup* backup, uint32_t max_pages) {
+    Pager* pager = backup->table->pager;
+    uint32_t page_size = pager->page_size;
+    uint32_t file_pages = pager->file_length / page_size;
+    uint32_t end = backup->num_pages;
+    if (max_pages < end - backup->next_page_num) {
+        end = backup->next_page_num + max_pages;
+    }
+
+    while (backup->next_page_num < end) {
+        uint32_t first = backup->next_page_num;
+        uint32_t last = first;
+
+        if (!pager_snapshot_in_file(pager, first)) {
+            // Gather saved, cached and compressed pages into one write
+            while (last < end && last - first < BACKUP_RUN_PAGES && !pager_snapshot_in_file(pager, last)) {
+                void* slot = backup->buffer + (last - first) * page_size;
+                void* page = pager_snapshot_page(pager, last, slot);
+                if (page != slot) {
+                    memcpy(slot, page, page_size);
+                }
+                last++;
+            }
+            if (first == FILE_HEADER_PAGE_NUM) {
+                // The copy always holds plain pages
+                void* header = backup->buffer;
+                *file_header_flags(header) &= ~FILE_FLAG_COMPRESSED;
+                *file_header_extent_map(header) = 0;
+                *file_header_num_extents(header) = 0;
+            }
+            if (!backup_write(backup->file_descriptor, backup->buffer, (last - first) * page_size,
+                              (off_t) first * page_size)) {
+                return BACKUP_ERROR;
+            }
+        } else {
+            while (last < end && pager_snapshot_in_file(pager, last)) {
+                last++;
+            }
+            // Freed pages past the end of the file stay a hole in the copy
+            uint32_t file_last = last < file_pages ? last : file_pages;
+            if (first < file_last && !backup_copy_from_file(backup, first, file_last - first)) {
+                return BACKUP_ERROR;
+            }
+        }
+
+        pager_snapshot_taken(pager, first, last);
+        backup->next_page_num = last;
+    }
+
+    return backup->next_page_num == backup->num_pages ? BACKUP_DONE : BACKUP_MORE;
+}
+
+/*
+ * Make the copy durable and move it into place when it is complete, then
+ * release the backup. An unfinished backup is abandoned.
+ */
+BackupResult backup_finish(Backup* backup) {
+    BackupResult result = BACKUP_ERROR;
+    bool complete = backup->next_page_num == backup->num_pages;
+    pager_snapshot_end(backup->table->pager);
+
+    if (complete &&
+        ftruncate(backup->file_descriptor, (off_t) backup->num_pages * backup->table->pager->page_size) == 0 &&
+        fsync(backup->file_descriptor) == 0) {
+        result = BACKUP_DONE;
+    }
+    if (close(backup->file_descriptor) == -1) {
+        result = BACKUP_ERROR;
+    }
+    if (result == BACKUP_DONE && rename(backup->temp_path, backup->path) == -1) {
+        result = BACKUP_ERROR;
+    }
+    if (result != BACKUP_DONE) {
+        unlink(backup->temp_path);
+    }
+
+    free(backup->buffer);
+    free(backup->temp_path);
+    free(backup->path);
+    free(backup);
+    return result;
+}
+
+/*
+ * Back up the whole table in one go, between two statements.
+ */
+BackupResult table_backup(Table* table, const char* path, uint32_t* num_pages) {
+    Backup* backup = backup_begin(table, path);
+    if (backup == NULL) {
+        return BACKUP_ERROR;
+    }
+
+    *num_pages = backup->num_pages;
+    if (backup_step(backup, UINT32_MAX) == BACKUP_ERROR) {
+        backup_finish(backup);
+        return BACKUP_ERROR;
+    }
+    return backup_finish(backup);
+}
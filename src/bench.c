@@ -0,0 +1,572 @@
+//
+// Created by aagu on 20-4-10.
+//
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <zconf.h>
+#include "database.h"
+#include "btree.h"
+#include "parallel_scan.h"
+#include "metrics.h"
+
+/*
+ * Repeatable workloads against the engine API, bypassing the REPL.
+ * Every run uses the same seed so numbers are comparable across versions.
+ */
+
+static const uint32_t BENCH_BATCH_SIZE = 1000;
+
+#define BENCH_NUM_WORKLOADS 11
+static const char* BENCH_WORKLOADS[BENCH_NUM_WORKLOADS] = {
+    "seq_insert", "rand_insert", "batch_insert", "point_lookup", "range_scan", "id_scan", "paginate",
+    "full_scan", "mixed", "delete", "lazy_delete"
+};
+
+typedef struct {
+    uint32_t num_rows;
+    uint32_t num_ops;
+    uint32_t seed;
+    uint32_t scan_length;
+    uint32_t threads; // scan threads of full_scan
+    bool json;
+    bool hash_index;
+    const char* only;
+    const char* filename;
+    DbOptions db; // page size, leaf format and subtree counts of the bench database
+} BenchOptions;
+
+typedef struct {
+    const char* name;
+    uint32_t num_ops;
+    uint64_t* latencies; // nanoseconds per op
+    uint64_t total_ns;
+    uint64_t flush_ns;
+    uint64_t page_requests;
+    uint64_t page_reads;
+    uint64_t page_writes;
+    uint64_t arena_allocations;
+    uint64_t heap_allocations;
+} BenchResult;
+
+uint32_t bench_random(uint32_t* state) {
+    // xorshift32, deterministic for a given seed
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+uint32_t* shuffled_ids(uint32_t first, uint32_t count, uint32_t* state) {
+    uint32_t* ids = malloc(sizeof(uint32_t) * count);
+    for (uint32_t i = 0; i < count; i++) {
+        ids[i] = first + i;
+    }
+    for (uint32_t i = count; i > 1; i--) {
+        uint32_t j = bench_random(state) % i;
+        uint32_t tmp = ids[i - 1];
+        ids[i - 1] = ids[j];
+        ids[j] = tmp;
+    }
+    return ids;
+}
+
+void make_insert(Statement* statement, uint32_t id) {
+    statement->type = STATEMENT_INSERT;
+    statement->row_to_manipulate.id = id;
+    snprintf(statement->row_to_manipulate.username, sizeof(statement->row_to_manipulate.username),
+             "user%u", id);
+    snprintf(statement->row_to_manipulate.email, sizeof(statement->row_to_manipulate.email),
+             "person%u@example.com", id);
+}
+
+void remove_database(BenchOptions* options) {
+    char index_filename[1024];
+    snprintf(index_filename, sizeof(index_filename), "%s.hidx", options->filename);
+    unlink(options->filename);
+    unlink(index_filename);
+}
+
+Table* bench_open(BenchOptions* options, bool fresh) {
+    if (fresh) {
+        remove_database(options);
+    }
+
+    Table* table = db_open(options->filename, &options->db);
+    if (fresh && options->hash_index) {
+        create_hash_index(table);
+        arena_reset(table->arena);
+    }
+    return table;
+}
+
+void load_rows(Table* table, uint32_t* ids, uint32_t count) {
+    Statement statement;
+    for (uint32_t i = 0; i < count; i++) {
+        make_insert(&statement, ids[i]);
+        execute_insert(&statement, table);
+        arena_reset(table->arena);
+    }
+}
+
+void result_begin(BenchResult* result, const char* name, uint32_t num_ops, Table* table) {
+    result->name = name;
+    result->num_ops = num_ops;
+    result->latencies = malloc(sizeof(uint64_t) * (num_ops > 0 ? num_ops : 1));
+    result->total_ns = 0;
+    result->flush_ns = 0;
+    result->page_requests = table->pager->num_page_requests;
+    result->page_reads = table->pager->num_page_reads;
+    result->page_writes = table->pager->num_page_writes;
+    result->arena_allocations = table->arena->num_allocations;
+    result->heap_allocations = table->arena->num_heap_allocations;
+}
+
+/*
+ * Close the measurement window and take counter deltas. A workload that
+ * changes rows passes flush to write every cached page back, so page writes
+ * include what it dirtied. The pager does not track dirty pages, so a
+ * read-only workload must not flush or it would count every page it read.
+ */
+void result_end(BenchResult* result, Table* table, bool flush) {
+    Pager* pager = table->pager;
+    uint64_t flush_start = metrics_now_ns();
+    for (uint32_t i = 0; flush && i < pager->num_pages; i++) {
+        if (pager->pages[i] != NULL) {
+            pager_flush(pager, i);
+        }
+    }
+    result->flush_ns = flush ? metrics_now_ns() - flush_start : 0;
+
+    result->page_requests = pager->num_page_requests - result->page_requests;
+    result->page_reads = pager->num_page_reads - result->page_reads;
+    result->page_writes = pager->num_page_writes - result->page_writes;
+    result->arena_allocations = table->arena->num_allocations - result->arena_allocations;
+    result->heap_allocations = table->arena->num_heap_allocations - result->heap_allocations;
+}
+
+void bench_insert(BenchOptions* options, BenchResult* result, const char* name, bool random_order) {
+    uint32_t state = options->seed;
+    uint32_t* ids = shuffled_ids(1, options->num_rows, &state);
+    if (!random_order) {
+        for (uint32_t i = 0; i < options->num_rows; i++) {
+            ids[i] = i + 1;
+        }
+    }
+
+    Table* table = bench_open(options, true);
+    result_begin(result, name, options->num_rows, table);
+
+    Statement statement;
+    for (uint32_t i = 0; i < options->num_rows; i++) {
+        make_insert(&statement, ids[i]);
+        uint64_t start = metrics_now_ns();
+        execute_insert(&statement, table);
+        arena_reset(table->arena);
+        result->latencies[i] = metrics_now_ns() - start;
+    }
+
+    result_end(result, table, true);
+    db_close(table);
+    free(ids);
+}
+
+/*
+ * Clustered batch load: batches of BENCH_BATCH_SIZE consecutive ids, the
+ * batches in random order and the ids shuffled within each batch. Every row
+ * of a batch is charged the batch's average latency.
+ */
+void bench_batch_insert(BenchOptions* options, BenchResult* result) {
+    uint32_t state = options->seed;
+    uint32_t num_batches = (options->num_rows + BENCH_BATCH_SIZE - 1) / BENCH_BATCH_SIZE;
+    uint32_t* batch_order = shuffled_ids(0, num_batches, &state);
+    Row* rows = malloc(sizeof(Row) * BENCH_BATCH_SIZE);
+    Statement statement;
+
+    Table* table = bench_open(options, true);
+    result_begin(result, "batch_insert", options->num_rows, table);
+
+    uint32_t op = 0;
+    for (uint32_t b = 0; b < num_batches; b++) {
+        uint32_t first = batch_order[b] * BENCH_BATCH_SIZE + 1;
+        uint32_t count = options->num_rows - (first - 1) < BENCH_BATCH_SIZE ?
+                         options->num_rows - (first - 1) : BENCH_BATCH_SIZE;
+        uint32_t* ids = shuffled_ids(first, count, &state);
+        for (uint32_t i = 0; i < count; i++) {
+            make_insert(&statement, ids[i]);
+            rows[i] = statement.row_to_manipulate;
+        }
+        free(ids);
+
+        uint64_t start = metrics_now_ns();
+        execute_insert_batch(table, rows, count);
+        arena_reset(table->arena);
+        uint64_t per_row = (metrics_now_ns() - start) / count;
+        for (uint32_t i = 0; i < count; i++) {
+            result->latencies[op++] = per_row;
+        }
+    }
+
+    result_end(result, table, true);
+    db_close(table);
+    free(rows);
+    free(batch_order);
+}
+
+/*
+ * Load num_rows rows in random order and reopen, so the measured phase
+ * starts with a cold cache.
+ */
+Table* bench_prepare(BenchOptions* options, uint32_t num_rows) {
+    uint32_t state = options->seed;
+    uint32_t* ids = shuffled_ids(1, num_rows, &state);
+    Table* table = bench_open(options, true);
+    load_rows(table, ids, num_rows);
+    db_close(table);
+    free(ids);
+
+    return bench_open(options, false);
+}
+
+void bench_point_lookup(BenchOptions* options, BenchResult* result) {
+    Table* table = bench_prepare(options, options->num_rows);
+    result_begin(result, "point_lookup", options->num_ops, table);
+
+    uint32_t state = options->seed ^ 0x9e3779b9;
+    Row row;
+    for (uint32_t i = 0; i < options->num_ops; i++) {
+        uint32_t id = bench_random(&state) % options->num_rows + 1;
+        uint64_t start = metrics_now_ns();
+        Cursor* cursor = table_lookup(table, id);
+        if (!cursor->end_of_table) {
+            cursor_read_row(cursor, &row, COLUMN_ALL);
+        }
+        arena_reset(table->arena);
+        result->latencies[i] = metrics_now_ns() - start;
+    }
+
+    result_end(result, table, false);
+    db_close(table);
+}
+
+/*
+ * Scans read only the given columns, id_scan shows what projection saves
+ * (most with --pax).
+ */
+void bench_range_scan(BenchOptions* options, BenchResult* result, const char* name, uint32_t columns) {
+    Table* table = bench_prepare(options, options->num_rows);
+    result_begin(result, name, options->num_ops, table);
+
+    uint32_t state = options->seed ^ 0x85ebca6b;
+    Row row;
+    for (uint32_t i = 0; i < options->num_ops; i++) {
+        uint32_t id = bench_random(&state) % options->num_rows + 1;
+        uint64_t start = metrics_now_ns();
+        Cursor* cursor = table_find(table, id);
+        for (uint32_t n = 0; n < options->scan_length && !cursor->end_of_table; n++) {
+            cursor_read_row(cursor, &row, columns);
+            cursor_advance(cursor);
+        }
+        arena_reset(table->arena);
+        result->latencies[i] = metrics_now_ns() - start;
+    }
+
+    result_end(result, table, false);
+    db_close(table);
+}
+
+/*
+ * Deep pagination: a page of 10 rows at a random offset from the start.
+ * Cheap with --counts, otherwise the skipped leaves are walked.
+ */
+void bench_paginate(BenchOptions* options, BenchResult* result) {
+    Table* table = bench_prepare(options, options->num_rows);
+    result_begin(result, "paginate", options->num_ops, table);
+
+    uint32_t state = options->seed ^ 0x165667b1;
+    Row row;
+    for (uint32_t i = 0; i < options->num_ops; i++) {
+        uint32_t offset = bench_random(&state) % options->num_rows;
+        uint64_t start = metrics_now_ns();
+        Cursor* cursor = table_start(table);
+        cursor_skip_rows(cursor, offset);
+        for (uint32_t n = 0; n < 10 && !cursor->end_of_table; n++) {
+            cursor_read_row(cursor, &row, COLUMN_ALL);
+            cursor_advance(cursor);
+        }
+        arena_reset(table->arena);
+        result->latencies[i] = metrics_now_ns() - start;
+    }
+
+    result_end(result, table, false);
+    db_close(table);
+}
+
+/*
+ * sum(id) over the whole table, split across --threads threads. Every op
+ * reads all rows, so there are 100 times fewer ops than asked for.
+ */
+void bench_full_scan(BenchOptions* options, BenchResult* result) {
+    Table* table = bench_prepare(options, options->num_rows);
+    table->scan_threads = options->threads;
+    uint32_t num_ops = options->num_ops / 100 > 0 ? options->num_ops / 100 : 1;
+    result_begin(result, "full_scan", num_ops, table);
+
+    WhereClause clause = {NO_CONSTRAIN, 0};
+    ScanTotals totals;
+    for (uint32_t i = 0; i < num_ops; i++) {
+        uint64_t start = metrics_now_ns();
+        parallel_aggregate(table, clause, false, &totals);
+        arena_reset(table->arena);
+        result->latencies[i] = metrics_now_ns() - start;
+    }
+
+    result_end(result, table, false);
+    db_close(table);
+}
+
+/*
+ * Half the rows are loaded up front. Each op is then a coin flip between
+ * looking up a loaded row and inserting one of the remaining ids.
+ */
+void bench_mixed(BenchOptions* options, BenchResult* result) {
+    uint32_t loaded = options->num_rows / 2;
+    Table* table = bench_prepare(options, loaded);
+    result_begin(result, "mixed", options->num_ops, table);
+
+    uint32_t state = options->seed ^ 0xc2b2ae35;
+    uint32_t* new_ids = shuffled_ids(loaded + 1, options->num_rows - loaded, &state);
+    uint32_t next_new = 0;
+    Statement statement;
+    Row row;
+    for (uint32_t i = 0; i < options->num_ops; i++) {
+        bool insert = (bench_random(&state) & 1) && next_new < options->num_rows - loaded;
+        if (insert) {
+            make_insert(&statement, new_ids[next_new++]);
+        }
+        uint32_t id = bench_random(&state) % loaded + 1;
+
+        uint64_t start = metrics_now_ns();
+        if (insert) {
+            execute_insert(&statement, table);
+        } else {
+            Cursor* cursor = table_lookup(table, id);
+            if (!cursor->end_of_table) {
+                cursor_read_row(cursor, &row, COLUMN_ALL);
+            }
+        }
+        arena_reset(table->arena);
+        result->latencies[i] = metrics_now_ns() - start;
+    }
+
+    result_end(result, table, true);
+    db_close(table);
+    free(new_ids);
+}
+
+void bench_delete(BenchOptions* options, BenchResult* result, const char* name, bool lazy) {
+    Table* table = bench_prepare(options, options->num_rows);
+    table->lazy_delete = lazy;
+    uint32_t num_ops = options->num_ops < options->num_rows ? options->num_ops : options->num_rows;
+    result_begin(result, name, num_ops, table);
+
+    uint32_t state = options->seed ^ 0x27d4eb2f;
+    uint32_t* ids = shuffled_ids(1, options->num_rows, &state);
+    Statement statement;
+    statement.type = STATEMENT_DELETE;
+    for (uint32_t i = 0; i < num_ops; i++) {
+        statement.row_to_manipulate.id = ids[i];
+        uint64_t start = metrics_now_ns();
+        execute_delete(&statement, table);
+        arena_reset(table->arena);
+        result->latencies[i] = metrics_now_ns() - start;
+    }
+
+    result_end(result, table, true);
+    db_close(table);
+    free(ids);
+}
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t percentile(BenchResult* result, double fraction) {
+    if (result->num_ops == 0) return 0;
+    uint32_t index = (uint32_t)(fraction * (result->num_ops - 1));
+    return result->latencies[index];
+}
+
+void summarize(BenchResult* result) {
+    result->total_ns = 0;
+    for (uint32_t i = 0; i < result->num_ops; i++) {
+        result->total_ns += result->latencies[i];
+    }
+    qsort(result->latencies, result->num_ops, sizeof(uint64_t), compare_u64);
+}
+
+double ops_per_sec(BenchResult* result) {
+    return result->total_ns == 0 ? 0 : result->num_ops * 1e9 / result->total_ns;
+}
+
+void print_text(BenchOptions* options, BenchResult* results, uint32_t num_results) {
+    printf("rows %u, ops %u, seed %u, page size %u%s%s\n", options->num_rows, options->num_ops, options->seed,
+           options->db.page_size, options->db.leaf_format == LEAF_FORMAT_PAX ? ", pax leaves" : "",
+           options->db.subtree_counts ? ", subtree counts" : "");
+    printf("%-14s %10s %12s %8s %8s %8s %8s %10s %8s %8s %8s %8s\n",
+           "workload", "ops", "ops/sec", "p50us", "p90us", "p99us", "maxus",
+           "pages/op", "reads", "writes", "allocs", "mallocs");
+    for (uint32_t i = 0; i < num_results; i++) {
+        BenchResult* r = &results[i];
+        printf("%-14s %10u %12.0f %8.2f %8.2f %8.2f %8.2f %10.2f %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n",
+               r->name, r->num_ops, ops_per_sec(r),
+               percentile(r, 0.50) / 1e3, percentile(r, 0.90) / 1e3,
+               percentile(r, 0.99) / 1e3, percentile(r, 1.0) / 1e3,
+               r->num_ops ? (double)r->page_requests / r->num_ops : 0,
+               r->page_reads, r->page_writes, r->arena_allocations, r->heap_allocations);
+    }
+}
+
+void print_json(BenchOptions* options, BenchResult* results, uint32_t num_results) {
+    printf("{\"rows\": %u, \"ops\": %u, \"seed\": %u, \"page_size\": %u, \"pax\": %s, "
+           "\"subtree_counts\": %s, \"results\": [",
+           options->num_rows, options->num_ops, options->seed, options->db.page_size,
+           options->db.leaf_format == LEAF_FORMAT_PAX ? "true" : "false",
+           options->db.subtree_counts ? "true" : "false");
+    for (uint32_t i = 0; i < num_results; i++) {
+        BenchResult* r = &results[i];
+        printf("%s\n  {\"workload\": \"%s\", \"ops\": %u, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+               "\"latency_ns\": {\"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", "
+               "\"p99\": %" PRIu64 ", \"max\": %" PRIu64 "}, "
+               "\"pages\": {\"requests\": %" PRIu64 ", \"reads\": %" PRIu64 ", \"writes\": %" PRIu64 "}, "
+               "\"flush_seconds\": %.6f, "
+               "\"allocations\": {\"arena\": %" PRIu64 ", \"heap\": %" PRIu64 "}}",
+               i == 0 ? "" : ",", r->name, r->num_ops, r->total_ns / 1e9, ops_per_sec(r),
+               percentile(r, 0.50), percentile(r, 0.90), percentile(r, 0.99), percentile(r, 1.0),
+               r->page_requests, r->page_reads, r->page_writes, r->flush_ns / 1e9,
+               r->arena_allocations, r->heap_allocations);
+    }
+    printf("\n]}\n");
+}
+
+void usage(const char* program) {
+    printf("Usage: %s [--rows N] [--ops N] [--seed N] [--scan N] [--hash-index]\n"
+           "          [--only WORKLOAD] [--file PATH] [--page-size N] [--pax] [--counts]\n"
+           "          [--threads N] [--direct-io] [--huge-pages] [--json]\n"
+           "Workloads: seq_insert rand_insert batch_insert point_lookup range_scan id_scan paginate\n"
+           "           full_scan mixed delete lazy_delete\n", program);
+}
+
+bool selected(BenchOptions* options, const char* name) {
+    return options->only == NULL || strcmp(options->only, name) == 0;
+}
+
+bool workload_known(const char* name) {
+    for (uint32_t i = 0; i < BENCH_NUM_WORKLOADS; i++) {
+        if (strcmp(BENCH_WORKLOADS[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    options.num_rows = 20000;
+    options.num_ops = 20000;
+    options.seed = 42;
+    options.scan_length = 100;
+    options.threads = 1;
+    options.json = false;
+    options.hash_index = false;
+    options.only = NULL;
+    options.filename = "bench.db";
+    db_options_init(&options.db);
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--rows") == 0 && has_value) {
+            options.num_rows = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0 && has_value) {
+            options.num_ops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+            options.seed = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scan") == 0 && has_value) {
+            options.scan_length = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            options.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--only") == 0 && has_value) {
+            options.only = argv[++i];
+        } else if (strcmp(argv[i], "--file") == 0 && has_value) {
+            options.filename = argv[++i];
+        } else if (strcmp(argv[i], "--page-size") == 0 && has_value) {
+            options.db.page_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pax") == 0) {
+            options.db.leaf_format = LEAF_FORMAT_PAX;
+        } else if (strcmp(argv[i], "--counts") == 0) {
+            options.db.subtree_counts = true;
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            options.db.direct_io = true;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            options.db.huge_pages = true;
+        } else if (strcmp(argv[i], "--hash-index") == 0) {
+            options.hash_index = true;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            options.json = true;
+        } else {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.num_rows < 2 || options.seed == 0 || !page_size_valid(options.db.page_size) ||
+        options.threads < 1 || options.threads > SCAN_MAX_THREADS) {
+        printf("--rows must be at least 2, --seed non-zero, --page-size a power of two from 4096 to 65536\n"
+               "and --threads from 1 to %d.\n", SCAN_MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+    if (options.only != NULL && !workload_known(options.only)) {
+        printf("Unknown workload '%s'.\n", options.only);
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    BenchResult results[BENCH_NUM_WORKLOADS];
+    uint32_t num_results = 0;
+
+    if (selected(&options, "seq_insert")) bench_insert(&options, &results[num_results++], "seq_insert", false);
+    if (selected(&options, "rand_insert")) bench_insert(&options, &results[num_results++], "rand_insert", true);
+    if (selected(&options, "batch_insert")) bench_batch_insert(&options, &results[num_results++]);
+    if (selected(&options, "point_lookup")) bench_point_lookup(&options, &results[num_results++]);
+    if (selected(&options, "range_scan")) bench_range_scan(&options, &results[num_results++], "range_scan", COLUMN_ALL);
+    if (selected(&options, "id_scan")) bench_range_scan(&options, &results[num_results++], "id_scan", COLUMN_ID);
+    if (selected(&options, "paginate")) bench_paginate(&options, &results[num_results++]);
+    if (selected(&options, "full_scan")) bench_full_scan(&options, &results[num_results++]);
+    if (selected(&options, "mixed")) bench_mixed(&options, &results[num_results++]);
+    if (selected(&options, "delete")) bench_delete(&options, &results[num_results++], "delete", false);
+    if (selected(&options, "lazy_delete")) bench_delete(&options, &results[num_results++], "lazy_delete", true);
+
+    for (uint32_t i = 0; i < num_results; i++) {
+        summarize(&results[i]);
+    }
+
+    if (options.json) {
+        print_json(&options, results, num_results);
+    } else {
+        print_text(&options, results, num_results);
+    }
+
+    for (uint32_t i = 0; i < num_results; i++) {
+        free(results[i].latencies);
+    }
+    remove_database(&options);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,87 @@
+//
+// Created by aagu on 20-4-05.
+//
+
+#include <stdlib.h>
+#include "bloom_filter.h"
+
+BloomFilter* bloom_filter_new(uint32_t capacity) {
+    if (capacity < BLOOM_FILTER_MIN_CAPACITY) {
+        capacity = BLOOM_FILTER_MIN_CAPACITY;
+    }
+
+    uint32_t num_counters = 1;
+    while (num_counters < capacity * BLOOM_FILTER_COUNTERS_PER_KEY) {
+        num_counters <<= 1;
+    }
+
+    BloomFilter* filter = malloc(sizeof(BloomFilter));
+    filter->capacity = capacity;
+    filter->num_keys = 0;
+    filter->mask = num_counters - 1;
+    filter->counters = calloc(num_counters, sizeof(uint8_t));
+    return filter;
+}
+
+void bloom_filter_free(BloomFilter* filter) {
+    free(filter->counters);
+    free(filter);
+}
+
+/*
+ * Double hashing: probe i is h1 + i * h2, both taken from one 64 bit mix.
+ */
+uint64_t bloom_filter_hash(uint32_t key) {
+    uint64_t hash = key;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+void bloom_filter_add(BloomFilter* filter, uint32_t key) {
+    uint64_t hash = bloom_filter_hash(key);
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+    for (uint32_t i = 0; i < BLOOM_FILTER_NUM_HASHES; i++) {
+        uint8_t* counter = &filter->counters[(h1 + i * h2) & filter->mask];
+        if (*counter < UINT8_MAX) {
+            *counter += 1;
+        }
+    }
+    filter->num_keys += 1;
+}
+
+void bloom_filter_remove(BloomFilter* filter, uint32_t key) {
+    uint64_t hash = bloom_filter_hash(key);
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+    for (uint32_t i = 0; i < BLOOM_FILTER_NUM_HASHES; i++) {
+        uint8_t* counter = &filter->counters[(h1 + i * h2) & filter->mask];
+        // A saturated counter no longer knows how many keys hit it
+        if (*counter > 0 && *counter < UINT8_MAX) {
+            *counter -= 1;
+        }
+    }
+    filter->num_keys -= 1;
+}
+
+/*
+ * false means the key is definitely absent, true means it might be present.
+ */
+bool bloom_filter_may_contain(BloomFilter* filter, uint32_t key) {
+    uint64_t hash = bloom_filter_hash(key);
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+    for (uint32_t i = 0; i < BLOOM_FILTER_NUM_HASHES; i++) {
+        if (filter->counters[(h1 + i * h2) & filter->mask] == 0) {
+            return false;
+        }
+    }
+    return true;
+}
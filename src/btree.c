@@ -9,6 +9,47 @@
 #include "table.h"
 #include "btree.h"
 #include "pager.h"
+#include "hash_index.h"
+#include "metrics.h"
+
+void node_layout_init(NodeLayout* layout, uint32_t page_size, LeafFormat leaf_format, bool subtree_counts) {
+    layout->page_size = page_size;
+    layout->leaf_format = leaf_format;
+    layout->subtree_counts = subtree_counts;
+    if (leaf_format == LEAF_FORMAT_PAX) {
+        // A PAX cell holds the same bytes as a row cell minus the id stored twice
+        layout->leaf_space_for_cells = page_size - PAX_LEAF_NODE_HEADER_SIZE;
+        layout->leaf_max_cells = layout->leaf_space_for_cells / (LEAF_NODE_CELL_SIZE - ID_SIZE);
+        // Every PAX leaf of the table is made with leaf_max_cells capacity
+        layout->leaf_keys_offset = PAX_LEAF_NODE_KEYS_OFFSET;
+        layout->leaf_key_stride = LEAF_NODE_KEY_SIZE;
+        layout->leaf_flags_offset = PAX_LEAF_NODE_KEYS_OFFSET + layout->leaf_max_cells * LEAF_NODE_KEY_SIZE;
+        layout->leaf_flags_stride = LEAF_NODE_FLAGS_SIZE;
+    } else {
+        layout->leaf_space_for_cells = page_size - LEAF_NODE_HEADER_SIZE;
+        layout->leaf_max_cells = layout->leaf_space_for_cells / LEAF_NODE_CELL_SIZE;
+        layout->leaf_keys_offset = LEAF_NODE_HEADER_SIZE + LEAF_NODE_KEY_OFFSET;
+        layout->leaf_key_stride = LEAF_NODE_CELL_SIZE;
+        layout->leaf_flags_offset = LEAF_NODE_HEADER_SIZE + LEAF_NODE_FLAGS_OFFSET;
+        layout->leaf_flags_stride = LEAF_NODE_CELL_SIZE;
+    }
+    uint32_t leaf_right_split_count = (layout->leaf_max_cells + 1) / 2;
+    layout->leaf_left_split_count = (layout->leaf_max_cells + 1) - leaf_right_split_count;
+    layout->leaf_min_cells = layout->leaf_max_cells / 2;
+
+    layout->internal_max_cells = (page_size - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE;
+    if (subtree_counts) {
+        // Each cell's child and the right child also need a count
+        layout->internal_max_cells = (page_size - INTERNAL_NODE_HEADER_SIZE - INTERNAL_NODE_COUNT_SIZE) /
+                                     (INTERNAL_NODE_CELL_SIZE + INTERNAL_NODE_COUNT_SIZE);
+    }
+    if (page_size == 4096) {
+        layout->internal_max_cells = INTERNAL_NODE_MAX_CELLS_4K;
+    }
+    uint32_t internal_right_split_count = (layout->internal_max_cells + 1) / 2;
+    layout->internal_left_split_count = (layout->internal_max_cells + 1) - internal_right_split_count;
+    layout->internal_min_keys = layout->internal_max_cells / 2;
+}
 
 NodeType get_node_type(void* node) {
     uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
@@ -20,18 +61,20 @@ void set_node_type(void* node, NodeType type) {
     *((uint8_t*) (node + NODE_TYPE_OFFSET)) = value;
 }
 
-bool is_node_root(void* node) {
-    uint8_t value = *((uint8_t*) (node + IS_ROOT_OFFSET));
-    return (bool)value;
+uint8_t* node_flags(void* node) {
+    return node + IS_ROOT_OFFSET;
 }
 
-void set_node_root(void* node, bool is_root) {
-    uint8_t value = is_root;
-    *((uint8_t*) (node + IS_ROOT_OFFSET)) = value;
+bool is_node_root(void* node) {
+    return (*node_flags(node) & NODE_FLAG_ROOT) != 0;
 }
 
-uint32_t* node_parent(void* node) {
-    return node + PARENT_POINTER_OFFSET;
+void set_node_root(void* node, bool is_root) {
+    if (is_root) {
+        *node_flags(node) |= NODE_FLAG_ROOT;
+    } else {
+        *node_flags(node) &= ~NODE_FLAG_ROOT;
+    }
 }
 
 // These methods return a pointer to the value in question, so they can be used both as a getter and a setter.
@@ -39,31 +82,184 @@ uint32_t* leaf_node_num_cells(void* node) {
     return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
+bool leaf_node_is_pax(void* node) {
+    return (*node_flags(node) & NODE_FLAG_PAX) != 0;
+}
+
+uint32_t* pax_leaf_node_capacity(void* node) {
+    return node + PAX_LEAF_NODE_CAPACITY_OFFSET;
+}
+
+uint32_t pax_minipage_width(PaxMinipage minipage) {
+    switch (minipage) {
+        case PAX_MINIPAGE_KEY:
+            return LEAF_NODE_KEY_SIZE;
+        case PAX_MINIPAGE_FLAGS:
+            return LEAF_NODE_FLAGS_SIZE;
+        case PAX_MINIPAGE_USERNAME:
+            return USERNAME_SIZE;
+        default:
+            return EMAIL_SIZE;
+    }
+}
+
+void* pax_leaf_node_minipage(void* node, PaxMinipage minipage) {
+    uint32_t capacity = *pax_leaf_node_capacity(node);
+    uint32_t offset = PAX_LEAF_NODE_KEYS_OFFSET;
+    for (PaxMinipage i = PAX_MINIPAGE_KEY; i < minipage; i++) {
+        offset += capacity * pax_minipage_width(i);
+    }
+    return node + offset;
+}
+
+// Row leaves only, PAX leaves have no contiguous cells
 void* leaf_node_cell(void* node, uint32_t cell_num) {
     return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
 }
 
 uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
+    if (leaf_node_is_pax(node)) {
+        return node + PAX_LEAF_NODE_KEYS_OFFSET + cell_num * LEAF_NODE_KEY_SIZE;
+    }
     return leaf_node_cell(node, cell_num);
 }
 
+// Row leaves only
 void* leaf_node_value(void* node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    return leaf_node_cell(node, cell_num) + LEAF_NODE_VALUE_OFFSET;
+}
+
+uint8_t* leaf_node_flags(void* node, uint32_t cell_num) {
+    if (leaf_node_is_pax(node)) {
+        uint32_t keys_size = *pax_leaf_node_capacity(node) * LEAF_NODE_KEY_SIZE;
+        return node + PAX_LEAF_NODE_KEYS_OFFSET + keys_size + cell_num * LEAF_NODE_FLAGS_SIZE;
+    }
+    return leaf_node_cell(node, cell_num) + LEAF_NODE_FLAGS_OFFSET;
+}
+
+bool leaf_node_is_tombstone(void* node, uint32_t cell_num) {
+    return (*leaf_node_flags(node, cell_num) & LEAF_CELL_TOMBSTONE) != 0;
+}
+
+/*
+ * The key of a cell in a leaf of the table's leaf format. Unlike
+ * leaf_node_key() it does not look at the leaf to find out its format, so
+ * searches and scans over a table's leaves pay nothing for PAX when the
+ * table has row leaves.
+ */
+uint32_t layout_leaf_key(NodeLayout* layout, void* node, uint32_t cell_num) {
+    return *(uint32_t*) (node + layout->leaf_keys_offset + cell_num * layout->leaf_key_stride);
+}
+
+bool layout_leaf_is_tombstone(NodeLayout* layout, void* node, uint32_t cell_num) {
+    uint8_t flags = *(uint8_t*) (node + layout->leaf_flags_offset + cell_num * layout->leaf_flags_stride);
+    return (flags & LEAF_CELL_TOMBSTONE) != 0;
+}
+
+/*
+ * Copy the columns asked for out of a cell. Fields of row that were not
+ * asked for are left alone.
+ */
+void leaf_node_read_row(void* node, uint32_t cell_num, Row* row, uint32_t columns) {
+    if (!leaf_node_is_pax(node)) {
+        void* value = leaf_node_value(node, cell_num);
+        if (columns == COLUMN_ALL) {
+            deserialize_row(value, row);
+            return;
+        }
+        if (columns & COLUMN_ID) memcpy(&(row->id), value + ID_OFFSET, ID_SIZE);
+        if (columns & COLUMN_USERNAME) memcpy(&(row->username), value + USERNAME_OFFSET, USERNAME_SIZE);
+        if (columns & COLUMN_EMAIL) memcpy(&(row->email), value + EMAIL_OFFSET, EMAIL_SIZE);
+        return;
+    }
+
+    if (columns & COLUMN_ID) {
+        row->id = *leaf_node_key(node, cell_num);
+    }
+    if (columns & COLUMN_USERNAME) {
+        void* usernames = pax_leaf_node_minipage(node, PAX_MINIPAGE_USERNAME);
+        memcpy(&(row->username), usernames + cell_num * USERNAME_SIZE, USERNAME_SIZE);
+    }
+    if (columns & COLUMN_EMAIL) {
+        void* emails = pax_leaf_node_minipage(node, PAX_MINIPAGE_EMAIL);
+        memcpy(&(row->email), emails + cell_num * EMAIL_SIZE, EMAIL_SIZE);
+    }
+}
+
+// Store a live cell for key and row
+void leaf_node_set_cell(void* node, uint32_t cell_num, uint32_t key, Row* row) {
+    *leaf_node_key(node, cell_num) = key;
+    *leaf_node_flags(node, cell_num) = 0;
+    if (!leaf_node_is_pax(node)) {
+        serialize_row(row, leaf_node_value(node, cell_num));
+        return;
+    }
+
+    void* usernames = pax_leaf_node_minipage(node, PAX_MINIPAGE_USERNAME);
+    void* emails = pax_leaf_node_minipage(node, PAX_MINIPAGE_EMAIL);
+    memcpy(usernames + cell_num * USERNAME_SIZE, &(row->username), USERNAME_SIZE);
+    memcpy(emails + cell_num * EMAIL_SIZE, &(row->email), EMAIL_SIZE);
+}
+
+/*
+ * Copy count cells of source starting at from to destination starting at to.
+ * Both leaves have the same format. Ranges may overlap when they are the
+ * same leaf, like memmove().
+ */
+void leaf_node_copy_cells(void* destination, uint32_t to, void* source, uint32_t from, uint32_t count) {
+    if (count == 0) return;
+    if (!leaf_node_is_pax(source)) {
+        memmove(leaf_node_cell(destination, to), leaf_node_cell(source, from), count * LEAF_NODE_CELL_SIZE);
+        return;
+    }
+
+    for (PaxMinipage i = PAX_MINIPAGE_KEY; i < PAX_NUM_MINIPAGES; i++) {
+        uint32_t width = pax_minipage_width(i);
+        memmove(pax_leaf_node_minipage(destination, i) + to * width,
+                pax_leaf_node_minipage(source, i) + from * width, count * width);
+    }
+}
+
+/*
+ * Point the hash index at page_num for every key now stored in that leaf.
+ * Must be called whenever cells move to another page.
+ */
+void leaf_node_reindex_cells(Table* table, uint32_t page_num, uint32_t from_cell, uint32_t to_cell) {
+    if (table->hash_index == NULL) return;
+
+    void* node = get_page(table->pager, page_num);
+    for (uint32_t i = from_cell; i < to_cell; i++) {
+        if (layout_leaf_is_tombstone(&table->layout, node, i)) continue;
+        hash_index_put(table->hash_index, layout_leaf_key(&table->layout, node, i), page_num);
+    }
 }
 
-void initialize_leaf_node(void* node) {
+void leaf_node_reindex(Table* table, uint32_t page_num) {
+    if (table->hash_index == NULL) return;
+
+    void* node = get_page(table->pager, page_num);
+    if (get_node_type(node) != NODE_LEAF) return;
+
+    leaf_node_reindex_cells(table, page_num, 0, *leaf_node_num_cells(node));
+}
+
+void initialize_leaf_node(void* node, NodeLayout* layout) {
     set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
+    *node_flags(node) = 0;
+    if (layout->leaf_format == LEAF_FORMAT_PAX) {
+        *node_flags(node) = NODE_FLAG_PAX;
+        *pax_leaf_node_capacity(node) = layout->leaf_max_cells;
+    }
     *leaf_node_num_cells(node) = 0;
     *leaf_node_next_leaf(node) = 0; // 0 represents no sibling
 }
 
-uint32_t leaf_node_binary_search(void* node, uint32_t key, uint32_t num_cells) {
+uint32_t leaf_node_binary_search(NodeLayout* layout, void* node, uint32_t key, uint32_t num_cells) {
     uint32_t min_index = 0;
     uint32_t one_past_max_index = num_cells;
     while (one_past_max_index != min_index) {
         uint32_t index = (min_index + one_past_max_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
+        uint32_t key_at_index = layout_leaf_key(layout, node, index);
         if (key == key_at_index) {
             return index;
         }
@@ -88,31 +284,49 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
     uint32_t next_leaf = *leaf_node_next_leaf(node);
     uint32_t num_cells = *leaf_node_num_cells(node);
 
-    Cursor* cursor = malloc(sizeof(Cursor));
+    Cursor* cursor = arena_alloc(table->arena, sizeof(Cursor));
     cursor->table = table;
     cursor->page_num = page_num;
 
-    uint32_t index =  leaf_node_binary_search(node, key, num_cells);
+    uint32_t index =  leaf_node_binary_search(&table->layout, node, key, num_cells);
     cursor->cell_num = index;
     cursor->end_of_table = (next_leaf == 0) && (index == num_cells);
+    cursor->path.depth = 0;
     return cursor;
 }
 
 Cursor* leaf_node_delete(Cursor* cursor, uint32_t key) {
-    void* node = get_page(cursor->table->pager, cursor->page_num);
+    Table* table = cursor->table;
+    void* node = get_page(table->pager, cursor->page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
-    uint32_t old_max_key = get_node_max_key(node);
 
-    for (int32_t i = cursor->cell_num; i < num_cells; i++) {
-        memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i + 1), LEAF_NODE_CELL_SIZE);
+    bloom_filter_remove(table->key_filter, key);
+    if (table->hash_index != NULL) {
+        hash_index_remove(table->hash_index, key);
     }
 
-    *leaf_node_num_cells(node) = num_cells - 1;
+    if (table->layout.subtree_counts) {
+        cursor_ensure_path(cursor, key);
+        tree_path_add_count(table, &cursor->path, -1);
+    }
+
+    if (table->lazy_delete) {
+        // The cell stays until an insert needs the room or compact_tree() runs
+        *leaf_node_flags(node, cursor->cell_num) |= LEAF_CELL_TOMBSTONE;
+        table->num_tombstones += 1;
+        return cursor;
+    }
 
+    leaf_node_copy_cells(node, cursor->cell_num, node, cursor->cell_num + 1, num_cells - cursor->cell_num - 1);
+    *leaf_node_num_cells(node) = num_cells - 1;
 
-    if (!is_node_root(node)) {
-        uint32_t parent_page_num = *node_parent(node);
-        internal_node_delete(cursor->table, parent_page_num, cursor->page_num, old_max_key);
+    /*
+     * Separator keys above are left alone: they stay valid upper bounds for
+     * the leaf, so only an underflow needs the tree to change.
+     */
+    if (!is_node_root(node) && num_cells - 1 < table->layout.leaf_min_cells) {
+        cursor_ensure_path(cursor, key);
+        leaf_node_rebalance(cursor);
     }
 
     return cursor;
@@ -151,276 +365,317 @@ uint32_t internal_node_find_child(void* node, uint32_t key) {
     return min_index;
 }
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-    uint32_t old_child_index = internal_node_find_child(node, old_key);
-    *internal_node_key(node, old_child_index) = new_key;
-}
-
 uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
     return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
 }
 
-void internal_node_delete_cell(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-    void* parent = get_page(table->pager, parent_page_num);
-    uint32_t right_child = *internal_node_right_child(parent);
-    uint32_t num_keys = *internal_node_num_keys(parent);
-
-    if (right_child == child_page_num) {
-        if (num_keys == 1) {
-            uint32_t parent_page = *node_parent(parent);
-            internal_node_merge(table, parent_page, parent_page_num);
-        } else {
-            *internal_node_num_keys(parent) = num_keys - 1;
-            uint32_t left_sibling_cell_page = *internal_node_child(parent, num_keys - 1);
-            *internal_node_right_child(parent) = left_sibling_cell_page;
-        }
-    } else {
-        void* child_node = get_page(table->pager, child_page_num);
-        uint32_t key = get_node_max_key(child_node);
-        uint32_t index = internal_node_find_child(parent, key);
-
-        for (uint32_t i = num_keys - 1; i > index; i--) {
-            memcpy(internal_node_cell(parent, i - 1), internal_node_cell(parent, i), INTERNAL_NODE_CELL_SIZE);
-        }
-    }
-}
-
-void leaf_node_merge(Table* table, uint32_t left_node_page, uint32_t right_node_page) {
-    void* right_node = get_page(table->pager, right_node_page);
-    void* left_node = get_page(table->pager, left_node_page);
-    uint32_t left_node_num_cells = *leaf_node_num_cells(left_node);
-    uint32_t right_node_num_cells = *leaf_node_num_cells(right_node);
-    uint32_t old_max_key = get_node_max_key(left_node);
-
-    *leaf_node_next_leaf(left_node) = *leaf_node_next_leaf(right_node);
-
-    for (uint32_t index = 0; index < right_node_num_cells; index++) {
-        void* source_cell = leaf_node_cell(right_node, index);
-        void* destination_cell = leaf_node_cell(left_node, index + left_node_num_cells);
+/*
+ * Descend from page_num to the leaf that should hold key, recording every
+ * internal node passed in the cursor's path.
+ */
+Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
+    TreePath path;
+    path.depth = 0;
 
-        memcpy(destination_cell, source_cell, LEAF_NODE_CELL_SIZE);
+    table->counters.descents += 1;
+    void* node = get_page(table->pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        table->counters.internal_nodes_visited += 1;
+        uint32_t child_index = internal_node_find_child(node, key);
+        path.page_num[path.depth] = page_num;
+        path.child_index[path.depth] = child_index;
+        path.depth++;
+
+        page_num = *internal_node_child(node, child_index);
+        node = get_page(table->pager, page_num);
     }
 
-    *leaf_node_num_cells(left_node) += right_node_num_cells;
+    Cursor* cursor = leaf_node_find(table, page_num, key);
+    cursor->path = path;
+    return cursor;
+}
 
-    uint32_t left_parent_page = *node_parent(left_node);
-    uint32_t right_parent_page = *node_parent(right_node);
+uint32_t* internal_node_num_keys(void* node) {
+    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
 
-    void* parent = get_page(table->pager, left_parent_page);
+uint32_t* internal_node_right_child(void* node) {
+    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
 
-    if (left_node_page != *internal_node_right_child(parent)) {
-        uint32_t new_max_key = get_node_max_key(left_node);
-        update_internal_node_key(parent, old_max_key, new_max_key);
+uint32_t* internal_node_child(void* node, uint32_t child_num) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys) {
+        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+        exit(EXIT_FAILURE);
+    } else if (child_num == num_keys) {
+        return internal_node_right_child(node);
+    } else {
+        return internal_node_cell(node, child_num);
     }
+}
 
-    internal_node_delete_cell(table, right_parent_page, right_node_page);
+uint32_t* internal_node_key(void* node, uint32_t key_num) {
+    return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+}
 
-    free(right_node);
-    table->pager->pages[right_node_page] = NULL;
+uint32_t* internal_node_count(NodeLayout* layout, void* node, uint32_t child_num) {
+    uint32_t counts_offset = INTERNAL_NODE_HEADER_SIZE + layout->internal_max_cells * INTERNAL_NODE_CELL_SIZE;
+    return node + counts_offset + child_num * INTERNAL_NODE_COUNT_SIZE;
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
+/*
+ * Live rows under page_num, from the node itself: a leaf counts its cells,
+ * an internal node adds up its children's counts.
+ */
+uint32_t node_subtree_count(Table* table, uint32_t page_num) {
     void* node = get_page(table->pager, page_num);
+    uint32_t count = 0;
+    if (get_node_type(node) == NODE_LEAF) {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        if (table->num_tombstones == 0) return num_cells;
+        for (uint32_t i = 0; i < num_cells; i++) {
+            if (!layout_leaf_is_tombstone(&table->layout, node, i)) count++;
+        }
+        return count;
+    }
 
-    uint32_t child_index = internal_node_find_child(node, key);
-    uint32_t child_num = *internal_node_child(node, child_index);
-    void* child = get_page(table->pager, child_num);
-    switch (get_node_type(child)) {
-        case NODE_INTERNAL:
-            return internal_node_find(table, child_num, key);
-        case NODE_LEAF:
-            return leaf_node_find(table, child_num, key);
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        count += *internal_node_count(&table->layout, node, i);
     }
+    return count;
 }
 
-uint32_t internal_node_find_left_leaf(Table* table, uint32_t page_num, uint32_t target_page) {
-    void* this_page = get_page(table->pager, page_num);
-
-    if (get_node_type(this_page) == NODE_LEAF) return 0;
-
-    uint32_t num_keys = *internal_node_num_keys(this_page);
-    for (uint32_t i = 0; i <= num_keys; i++) {
-        uint32_t child_page = *internal_node_cell(this_page, i);
-        void* child_node = get_page(table->pager, child_page);
+// Refresh the count of a child whose contents changed, when counts are kept
+void internal_node_recount(Table* table, void* node, uint32_t child_num) {
+    if (!table->layout.subtree_counts) return;
+    *internal_node_count(&table->layout, node, child_num) =
+            node_subtree_count(table, *internal_node_child(node, child_num));
+}
 
-        if (get_node_type(child_node) == NODE_INTERNAL) {
-            uint32_t res = internal_node_find_left_leaf(table, child_page, target_page);
-            if (res != 0) return res;
-        } else {
-            if (*leaf_node_next_leaf(child_node) == target_page) return child_page;
-        }
+/*
+ * Rows were added to or removed from the leaf at the end of path, adjust
+ * the counts of every subtree it is in.
+ */
+void tree_path_add_count(Table* table, TreePath* path, int32_t delta) {
+    if (!table->layout.subtree_counts) return;
+    for (uint32_t level = 0; level < path->depth; level++) {
+        void* node = get_page(table->pager, path->page_num[level]);
+        *internal_node_count(&table->layout, node, path->child_index[level]) += delta;
     }
+}
 
-    uint32_t parent_num = *node_parent(this_page);
-    return internal_node_find_left_leaf(table, parent_num, target_page);
+// Recount every subtree on path, bottom-up
+void tree_path_recount(Table* table, TreePath* path) {
+    if (!table->layout.subtree_counts) return;
+    for (uint32_t level = path->depth; level > 0; level--) {
+        void* node = get_page(table->pager, path->page_num[level - 1]);
+        internal_node_recount(table, node, path->child_index[level - 1]);
+    }
 }
 
-uint32_t leaf_node_find_left_sibling(Table* table, uint32_t child_page_num) {
-    void* child = get_page(table->pager, child_page_num);
-    uint32_t parent_page = *node_parent(child);
-    return internal_node_find_left_leaf(table, parent_page, child_page_num);
+void initialize_internal_node(void* node) {
+    set_node_type(node, NODE_INTERNAL);
+    *node_flags(node) = 0;
+    *internal_node_num_keys(node) = 0;
 }
 
-void internal_node_delete(Table* table, uint32_t parent_page_num, uint32_t child_page_num, uint32_t old_max_key) {
-    void* parent = get_page(table->pager, parent_page_num);
-    void* child = get_page(table->pager, child_page_num);
-    if (get_node_type(parent) == NODE_LEAF) return;
+/*
+ * Largest key stored under node. Internal nodes only keep keys for their left
+ * children, so follow the right child down to a leaf.
+ */
+uint32_t get_node_max_key(Pager* pager, void* node) {
+    if (get_node_type(node) == NODE_LEAF) {
+        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+    void* right_child = get_page(pager, *internal_node_right_child(node));
+    return get_node_max_key(pager, right_child);
+}
 
-    uint32_t child_num_cells;
-    uint32_t max_cells;
+/*
+ * Squeeze the tombstoned cells out of a leaf. Keys stay on the same page, so
+ * the hash index needs no update. Returns the number of cells purged.
+ */
+uint32_t leaf_node_purge(Table* table, uint32_t page_num) {
+    void* node = get_page(table->pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
 
-    if (get_node_type(child) == NODE_LEAF) {
-        child_num_cells = *leaf_node_num_cells(child);
-        max_cells = LEAF_NODE_MAX_CELLS;
-    } else {
-        printf("Need to implement internal key deletion");
-        exit(EXIT_FAILURE);
+    uint32_t num_live = 0;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        if (layout_leaf_is_tombstone(&table->layout, node, i)) continue;
+        if (num_live != i) {
+            leaf_node_copy_cells(node, num_live, node, i, 1);
+        }
+        num_live++;
     }
 
-    if (child_num_cells < max_cells / 2) {
-        uint32_t right_sibling_page = *leaf_node_next_leaf(child);
-        if (right_sibling_page == 0) { // no right sibling, try to get left sibling
-            uint32_t left_sibling_page = leaf_node_find_left_sibling(table, child_page_num);
-            void* left_sibling = get_page(table->pager, left_sibling_page);
-            uint32_t left_sibling_num_cells = *leaf_node_num_cells(left_sibling);
-            if (left_sibling_num_cells < max_cells / 2) {
-                leaf_node_merge(table, left_sibling_page, child_page_num);
-            } else {
-                uint32_t old_key = get_node_max_key(left_sibling);
-                for (uint32_t i = 0; i < child_num_cells; i++) {
-                    void* source_cell;
-                    if (i == 0) {
-                        source_cell = leaf_node_cell(left_sibling, left_sibling_num_cells - 1);
-                    } else {
-                        source_cell = leaf_node_cell(child, i - 1);
-                    }
-
-                    memcpy(leaf_node_cell(child, i), source_cell, LEAF_NODE_CELL_SIZE);
-                }
-
-                uint32_t left_sibling_parent_page = *node_parent(left_sibling);
-                void* left_sibling_parent = get_page(table->pager, left_sibling_parent_page);
+    *leaf_node_num_cells(node) = num_live;
+    table->num_tombstones -= num_cells - num_live;
+    return num_cells - num_live;
+}
 
-                if (left_sibling_page != *internal_node_right_child(left_sibling_parent)) {
-                    uint32_t new_key = get_node_max_key(left_sibling);
-                    update_internal_node_key(left_sibling_parent, old_key, new_key);
-                }
+void leaf_node_insert(Cursor* cursor, uint32_t key, Row* row) {
+    Table* table = cursor->table;
+    void* node = get_page(table->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    bloom_filter_add(table->key_filter, key);
 
-                *leaf_node_num_cells(child) += 1;
-                *leaf_node_num_cells(left_sibling) -= 1;
-            }
-        } else {
-            void* right_sibling = get_page(table->pager, right_sibling_page);
-            uint32_t right_sibling_num_cells = *leaf_node_num_cells(right_sibling);
-            if (right_sibling_num_cells < max_cells / 2) {
-                leaf_node_merge(table, child_page_num, right_sibling_page);
-            } else {
-                for (uint32_t i = 0; i < right_sibling_num_cells; i++) {
-                    void* destination_cell;
-                    if (i == 0) {
-                        destination_cell = leaf_node_cell(child, child_num_cells);
-                    } else {
-                        destination_cell = leaf_node_cell(right_sibling, i - 1);
-                    }
-
-                    memcpy(destination_cell, leaf_node_cell(right_sibling, i), LEAF_NODE_CELL_SIZE);
-                }
+    /*
+     * Count the row on the way down now. Nodes that split below recount
+     * their halves from scratch, so the counts stay exact either way.
+     */
+    if (table->layout.subtree_counts) {
+        cursor_ensure_path(cursor, key);
+        tree_path_add_count(table, &cursor->path, 1);
+    }
 
-                *leaf_node_num_cells(child) += 1;
-                *leaf_node_num_cells(right_sibling) -= 1;
-            }
+    if (cursor->cell_num < num_cells && *leaf_node_key(node, cursor->cell_num) == key &&
+        leaf_node_is_tombstone(node, cursor->cell_num)) {
+        // The key was deleted lazily, bring its cell back
+        leaf_node_set_cell(node, cursor->cell_num, key, row);
+        table->num_tombstones -= 1;
+        if (table->hash_index != NULL) {
+            hash_index_put(table->hash_index, key, cursor->page_num);
         }
+        return;
     }
 
-    if(is_node_root(child)) return;
+    if (num_cells >= table->layout.leaf_max_cells && leaf_node_purge(table, cursor->page_num) > 0) {
+        // Dropping tombstones made room without a split
+        num_cells = *leaf_node_num_cells(node);
+        cursor->cell_num = leaf_node_binary_search(&table->layout, node, key, num_cells);
+    }
 
-    if (child_page_num != *internal_node_right_child(parent)) {
-        uint32_t new_max_key = get_node_max_key(child);
-        update_internal_node_key(parent, old_max_key, new_max_key);
+    if (num_cells >= table->layout.leaf_max_cells) {
+        // Node full
+        leaf_node_split_and_insert(cursor, key, row);
+        return;
     }
-}
 
-uint32_t* internal_node_num_keys(void* node) {
-    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
-}
+    // Make room for new cell by shifting cells with larger cell num to right
+    leaf_node_copy_cells(node, cursor->cell_num + 1, node, cursor->cell_num, num_cells - cursor->cell_num);
 
-uint32_t* internal_node_right_child(void* node) {
-    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+    *(leaf_node_num_cells(node)) += 1;
+    leaf_node_set_cell(node, cursor->cell_num, key, row);
+
+    if (table->hash_index != NULL) {
+        hash_index_put(table->hash_index, key, cursor->page_num);
+    }
 }
 
-void internal_node_merge(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-    void* parent = get_page(table->pager, parent_page_num);
-    void* child = get_page(table->pager, child_page_num);
+/*
+ * Merge rows into the cursor's leaf in a single pass. Rows must be sorted by
+ * id, belong in this leaf and not be live in the tree yet. When they do not
+ * fit, the leaf is rewritten as however many evenly filled leaves are needed
+ * and the new ones are hooked into the parent left to right.
+ */
+void leaf_node_insert_batch(Cursor* cursor, Row* rows, uint32_t num_rows) {
+    Table* table = cursor->table;
+    Pager* pager = table->pager;
+    cursor_ensure_path(cursor, rows[0].id);
+    tree_path_add_count(table, &cursor->path, num_rows);
+    void* node = get_page(pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
 
-    if (is_node_root(child)) {
-        uint32_t node_page = *internal_node_cell(child, 0);
-        void* node = get_page(table->pager, node_page);
-        set_node_root(node, true);
-        set_node_root(child, false);
-        free(child);
-        table->pager->pages[child_page_num] = NULL;
-        return;
+    // Merge from a copy of the leaf, so its page can be rewritten in place. Tombstones are dropped
+    void* source = arena_alloc(table->arena, table->layout.page_size);
+    memcpy(source, node, table->layout.page_size);
+    uint32_t num_live = 0;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        if (!layout_leaf_is_tombstone(&table->layout, source, i)) num_live++;
     }
-    uint32_t num_keys = *internal_node_num_keys(parent);
-    uint32_t* pages_of_children = malloc(sizeof(uint32_t) * (num_keys + 1));
-    for (uint32_t i = 0; i <= num_keys; i++) {
-        pages_of_children[i] = *internal_node_child(parent, i);
+    table->num_tombstones -= num_cells - num_live;
+    uint32_t num_merged = num_live + num_rows;
+
+    uint32_t num_leaves = (num_merged + table->layout.leaf_max_cells - 1) / table->layout.leaf_max_cells;
+    uint32_t next_leaf_page_num = *leaf_node_next_leaf(node);
+    uint32_t* pages = arena_alloc(table->arena, num_leaves * sizeof(uint32_t));
+    uint32_t* max_keys = arena_alloc(table->arena, num_leaves * sizeof(uint32_t));
+    pages[0] = cursor->page_num;
+    for (uint32_t i = 1; i < num_leaves; i++) {
+        pages[i] = pager_allocate_near(pager, pages[i - 1]);
+        initialize_leaf_node(get_page(pager, pages[i]), &table->layout);
     }
-}
 
-uint32_t* internal_node_child(void* node, uint32_t child_num) {
-    uint32_t num_keys = *internal_node_num_keys(node);
-    if (child_num > num_keys) {
-        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-        exit(EXIT_FAILURE);
-    } else if (child_num == num_keys) {
-        return internal_node_right_child(node);
-    } else {
-        return internal_node_cell(node, child_num);
+    uint32_t cell_num = 0;
+    uint32_t row_num = 0;
+    for (uint32_t i = 0; i < num_leaves; i++) {
+        uint32_t count = num_merged / num_leaves + (i < num_merged % num_leaves ? 1 : 0);
+        void* leaf = get_page(pager, pages[i]);
+        for (uint32_t j = 0; j < count; j++) {
+            while (cell_num < num_cells && layout_leaf_is_tombstone(&table->layout, source, cell_num)) {
+                cell_num++;
+            }
+            if (row_num == num_rows ||
+                (cell_num < num_cells && layout_leaf_key(&table->layout, source, cell_num) < rows[row_num].id)) {
+                leaf_node_copy_cells(leaf, j, source, cell_num++, 1);
+            } else {
+                leaf_node_set_cell(leaf, j, rows[row_num].id, &rows[row_num]);
+                bloom_filter_add(table->key_filter, rows[row_num].id);
+                row_num++;
+            }
+        }
+        *leaf_node_num_cells(leaf) = count;
+        *leaf_node_next_leaf(leaf) = i + 1 < num_leaves ? pages[i + 1] : next_leaf_page_num;
+        max_keys[i] = layout_leaf_key(&table->layout, leaf, count - 1);
+        leaf_node_reindex(table, pages[i]);
     }
-}
 
-uint32_t* internal_node_key(void* node, uint32_t key_num) {
-    return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
-}
-
-void initialize_internal_node(void* node) {
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
-}
+    if (num_leaves == 1) return;
+    metrics_count(METRIC_LEAF_SPLITS, num_leaves - 1);
+
+    // Children are about to move between internal nodes, cached paths go stale
+    table->tree_version += 1;
+
+    TreePath path = cursor->path;
+    for (uint32_t i = 1; i < num_leaves; i++) {
+        if (path.depth > 0) {
+            uint32_t level = path.depth - 1;
+            bool parent_full = *internal_node_num_keys(get_page(pager, path.page_num[level])) >= table->layout.internal_max_cells;
+            internal_node_insert(table, &path, level, max_keys[i - 1], pages[i]);
+            if (!parent_full) {
+                path.child_index[level] += 1;
+                continue;
+            }
+        } else {
+            create_new_root(table, pages[i], max_keys[i - 1]);
+        }
 
-uint32_t get_node_max_key(void* node) {
-    switch (get_node_type(node)) {
-        case NODE_INTERNAL:
-            return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-        case NODE_LEAF:
-            return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+        // The parent split or the root grew, look up where the new leaf hangs now
+        if (i + 1 < num_leaves) {
+            path = internal_node_find(table, table->root_page_num, max_keys[i])->path;
+        }
     }
-}
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* row) {
-    void* node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
-        // Node full
-        leaf_node_split_and_insert(cursor, key, row);
-        return;
+    /*
+     * A node that split while leaves were still being hooked counted only
+     * the leaves it had then, and nodes above it missed the rest.
+     */
+    if (table->layout.subtree_counts) {
+        for (uint32_t i = 0; i < num_leaves; i++) {
+            tree_path_recount(table, &internal_node_find(table, table->root_page_num, max_keys[i])->path);
+        }
     }
+}
 
-    if (cursor->cell_num < num_cells) {
-        // Make room for new cell by shifting cells with larger cell num to right
-        for (uint32_t i = num_cells; i > cursor->cell_num; --i) {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
+/*
+ * Largest key that still belongs in the leaf at the end of path. Returns
+ * false for the rightmost leaf, which takes every larger key.
+ */
+bool tree_path_upper_bound(Table* table, TreePath* path, uint32_t* key) {
+    for (uint32_t level = path->depth; level > 0; level--) {
+        void* node = get_page(table->pager, path->page_num[level - 1]);
+        uint32_t child_index = path->child_index[level - 1];
+        if (child_index < *internal_node_num_keys(node)) {
+            *key = *internal_node_key(node, child_index);
+            return true;
         }
     }
-
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(row, leaf_node_value(node, cursor->cell_num));
+    return false;
 }
 
-void create_new_root(Table* table, uint32_t right_child_page_num) {
+void create_new_root(Table* table, uint32_t right_child_page_num, uint32_t left_max_key) {
     /*
      * Handle splitting the root.
      * Old root copied to new page, becomes left child.
@@ -430,14 +685,15 @@ void create_new_root(Table* table, uint32_t right_child_page_num) {
      */
 
     void* root = get_page(table->pager, table->root_page_num);
-    void* right_child = get_page(table->pager, right_child_page_num);
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
+    uint32_t left_child_page_num = get_node_type(root) == NODE_LEAF ?
+                                   pager_allocate_near(table->pager, right_child_page_num) :
+                                   get_unused_page_num(table->pager);
     void* left_child = get_page(table->pager, left_child_page_num);
 
     /*
      * Left child has data copied from old root;
      */
-    memcpy(left_child, root, PAGE_SIZE);
+    memcpy(left_child, root, table->layout.page_size);
     set_node_root(left_child, false);
 
     /*
@@ -447,117 +703,117 @@ void create_new_root(Table* table, uint32_t right_child_page_num) {
     set_node_root(root, true);
     *internal_node_num_keys(root) = 1;
     *internal_node_child(root, 0) = left_child_page_num;
-    uint32_t left_child_max_key = get_node_max_key(left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
+    *internal_node_key(root, 0) = left_max_key;
     *internal_node_right_child(root) = right_child_page_num;
-    *node_parent(left_child) = table->root_page_num;
-    *node_parent(right_child) = table->root_page_num;
+    internal_node_recount(table, root, 0);
+    internal_node_recount(table, root, 1);
+
+    leaf_node_reindex(table, left_child_page_num);
 }
 
-void do_internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-    /*
-     * Add a new child/key pair to parent that corresponds to child
-     */
-    void* parent = get_page(table->pager, parent_page_num);
-    void* child = get_page(table->pager, child_page_num);
-    uint32_t child_max_key = get_node_max_key(child);
-    uint32_t index = internal_node_find_child(parent, child_max_key);
-
-    uint32_t original_num_keys = *internal_node_num_keys(parent);
-    *internal_node_num_keys(parent) = original_num_keys + 1;
-
-    uint32_t right_child_page_num = *internal_node_right_child(parent);
-    if (right_child_page_num == 0) {
-        // parent node is empty
-        *internal_node_child(parent, original_num_keys) = child_page_num;
-        *internal_node_right_child(parent) = child_page_num;
-        *node_parent(child) = parent_page_num;
-        return;
-    }
-    void* right_child = get_page(table->pager, right_child_page_num);
+/*
+ * The child at path level `level` was split and new_child_page_num holds its
+ * upper part. Insert the new child right after it; left_max_key becomes the
+ * key of the old child and the new child inherits the old child's key.
+ */
+void internal_node_insert(Table* table, TreePath* path, uint32_t level,
+                          uint32_t left_max_key, uint32_t new_child_page_num) {
+    uint32_t page_num = path->page_num[level];
+    void* node = get_page(table->pager, page_num);
+    uint32_t child_index = path->child_index[level];
+    uint32_t num_keys = *internal_node_num_keys(node);
 
-    uint32_t old_max_key = get_node_max_key(right_child);
-    if (child_max_key > old_max_key) {
-        // Replace right child
-        *internal_node_child(parent, original_num_keys) = right_child_page_num;
-        *internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
-        *internal_node_right_child(parent) = child_page_num;
-    } else {
-        // Make room for the new cell
-        for (uint32_t i = original_num_keys; i > index; i--) {
-            void* destination = internal_node_cell(parent, i);
-            void* source = internal_node_cell(parent, i - 1);
-            memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+    if (num_keys < table->layout.internal_max_cells) {
+        if (child_index == num_keys) {
+            // Split child was the right child
+            *internal_node_cell(node, num_keys) = *internal_node_right_child(node);
+            *internal_node_key(node, num_keys) = left_max_key;
+            *internal_node_right_child(node) = new_child_page_num;
+        } else {
+            memmove(internal_node_cell(node, child_index + 2), internal_node_cell(node, child_index + 1),
+                    (num_keys - child_index - 1) * INTERNAL_NODE_CELL_SIZE);
+            *internal_node_cell(node, child_index + 1) = new_child_page_num;
+            *internal_node_key(node, child_index + 1) = *internal_node_key(node, child_index);
+            *internal_node_key(node, child_index) = left_max_key;
         }
-        *internal_node_child(parent, index) = child_page_num;
-        *internal_node_key(parent, index) = child_max_key;
+        *internal_node_num_keys(node) = num_keys + 1;
+        if (table->layout.subtree_counts) {
+            uint32_t* counts = internal_node_count(&table->layout, node, 0);
+            memmove(counts + child_index + 2, counts + child_index + 1,
+                    (num_keys - child_index) * INTERNAL_NODE_COUNT_SIZE);
+            internal_node_recount(table, node, child_index);
+            internal_node_recount(table, node, child_index + 1);
+        }
+        return;
     }
 
-    *node_parent(child) = parent_page_num;
+    internal_node_split_and_insert(table, path, level, left_max_key, new_child_page_num);
 }
 
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-    void* old_node = get_page(table->pager, parent_page_num);
-    uint32_t new_page_num = get_unused_page_num(table->pager);
-    uint32_t old_parent_max_key = get_node_max_key(old_node);
-    void* new_node = get_page(table->pager, new_page_num);
-    initialize_internal_node(new_node);
-
-    uint32_t old_right_child_page_num = *internal_node_right_child(old_node);
-    void* old_right_child = get_page(table->pager, old_right_child_page_num);
-    void* insert_child = get_page(table->pager, child_page_num);
-
-    uint32_t old_max = get_node_max_key(old_right_child);
-    uint32_t insert_max = get_node_max_key(insert_child);
-
-    if (old_max > insert_max) {
-        *internal_node_cell(new_node, 0) = child_page_num;
-        *internal_node_num_keys(new_node) = 1;
-        *internal_node_key(new_node, 0) = insert_max;
-        *internal_node_cell(new_node, 1) = old_right_child_page_num;
-        *internal_node_right_child(new_node) = old_right_child_page_num;
-    } else {
-        *internal_node_cell(new_node, 0) = old_right_child_page_num;
-        *internal_node_num_keys(new_node) = 1;
-        *internal_node_key(new_node, 0) = old_max;
-        *internal_node_cell(new_node, 1) = child_page_num;
-        *internal_node_right_child(new_node) = child_page_num;
+void internal_node_split_and_insert(Table* table, TreePath* path, uint32_t level,
+                                    uint32_t left_max_key, uint32_t new_child_page_num) {
+    /*
+     * Lay out every child of the full node plus the new one in key order.
+     * The first half stays in the old node, the rest moves to a new node
+     * which is then inserted into the grandparent. Children stay where they
+     * are, only the two internal pages are written.
+     */
+    metrics_count(METRIC_INTERNAL_SPLITS, 1);
+    uint32_t page_num = path->page_num[level];
+    void* old_node = get_page(table->pager, page_num);
+    uint32_t child_index = path->child_index[level];
+    uint32_t old_num_keys = *internal_node_num_keys(old_node);
+
+    uint32_t num_children = 0;
+    uint32_t* children = arena_alloc(table->arena, (old_num_keys + 2) * sizeof(uint32_t));
+    uint32_t* keys = arena_alloc(table->arena, (old_num_keys + 2) * sizeof(uint32_t));
+    uint32_t* counts = NULL;
+    if (table->layout.subtree_counts) {
+        counts = arena_alloc(table->arena, (old_num_keys + 2) * sizeof(uint32_t));
     }
-
-    // Split node
-    for (int32_t i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_LEFT_SPILT_COUNT; i--) {
-        uint32_t child_page = *internal_node_child(old_node, i);
-
-        do_internal_node_insert(table, new_page_num, child_page);
+    for (uint32_t i = 0; i <= old_num_keys; i++) {
+        if (counts != NULL) {
+            counts[num_children] = *internal_node_count(&table->layout, old_node, i);
+        }
+        children[num_children] = *internal_node_child(old_node, i);
+        keys[num_children++] = i < old_num_keys ? *internal_node_key(old_node, i) : 0;
+        if (i == child_index) {
+            keys[num_children] = keys[num_children - 1];
+            keys[num_children - 1] = left_max_key;
+            children[num_children++] = new_child_page_num;
+            if (counts != NULL) {
+                counts[num_children - 2] = node_subtree_count(table, children[num_children - 2]);
+                counts[num_children - 1] = node_subtree_count(table, new_child_page_num);
+            }
+        }
     }
 
-    uint32_t child_page = *internal_node_child(old_node, INTERNAL_NODE_LEFT_SPILT_COUNT);
-    *internal_node_right_child(old_node) = child_page;
+    uint32_t new_page_num = get_unused_page_num(table->pager);
+    void* new_node = get_page(table->pager, new_page_num);
+    initialize_internal_node(new_node);
 
-    *internal_node_num_keys(old_node) = INTERNAL_NODE_LEFT_SPILT_COUNT;
+    uint32_t left_num_children = table->layout.internal_left_split_count + 1;
+    internal_node_fill(table, page_num, children, keys, counts, left_num_children);
+    internal_node_fill(table, new_page_num, children + left_num_children, keys + left_num_children,
+                       counts == NULL ? NULL : counts + left_num_children, num_children - left_num_children);
+    uint32_t separator = keys[left_num_children - 1];
 
-    if (is_node_root(old_node)) {
-        create_new_root(table, new_page_num);
+    if (level == 0) {
+        create_new_root(table, new_page_num, separator);
     } else {
-        uint32_t parent_parent_page_num = *node_parent(old_node);
-        uint32_t new_max = get_node_max_key(old_node);
-        void* parent_parent = get_page(table->pager, parent_parent_page_num);
-
-        update_internal_node_key(parent_parent, old_parent_max_key, new_max);
-        internal_node_insert(table, parent_parent_page_num, new_page_num);
+        internal_node_insert(table, path, level - 1, separator, new_page_num);
     }
 }
 
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-    void* parent = get_page(table->pager, parent_page_num);
-
-    uint32_t original_num_keys = *internal_node_num_keys(parent);
+/*
+ * A cursor positioned without a descent (a hash index hit) has no path;
+ * descend once to get it before changing the tree.
+ */
+void cursor_ensure_path(Cursor* cursor, uint32_t key) {
+    Table* table = cursor->table;
+    if (cursor->path.depth > 0 || cursor->page_num == table->root_page_num) return;
 
-    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-        return internal_node_split_and_insert(table, parent_page_num, child_page_num);
-    } else {
-        return do_internal_node_insert(table, parent_page_num, child_page_num);
-    }
+    cursor->path = internal_node_find(table, table->root_page_num, key)->path;
 }
 
 void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
@@ -567,60 +823,522 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
      * Update parent or create a new parent.
      */
 
-    void* old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t old_max = get_node_max_key(old_node);
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    void* new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
+    Table* table = cursor->table;
+    metrics_count(METRIC_LEAF_SPLITS, 1);
+    cursor_ensure_path(cursor, key);
+    void* old_node = get_page(table->pager, cursor->page_num);
+    uint32_t new_page_num = pager_allocate_near(table->pager, cursor->page_num);
+    void* new_node = get_page(table->pager, new_page_num);
+    initialize_leaf_node(new_node, &table->layout);
 
-    *node_parent(new_node) = *node_parent(old_node);
     uint32_t next_leaf_page_num = *leaf_node_next_leaf(old_node);
-    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(new_node) = next_leaf_page_num;
     *leaf_node_next_leaf(old_node) = new_page_num;
 
     /*
-     * All existing keys plus new key should be divided evenly between
-     * old (left) and new (right) nodes. Starting from the right, move
-     * each key to correct position.
+     * Appending past the end of the rightmost leaf (ascending ids) keeps the
+     * old node full and starts the new node with only the new key. Any other
+     * split divides all existing keys plus the new key evenly.
      */
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
+    uint32_t max_cells = table->layout.leaf_max_cells;
+    uint32_t left_split_count = table->layout.leaf_left_split_count;
+    if (cursor->cell_num == max_cells && next_leaf_page_num == 0) {
+        left_split_count = max_cells;
+    }
+    uint32_t right_split_count = max_cells + 1 - left_split_count;
+
+    /*
+     * Starting from the right, move each key to correct position.
+     */
+    for (int32_t i = max_cells; i >= 0; i--) {
         void* destination_node;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+        uint32_t index_within_node;
+        if (i >= left_split_count) {
             destination_node = new_node;
+            index_within_node = i - left_split_count;
         } else {
             destination_node = old_node;
+            index_within_node = i;
         }
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void* destination_cell = leaf_node_cell(destination_node, index_within_node);
 
         if (i == cursor->cell_num) {
             // save the new key/value pair
-            serialize_row(value,
-                    leaf_node_value(destination_node, index_within_node));
-            *leaf_node_key(destination_node, index_within_node) = key;
+            leaf_node_set_cell(destination_node, index_within_node, key, value);
         } else if (i > cursor->cell_num) {
             // larger key move right
-            memcpy(destination_cell, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+            leaf_node_copy_cells(destination_node, index_within_node, old_node, i - 1, 1);
         } else {
             // smaller key keep untouched
-            memcpy(destination_cell, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+            leaf_node_copy_cells(destination_node, index_within_node, old_node, i, 1);
         }
     }
 
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    *(leaf_node_num_cells(old_node)) = left_split_count;
+    *(leaf_node_num_cells(new_node)) = right_split_count;
+
+    leaf_node_reindex(table, new_page_num);
+    if (table->hash_index != NULL && cursor->cell_num < left_split_count) {
+        hash_index_put(table->hash_index, key, cursor->page_num);
+    }
+
+    // Children are about to move between internal nodes, cached paths go stale
+    table->tree_version += 1;
 
-    if (is_node_root(old_node)) {
-        return create_new_root(cursor->table, new_page_num);
+    uint32_t left_max_key = *leaf_node_key(old_node, left_split_count - 1);
+    if (cursor->path.depth == 0) {
+        create_new_root(table, new_page_num, left_max_key);
     } else {
-        uint32_t parent_page_num = *node_parent(old_node);
-        uint32_t new_max = get_node_max_key(old_node);
-        void* parent = get_page(cursor->table->pager, parent_page_num);
+        internal_node_insert(table, &cursor->path, cursor->path.depth - 1, left_max_key, new_page_num);
+    }
+}
+
+/*
+ * Remove child child_index + 1 after its contents were merged into child
+ * child_index. The merged child takes over the removed child's key, or
+ * becomes the right child if the removed one was.
+ */
+void internal_node_remove_child(Table* table, void* node, uint32_t child_index) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (table->layout.subtree_counts) {
+        uint32_t* counts = internal_node_count(&table->layout, node, 0);
+        memmove(counts + child_index + 1, counts + child_index + 2,
+                (num_keys - child_index - 1) * INTERNAL_NODE_COUNT_SIZE);
+    }
+    if (child_index + 1 == num_keys) {
+        *internal_node_right_child(node) = *internal_node_child(node, child_index);
+    } else {
+        *internal_node_key(node, child_index) = *internal_node_key(node, child_index + 1);
+        memmove(internal_node_cell(node, child_index + 1), internal_node_cell(node, child_index + 2),
+                (num_keys - child_index - 2) * INTERNAL_NODE_CELL_SIZE);
+    }
+    *internal_node_num_keys(node) = num_keys - 1;
+}
+
+/*
+ * Even out two adjacent leaves of parent, moving as many cells as needed in
+ * one go, then fix the separator between them.
+ */
+void leaf_node_balance(Table* table, void* parent, uint32_t left_index) {
+    uint32_t left_page_num = *internal_node_child(parent, left_index);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+    void* left = get_page(table->pager, left_page_num);
+    void* right = get_page(table->pager, right_page_num);
+    uint32_t left_num_cells = *leaf_node_num_cells(left);
+    uint32_t right_num_cells = *leaf_node_num_cells(right);
+    uint32_t new_left_num_cells = (left_num_cells + right_num_cells) / 2;
+    metrics_count(METRIC_LEAF_BORROWS, 1);
+
+    if (new_left_num_cells > left_num_cells) {
+        // Take cells from the front of the right leaf
+        uint32_t count = new_left_num_cells - left_num_cells;
+        leaf_node_copy_cells(left, left_num_cells, right, 0, count);
+        leaf_node_copy_cells(right, 0, right, count, right_num_cells - count);
+        *leaf_node_num_cells(left) = new_left_num_cells;
+        *leaf_node_num_cells(right) = right_num_cells - count;
+        leaf_node_reindex_cells(table, left_page_num, left_num_cells, new_left_num_cells);
+    } else {
+        // Give cells from the end of the left leaf
+        uint32_t count = left_num_cells - new_left_num_cells;
+        leaf_node_copy_cells(right, count, right, 0, right_num_cells);
+        leaf_node_copy_cells(right, 0, left, new_left_num_cells, count);
+        *leaf_node_num_cells(left) = new_left_num_cells;
+        *leaf_node_num_cells(right) = right_num_cells + count;
+        leaf_node_reindex_cells(table, right_page_num, 0, count);
+    }
+
+    *internal_node_key(parent, left_index) = *leaf_node_key(left, new_left_num_cells - 1);
+    internal_node_recount(table, parent, left_index);
+    internal_node_recount(table, parent, left_index + 1);
+}
+
+/*
+ * Append the right leaf of an adjacent pair to the left one and drop it.
+ */
+void leaf_node_merge(Table* table, void* parent, uint32_t left_index) {
+    metrics_count(METRIC_LEAF_MERGES, 1);
+    uint32_t left_page_num = *internal_node_child(parent, left_index);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+    void* left = get_page(table->pager, left_page_num);
+    void* right = get_page(table->pager, right_page_num);
+    uint32_t left_num_cells = *leaf_node_num_cells(left);
+    uint32_t right_num_cells = *leaf_node_num_cells(right);
+
+    leaf_node_copy_cells(left, left_num_cells, right, 0, right_num_cells);
+    *leaf_node_num_cells(left) = left_num_cells + right_num_cells;
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+    leaf_node_reindex_cells(table, left_page_num, left_num_cells, left_num_cells + right_num_cells);
+
+    internal_node_remove_child(table, parent, left_index);
+    internal_node_recount(table, parent, left_index);
+    pager_free_page(table->pager, right_page_num);
+    table->tree_version += 1;
+}
+
+/*
+ * Lay out the children of an adjacent pair of internal nodes in key order,
+ * with the parent's separator between the two halves.
+ */
+uint32_t internal_node_gather(Table* table, void* parent, uint32_t left_index, uint32_t* children, uint32_t* keys,
+                              uint32_t* counts) {
+    void* left = get_page(table->pager, *internal_node_child(parent, left_index));
+    void* right = get_page(table->pager, *internal_node_child(parent, left_index + 1));
+    uint32_t left_num_keys = *internal_node_num_keys(left);
+    uint32_t right_num_keys = *internal_node_num_keys(right);
+
+    if (counts != NULL) {
+        for (uint32_t i = 0; i <= left_num_keys; i++) {
+            counts[i] = *internal_node_count(&table->layout, left, i);
+        }
+        for (uint32_t i = 0; i <= right_num_keys; i++) {
+            counts[left_num_keys + 1 + i] = *internal_node_count(&table->layout, right, i);
+        }
+    }
 
-        update_internal_node_key(parent, old_max, new_max);
-        internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    uint32_t num_children = 0;
+    for (uint32_t i = 0; i < left_num_keys; i++) {
+        children[num_children] = *internal_node_child(left, i);
+        keys[num_children++] = *internal_node_key(left, i);
+    }
+    children[num_children] = *internal_node_right_child(left);
+    keys[num_children++] = *internal_node_key(parent, left_index);
+    for (uint32_t i = 0; i < right_num_keys; i++) {
+        children[num_children] = *internal_node_child(right, i);
+        keys[num_children++] = *internal_node_key(right, i);
+    }
+    children[num_children++] = *internal_node_right_child(right);
+    return num_children;
+}
+
+/*
+ * Fill an internal node with children[0, num_children) and the keys between
+ * them, and with their counts unless counts is NULL.
+ */
+void internal_node_fill(Table* table, uint32_t page_num, uint32_t* children, uint32_t* keys, uint32_t* counts,
+                        uint32_t num_children) {
+    void* node = get_page(table->pager, page_num);
+    for (uint32_t i = 0; i < num_children - 1; i++) {
+        *internal_node_cell(node, i) = children[i];
+        *internal_node_key(node, i) = keys[i];
+    }
+    *internal_node_num_keys(node) = num_children - 1;
+    *internal_node_right_child(node) = children[num_children - 1];
+    if (counts != NULL) {
+        memcpy(internal_node_count(&table->layout, node, 0), counts, num_children * INTERNAL_NODE_COUNT_SIZE);
+    }
+}
+
+// Scratch space for the children of two internal nodes
+uint32_t* internal_node_scratch(Table* table) {
+    return arena_alloc(table->arena, (2 * table->layout.internal_max_cells + 2) * sizeof(uint32_t));
+}
+
+void internal_node_balance(Table* table, void* parent, uint32_t left_index) {
+    metrics_count(METRIC_INTERNAL_BORROWS, 1);
+    uint32_t* children = internal_node_scratch(table);
+    uint32_t* keys = internal_node_scratch(table);
+    uint32_t* counts = table->layout.subtree_counts ? internal_node_scratch(table) : NULL;
+    uint32_t num_children = internal_node_gather(table, parent, left_index, children, keys, counts);
+    uint32_t left_num_children = num_children / 2;
+
+    internal_node_fill(table, *internal_node_child(parent, left_index), children, keys, counts, left_num_children);
+    internal_node_fill(table, *internal_node_child(parent, left_index + 1),
+                       children + left_num_children, keys + left_num_children,
+                       counts == NULL ? NULL : counts + left_num_children, num_children - left_num_children);
+    *internal_node_key(parent, left_index) = keys[left_num_children - 1];
+    internal_node_recount(table, parent, left_index);
+    internal_node_recount(table, parent, left_index + 1);
+    table->tree_version += 1;
+}
+
+void internal_node_merge(Table* table, void* parent, uint32_t left_index) {
+    metrics_count(METRIC_INTERNAL_MERGES, 1);
+    uint32_t* children = internal_node_scratch(table);
+    uint32_t* keys = internal_node_scratch(table);
+    uint32_t* counts = table->layout.subtree_counts ? internal_node_scratch(table) : NULL;
+    uint32_t num_children = internal_node_gather(table, parent, left_index, children, keys, counts);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+
+    internal_node_fill(table, *internal_node_child(parent, left_index), children, keys, counts, num_children);
+    internal_node_remove_child(table, parent, left_index);
+    internal_node_recount(table, parent, left_index);
+    pager_free_page(table->pager, right_page_num);
+    table->tree_version += 1;
+}
+
+/*
+ * The root is down to a single child: pull that child up into the root page
+ * so the tree loses a level and the root stays at root_page_num.
+ */
+void collapse_root(Table* table) {
+    metrics_count(METRIC_ROOT_COLLAPSES, 1);
+    void* root = get_page(table->pager, table->root_page_num);
+    uint32_t child_page_num = *internal_node_right_child(root);
+    void* child = get_page(table->pager, child_page_num);
+
+    memcpy(root, child, table->layout.page_size);
+    set_node_root(root, true);
+    leaf_node_reindex(table, table->root_page_num);
+
+    pager_free_page(table->pager, child_page_num);
+    table->tree_version += 1;
+}
+
+/*
+ * Fix the internal node at path level `level` after it lost a child. Its
+ * siblings and parent come straight from the path, so this is O(height).
+ */
+void internal_node_rebalance(Table* table, TreePath* path, uint32_t level) {
+    void* node = get_page(table->pager, path->page_num[level]);
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    if (level == 0) {
+        if (num_keys == 0) {
+            collapse_root(table);
+        }
         return;
     }
+    if (num_keys >= table->layout.internal_min_keys) return;
+
+    void* parent = get_page(table->pager, path->page_num[level - 1]);
+    uint32_t child_index = path->child_index[level - 1];
+    uint32_t parent_num_keys = *internal_node_num_keys(parent);
+
+    if (child_index > 0) {
+        void* left = get_page(table->pager, *internal_node_child(parent, child_index - 1));
+        if (*internal_node_num_keys(left) > table->layout.internal_min_keys) {
+            internal_node_balance(table, parent, child_index - 1);
+            return;
+        }
+    }
+    if (child_index < parent_num_keys) {
+        void* right = get_page(table->pager, *internal_node_child(parent, child_index + 1));
+        if (*internal_node_num_keys(right) > table->layout.internal_min_keys) {
+            internal_node_balance(table, parent, child_index);
+            return;
+        }
+    }
+
+    internal_node_merge(table, parent, child_index > 0 ? child_index - 1 : child_index);
+    internal_node_rebalance(table, path, level - 1);
+}
+
+/*
+ * The cursor's leaf fell under the minimum fill. Borrow from a sibling
+ * that can spare cells, otherwise merge with one and let the parent
+ * rebalance in turn.
+ */
+void leaf_node_rebalance(Cursor* cursor) {
+    Table* table = cursor->table;
+    TreePath* path = &cursor->path;
+
+    uint32_t level = path->depth - 1;
+    void* parent = get_page(table->pager, path->page_num[level]);
+    uint32_t child_index = path->child_index[level];
+    uint32_t num_keys = *internal_node_num_keys(parent);
+
+    if (child_index > 0) {
+        void* left = get_page(table->pager, *internal_node_child(parent, child_index - 1));
+        if (*leaf_node_num_cells(left) > table->layout.leaf_min_cells) {
+            leaf_node_balance(table, parent, child_index - 1);
+            return;
+        }
+    }
+    if (child_index < num_keys) {
+        void* right = get_page(table->pager, *internal_node_child(parent, child_index + 1));
+        if (*leaf_node_num_cells(right) > table->layout.leaf_min_cells) {
+            leaf_node_balance(table, parent, child_index);
+            return;
+        }
+    }
+
+    leaf_node_merge(table, parent, child_index > 0 ? child_index - 1 : child_index);
+    internal_node_rebalance(table, path, level);
+}
+
+uint32_t collect_internal_pages(Pager* pager, uint32_t page_num, uint32_t* pages, uint32_t num_pages) {
+    void* node = get_page(pager, page_num);
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        uint32_t child_page_num = *internal_node_child(node, i);
+        if (get_node_type(get_page(pager, child_page_num)) == NODE_INTERNAL) {
+            pages[num_pages++] = child_page_num;
+            num_pages = collect_internal_pages(pager, child_page_num, pages, num_pages);
+        }
+    }
+    return num_pages;
+}
+
+/*
+ * How many of the `remaining` nodes to put in the next group of a level
+ * built left to right: full groups, except that the last two share evenly
+ * when the last one would fall under min_size.
+ */
+uint32_t compact_group_size(uint32_t remaining, uint32_t max_size, uint32_t min_size) {
+    if (remaining <= max_size) return remaining;
+    if (remaining - max_size < min_size) return remaining / 2;
+    return max_size;
+}
+
+/*
+ * Build internal levels bottom-up over a level of num_pages nodes, grouping
+ * up to max_children under each parent, until one node is left. pages,
+ * max_keys and counts (NULL without subtree counts) describe the level and
+ * are overwritten by each level above it. Returns the page of the top node,
+ * or 0 when supply runs out of pages.
+ */
+uint32_t build_internal_levels(Table* table, uint32_t* pages, uint32_t* max_keys, uint32_t* counts,
+                               uint32_t num_pages, uint32_t max_children, InternalPageSupply* supply) {
+    Pager* pager = table->pager;
+    uint32_t level_size = num_pages;
+    while (level_size > 1) {
+        uint32_t num_parents = 0;
+        for (uint32_t start = 0; start < level_size;) {
+            uint32_t count = compact_group_size(level_size - start, max_children,
+                                                table->layout.internal_min_keys + 1);
+            uint32_t page_num;
+            if (count == level_size && supply->top_page_num != 0) {
+                page_num = supply->top_page_num;
+            } else if (supply->num_spare_used < supply->num_spare_pages) {
+                page_num = supply->spare_pages[supply->num_spare_used++];
+            } else {
+                page_num = get_unused_page_num(pager);
+            }
+            if (page_num >= TABLE_MAX_PAGES) return 0;
+            initialize_internal_node(get_page(pager, page_num));
+            internal_node_fill(table, page_num, pages + start, max_keys + start,
+                               counts == NULL ? NULL : counts + start, count);
+
+            // Parents never outrun the children still to be read
+            if (counts != NULL) {
+                uint32_t total = 0;
+                for (uint32_t i = start; i < start + count; i++) {
+                    total += counts[i];
+                }
+                counts[num_parents] = total;
+            }
+            pages[num_parents] = page_num;
+            max_keys[num_parents] = max_keys[start + count - 1];
+            num_parents++;
+            start += count;
+        }
+        level_size = num_parents;
+    }
+    return pages[0];
+}
+
+/*
+ * Rebuild the whole tree in one pass: walk the leaf chain purging
+ * tombstones and packing cells into as few leaves as possible, reusing the
+ * leaf pages in place, then lay fresh internal levels over them on the old
+ * internal pages. The root stays at root_page_num. Returns the number of
+ * pages freed.
+ */
+uint32_t compact_tree(Table* table) {
+    Pager* pager = table->pager;
+    metrics_count(METRIC_COMPACTIONS, 1);
+    table->data_version += 1;
+    void* root = get_page(pager, table->root_page_num);
+    if (get_node_type(root) == NODE_LEAF) {
+        leaf_node_purge(table, table->root_page_num);
+        return 0;
+    }
+
+    uint32_t* internal_pages = malloc(pager->num_pages * sizeof(uint32_t));
+    uint32_t num_internal_pages = collect_internal_pages(pager, table->root_page_num, internal_pages, 0);
+
+    uint32_t* leaf_pages = malloc(pager->num_pages * sizeof(uint32_t));
+    uint32_t* max_keys = malloc(pager->num_pages * sizeof(uint32_t));
+    uint32_t* counts = table->layout.subtree_counts ? malloc(pager->num_pages * sizeof(uint32_t)) : NULL;
+    uint32_t num_leaves = 0;
+    for (uint32_t page_num = leftmost_leaf(table, table->root_page_num); page_num != 0;) {
+        leaf_pages[num_leaves++] = page_num;
+        page_num = *leaf_node_next_leaf(get_page(pager, page_num));
+    }
+
+    /*
+     * Cells only ever move towards the front of the chain, so packing in
+     * place never overwrites a cell that has not been read yet.
+     */
+    uint32_t write_leaf = 0;
+    uint32_t write_cell = 0;
+    void* destination = get_page(pager, leaf_pages[0]);
+    for (uint32_t i = 0; i < num_leaves; i++) {
+        void* source = get_page(pager, leaf_pages[i]);
+        uint32_t num_cells = *leaf_node_num_cells(source);
+        for (uint32_t j = 0; j < num_cells; j++) {
+            if (layout_leaf_is_tombstone(&table->layout, source, j)) continue;
+            if (write_cell == table->layout.leaf_max_cells) {
+                *leaf_node_num_cells(destination) = write_cell;
+                destination = get_page(pager, leaf_pages[++write_leaf]);
+                write_cell = 0;
+            }
+            leaf_node_copy_cells(destination, write_cell, source, j, 1);
+            write_cell++;
+        }
+    }
+    *leaf_node_num_cells(destination) = write_cell;
+    uint32_t num_leaves_used = write_leaf + 1;
+
+    uint32_t max_cells = table->layout.leaf_max_cells;
+    if (num_leaves_used > 1 && write_cell < table->layout.leaf_min_cells) {
+        // Even out the last two leaves
+        void* previous = get_page(pager, leaf_pages[num_leaves_used - 2]);
+        uint32_t count = (max_cells - write_cell) / 2;
+        leaf_node_copy_cells(destination, count, destination, 0, write_cell);
+        leaf_node_copy_cells(destination, 0, previous, max_cells - count, count);
+        *leaf_node_num_cells(previous) = max_cells - count;
+        *leaf_node_num_cells(destination) = write_cell + count;
+    }
+
+    for (uint32_t i = 0; i < num_leaves_used; i++) {
+        void* leaf = get_page(pager, leaf_pages[i]);
+        *leaf_node_next_leaf(leaf) = i + 1 < num_leaves_used ? leaf_pages[i + 1] : 0;
+        uint32_t num_cells = *leaf_node_num_cells(leaf);
+        max_keys[i] = num_cells > 0 ? layout_leaf_key(&table->layout, leaf, num_cells - 1) : 0;
+        if (counts != NULL) {
+            counts[i] = num_cells;
+        }
+        leaf_node_reindex(table, leaf_pages[i]);
+    }
+
+    uint32_t num_pages_freed = 0;
+    for (uint32_t i = num_leaves_used; i < num_leaves; i++) {
+        pager_free_page(pager, leaf_pages[i]);
+        num_pages_freed++;
+    }
+
+    // The single node on top is written straight into the root page
+    InternalPageSupply supply = {table->root_page_num, internal_pages, num_internal_pages, 0};
+    uint32_t* level_pages = leaf_pages;
+    if (build_internal_levels(table, level_pages, max_keys, counts, num_leaves_used,
+                              table->layout.internal_max_cells + 1, &supply) == 0) {
+        printf("Table full while compacting.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t next_internal_page = supply.num_spare_used;
+
+    if (num_leaves_used == 1) {
+        // Everything fits in one leaf, which becomes the root
+        memcpy(root, get_page(pager, level_pages[0]), table->layout.page_size);
+        pager_free_page(pager, level_pages[0]);
+        leaf_node_reindex(table, table->root_page_num);
+        num_pages_freed++;
+    }
+    set_node_root(root, true);
+
+    for (uint32_t i = next_internal_page; i < num_internal_pages; i++) {
+        pager_free_page(pager, internal_pages[i]);
+        num_pages_freed++;
+    }
+
+    free(internal_pages);
+    free(leaf_pages);
+    free(max_keys);
+    free(counts);
+
+    table->num_tombstones = 0;
+    table->tree_version += 1;
+    return num_pages_freed;
 }
 
 uint32_t* leaf_node_next_leaf(void* node) {
@@ -667,7 +1385,11 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
             printf("- leaf (size %d)\n", num_keys);
             for (uint32_t i = 0; i < num_keys; i++) {
                 indent(indentation_level + 1);
-                printf("- %d\n", *leaf_node_key(node, i));
+                if (leaf_node_is_tombstone(node, i)) {
+                    printf("- %d (tombstone)\n", *leaf_node_key(node, i));
+                } else {
+                    printf("- %d\n", *leaf_node_key(node, i));
+                }
             }
             break;
     }
@@ -0,0 +1,491 @@
+//
+// Created by aagu on 20-4-10.
+//
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zconf.h>
+#include "database.h"
+#include "utils.h"
+#include "btree.h"
+#include "hash_index.h"
+#include "parallel_scan.h"
+#include "explain.h"
+#include "metrics.h"
+
+char* hash_index_filename(const char* filename) {
+    char* index_filename = malloc(strlen(filename) + strlen(".hidx") + 1);
+    strcpy(index_filename, filename);
+    strcat(index_filename, ".hidx");
+    return index_filename;
+}
+
+void db_options_init(DbOptions* options) {
+    options->page_size = DEFAULT_PAGE_SIZE;
+    options->leaf_format = LEAF_FORMAT_ROW;
+    options->subtree_counts = false;
+    options->direct_io = false;
+    options->huge_pages = false;
+}
+
+/*
+ * Open the database in filename, creating it as options say if it does not
+ * exist yet.
+ */
+Table* db_open(const char* filename, DbOptions* options) {
+    Pager* pager = pager_open(filename, options->page_size, options->huge_pages);
+    if (options->huge_pages && !pager->huge_tlb) {
+        printf("Not enough huge pages reserved, using transparent huge pages.\n");
+    }
+    if (options->direct_io && !pager_set_direct_io(pager, true)) {
+        printf("Direct I/O is not available for this file, using the OS page cache.\n");
+    }
+    void* header = get_page(pager, FILE_HEADER_PAGE_NUM);
+    uint32_t* root_page_num = file_header_root_page(header);
+    uint32_t* flags = file_header_flags(header);
+    if (*root_page_num == 0) {
+        if (options->leaf_format == LEAF_FORMAT_PAX) *flags |= FILE_FLAG_PAX_LEAVES;
+        if (options->subtree_counts) *flags |= FILE_FLAG_SUBTREE_COUNTS;
+    }
+    LeafFormat leaf_format = (*flags & FILE_FLAG_PAX_LEAVES) ? LEAF_FORMAT_PAX : LEAF_FORMAT_ROW;
+    bool subtree_counts = (*flags & FILE_FLAG_SUBTREE_COUNTS) != 0;
+
+    Table* table = malloc(sizeof(Table));
+    table->filename = filename;
+    table->pager = pager;
+    node_layout_init(&table->layout, pager->page_size, leaf_format, subtree_counts);
+    table->hash_index = NULL;
+    table->key_filter = NULL;
+    table->hot_leaf_page_num = 0;
+    table->hot_leaf_version = 0;
+    table->tree_version = 0;
+    table->data_version = *file_header_data_version(header);
+    table->lazy_delete = false;
+    table->num_tombstones = 0;
+    table->scan_threads = 1;
+    memset(&table->counters, 0, sizeof(QueryCounters));
+    table->arena = arena_new();
+
+    bool new_file = *root_page_num == 0;
+    if (new_file) {
+        // New database file. The root starts as a leaf right after the header
+        *root_page_num = get_unused_page_num(pager);
+        void* root_node = get_page(pager, *root_page_num);
+        initialize_leaf_node(root_node, &table->layout);
+        set_node_root(root_node, true);
+    }
+    table->root_page_num = *root_page_num;
+
+    /*
+     * The hash index is enabled once created and stays enabled. An index
+     * left over from another file, or from this one before a backup was
+     * restored over it, is rebuilt from the tree.
+     */
+    char* index_filename = hash_index_filename(filename);
+    if (access(index_filename, F_OK) == 0) {
+        table->hash_index = hash_index_open(index_filename, pager->page_size);
+        uint32_t index_version = *file_header_data_version(get_page(table->hash_index, FILE_HEADER_PAGE_NUM));
+        if (new_file || index_version != table->data_version) {
+            hash_index_close(table->hash_index);
+            table->hash_index = NULL;
+            unlink(index_filename);
+            create_hash_index(table);
+        }
+    }
+    free(index_filename);
+
+    table_rebuild_filter(table);
+
+    return table;
+}
+
+void db_close(Table* table) {
+    *file_header_data_version(get_page(table->pager, FILE_HEADER_PAGE_NUM)) = table->data_version;
+    pager_close(table->pager);
+    if (table->hash_index != NULL) {
+        *file_header_data_version(get_page(table->hash_index, FILE_HEADER_PAGE_NUM)) = table->data_version;
+        hash_index_close(table->hash_index);
+    }
+    bloom_filter_free(table->key_filter);
+    arena_free(table->arena);
+
+    free(table);
+}
+
+void create_hash_index(Table* table) {
+    if (table->hash_index != NULL) {
+        return;
+    }
+
+    char* index_filename = hash_index_filename(table->filename);
+    table->hash_index = hash_index_open(index_filename, table->pager->page_size);
+    free(index_filename);
+
+    Cursor* cursor = table_start(table);
+    while (!(cursor->end_of_table)) {
+        void* node = get_page(table->pager, cursor->page_num);
+        hash_index_put(table->hash_index, *leaf_node_key(node, cursor->cell_num), cursor->page_num);
+        cursor_advance(cursor);
+    }
+}
+
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+    Row* row_to_insert = &(statement->row_to_manipulate);
+    uint32_t key_to_insert = row_to_insert->id;
+
+    // Unique ids miss the filter and skip the duplicate check entirely
+    bool may_exist = bloom_filter_may_contain(table->key_filter, key_to_insert);
+
+    if (may_exist && table->hash_index != NULL && table_index_find(table, key_to_insert) != NULL) {
+        return EXECUTE_DUPLICATE_KEY;
+    }
+
+    Cursor* cursor = table_find(table, key_to_insert);
+
+    void* node = get_page(cursor->table->pager, cursor->page_num);
+    uint32_t num_cells = (*leaf_node_num_cells(node));
+
+    if (may_exist && cursor->cell_num < num_cells) {
+        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+        if (key_at_index == key_to_insert && !leaf_node_is_tombstone(node, cursor->cell_num)) {
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    table->data_version += 1;
+    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+
+    if (table->key_filter->num_keys > table->key_filter->capacity) {
+        table_rebuild_filter(table);
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+int compare_row_ids(const void* a, const void* b) {
+    uint32_t x = ((const Row*)a)->id;
+    uint32_t y = ((const Row*)b)->id;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Insert many rows at once. The rows are sorted by id and applied a leaf at
+ * a time, so clustered ids cost about one descent per leaf instead of one
+ * per row. Nothing is inserted when any id is a duplicate.
+ */
+ExecuteResult execute_insert_batch(Table* table, Row* rows, uint32_t num_rows) {
+    qsort(rows, num_rows, sizeof(Row), compare_row_ids);
+
+    for (uint32_t i = 0; i < num_rows; i++) {
+        if (i > 0 && rows[i].id == rows[i - 1].id) {
+            return EXECUTE_DUPLICATE_KEY;
+        }
+        if (!bloom_filter_may_contain(table->key_filter, rows[i].id)) continue;
+
+        Cursor* cursor = table_lookup(table, rows[i].id);
+        if (cursor->end_of_table) continue;
+        void* node = get_page(table->pager, cursor->page_num);
+        if (cursor->cell_num < *leaf_node_num_cells(node) &&
+            *leaf_node_key(node, cursor->cell_num) == rows[i].id &&
+            !leaf_node_is_tombstone(node, cursor->cell_num)) {
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    table->data_version += 1;
+    uint32_t first = 0;
+    while (first < num_rows) {
+        Cursor* cursor = table_find(table, rows[first].id);
+
+        uint32_t last = num_rows;
+        uint32_t upper_bound;
+        if (tree_path_upper_bound(table, &cursor->path, &upper_bound)) {
+            last = first + 1;
+            while (last < num_rows && rows[last].id <= upper_bound) {
+                last++;
+            }
+        }
+
+        leaf_node_insert_batch(cursor, rows + first, last - first);
+        first = last;
+    }
+
+    if (table->key_filter->num_keys > table->key_filter->capacity) {
+        table_rebuild_filter(table);
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+void print_row(Row* row) {
+    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+}
+
+// Print only the given columns, in table order
+void print_row_columns(Row* row, uint32_t columns) {
+    fprint_row_columns(stdout, row, columns);
+}
+
+void fprint_row_columns(FILE* output, Row* row, uint32_t columns) {
+    if (columns == COLUMN_ALL) {
+        fprintf(output, "(%d, %s, %s)\n", row->id, row->username, row->email);
+        return;
+    }
+
+    const char* separator = "";
+    fprintf(output, "(");
+    if (columns & COLUMN_ID) {
+        fprintf(output, "%d", row->id);
+        separator = ", ";
+    }
+    if (columns & COLUMN_USERNAME) {
+        fprintf(output, "%s%s", separator, row->username);
+        separator = ", ";
+    }
+    if (columns & COLUMN_EMAIL) {
+        fprintf(output, "%s%s", separator, row->email);
+    }
+    fprintf(output, ")\n");
+}
+
+/*
+ * Rows the where clause selects, as the difference of two ranks. Needs
+ * subtree counts.
+ */
+uint64_t count_in_range(Table* table, WhereClause clause) {
+    uint64_t lower = 0;
+    uint64_t upper;
+    if (clause.type >= EQUAL) {
+        lower = table_rank(table, clause.id);
+    }
+    if (clause.type == LESS) {
+        upper = table_rank(table, clause.id);
+    } else if ((clause.type == LESS_OR_EQUAL || clause.type == EQUAL) && clause.id < UINT32_MAX) {
+        upper = table_rank(table, clause.id + 1);
+    } else {
+        upper = table_count_rows(table);
+    }
+    return upper > lower ? upper - lower : 0;
+}
+
+/*
+ * How a select reaches its rows. execute_select() and execute_aggregate()
+ * follow it, and explain prints it.
+ */
+AccessPath select_access_path(Statement* statement, Table* table) {
+    AggregateType aggregate = statement->aggregate;
+    EqualType type = statement->clause.type;
+    if (aggregate == AGGREGATE_COUNT && table->layout.subtree_counts) return ACCESS_SUBTREE_COUNTS;
+    if (aggregate == AGGREGATE_MAX && type == NO_CONSTRAIN) return ACCESS_RIGHTMOST_LEAF;
+    if (type == EQUAL) return ACCESS_POINT_LOOKUP;
+
+    // MIN stops at the first key anyway, and paging needs the rows in order from the start
+    bool paged = aggregate == AGGREGATE_NONE && (statement->offset > 0 || statement->limit != UINT32_MAX);
+    if (table->scan_threads > 1 && aggregate != AGGREGATE_MIN && !paged) return ACCESS_PARALLEL_SCAN;
+    return type > EQUAL ? ACCESS_SEEK : ACCESS_FULL_SCAN;
+}
+
+// Cursor at the first row a serial access path reads
+Cursor* access_path_start(AccessPath path, Statement* statement, Table* table) {
+    if (path == ACCESS_POINT_LOOKUP) {
+        return table_lookup(table, statement->clause.id);
+    } else if (path == ACCESS_SEEK) {
+        return table_find(table, statement->clause.id);
+    }
+    return table_start(table);
+}
+
+/*
+ * Aggregates over id never build rows. With subtree counts COUNT is two
+ * rank lookups, and MAX without a where clause comes straight from the
+ * rightmost leaf. Everything else walks the keys of the leaves in range a
+ * page at a time, and COUNT takes whole leaves at once when their last key
+ * is still in range and no cell is a tombstone. With more than one scan
+ * thread the walk is split across threads, except for MIN, which stops at
+ * the first key anyway.
+ */
+ExecuteResult execute_aggregate(Statement* statement, Table* table) {
+    AggregateType aggregate = statement->aggregate;
+    WhereClause clause = statement->clause;
+    bool print = statement->explain == EXPLAIN_NONE;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint32_t min_key = 0;
+    uint32_t max_key = 0;
+
+    // The single result row can still be paged away
+    if (statement->offset > 0 || statement->limit == 0) {
+        if (print) printf("0 row\n");
+        return EXECUTE_SUCCESS;
+    }
+
+    AccessPath path = select_access_path(statement, table);
+    if (path == ACCESS_SUBTREE_COUNTS) {
+        count = count_in_range(table, clause);
+    } else if (path == ACCESS_RIGHTMOST_LEAF) {
+        count = table_max_key(table, &max_key) ? 1 : 0;
+    } else if (path == ACCESS_PARALLEL_SCAN) {
+        ScanTotals totals;
+        parallel_aggregate(table, clause, aggregate == AGGREGATE_COUNT, &totals);
+        count = totals.count;
+        sum = totals.sum;
+        max_key = totals.max_key;
+    } else {
+        Cursor* cursor = access_path_start(path, statement, table);
+        uint32_t page_num = cursor->end_of_table ? 0 : cursor->page_num;
+        uint32_t cell_num = cursor->cell_num;
+        bool done = false;
+        while (page_num != 0 && !done) {
+            void* node = get_page(table->pager, page_num);
+            uint32_t num_cells = *leaf_node_num_cells(node);
+            if (aggregate == AGGREGATE_COUNT && table->num_tombstones == 0 && cell_num < num_cells &&
+                where_key_satisfied(layout_leaf_key(&table->layout, node, num_cells - 1), clause)) {
+                // Keys are sorted, the rest of the leaf is in range
+                count += num_cells - cell_num;
+                table->counters.rows_examined += num_cells - cell_num;
+                cell_num = num_cells;
+            }
+            for (; cell_num < num_cells; cell_num++) {
+                if (layout_leaf_is_tombstone(&table->layout, node, cell_num)) continue;
+                uint32_t key = layout_leaf_key(&table->layout, node, cell_num);
+                table->counters.rows_examined += 1;
+                if (!where_key_satisfied(key, clause)) {
+                    done = true;
+                    break;
+                }
+                if (count == 0) min_key = key;
+                max_key = key;
+                count += 1;
+                sum += key;
+                if (aggregate == AGGREGATE_MIN) {
+                    done = true;
+                    break;
+                }
+            }
+            page_num = *leaf_node_next_leaf(node);
+            cell_num = 0;
+            if (page_num != 0 && !done) {
+                table->counters.leaves_visited += 1;
+            }
+        }
+    }
+    table->counters.rows_returned += 1;
+    if (!print) {
+        return EXECUTE_SUCCESS;
+    }
+
+    if (aggregate == AGGREGATE_COUNT) {
+        printf("(%" PRIu64 ")\n", count);
+    } else if (count == 0) {
+        printf("(NULL)\n");
+    } else if (aggregate == AGGREGATE_SUM) {
+        printf("(%" PRIu64 ")\n", sum);
+    } else {
+        printf("(%u)\n", aggregate == AGGREGATE_MIN ? min_key : max_key);
+    }
+    printf("1 row\n");
+
+    return EXECUTE_SUCCESS;
+}
+
+void print_row_count(uint64_t row_count) {
+    if (row_count > 1) {
+        printf("%" PRIu64 " rows\n", row_count);
+    } else {
+        printf("%" PRIu64 " row\n", row_count);
+    }
+}
+
+/*
+ * Under explain analyze the rows are read as usual but not printed.
+ */
+ExecuteResult execute_select(Statement* statement, Table* table) {
+    if (statement->aggregate != AGGREGATE_NONE) {
+        return execute_aggregate(statement, table);
+    }
+
+    bool print = statement->explain == EXPLAIN_NONE;
+    AccessPath path = select_access_path(statement, table);
+    if (path == ACCESS_PARALLEL_SCAN) {
+        uint64_t row_count = parallel_select(table, statement->clause, statement->columns, print ? stdout : NULL);
+        table->counters.rows_returned += row_count;
+        if (print) print_row_count(row_count);
+        return EXECUTE_SUCCESS;
+    }
+
+    Cursor* cursor = access_path_start(path, statement, table);
+    cursor_skip_tombstones(cursor);
+    cursor_skip_rows(cursor, statement->offset);
+
+    // The where clause needs the id even when it is not printed
+    uint32_t columns = statement->columns;
+    if (statement->clause.type != NO_CONSTRAIN) {
+        columns |= COLUMN_ID;
+    }
+
+    uint32_t row_count = 0;
+    Row row;
+    while (!(cursor->end_of_table) && row_count < statement->limit) {
+        cursor_read_row(cursor, &row, columns);
+        table->counters.rows_examined += 1;
+        if (!where_constrain_satisfied(&row, statement->clause)) break;
+        if (print) print_row_columns(&row, statement->columns);
+        row_count += 1;
+        cursor_advance(cursor);
+    }
+    table->counters.rows_returned += row_count;
+    if (print) print_row_count(row_count);
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_delete(Statement* statement, Table* table) {
+    Row* row_to_remove = &(statement->row_to_manipulate);
+    uint32_t key_to_remove = row_to_remove->id;
+    Cursor* cursor = table_find(table, key_to_remove);
+
+    void* node = get_page(cursor->table->pager, cursor->page_num);
+    uint32_t num_cells = (*leaf_node_num_cells(node));
+
+    if (cursor->cell_num < num_cells) {
+        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+        if (key_at_index == key_to_remove && !leaf_node_is_tombstone(node, cursor->cell_num)) {
+            table->data_version += 1;
+            leaf_node_delete(cursor, key_to_remove);
+        }
+    }
+
+    // Once most cells are tombstones, reorganize them all in one pass
+    if (table->lazy_delete && table->num_tombstones > table->key_filter->num_keys) {
+        compact_tree(table);
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement(Statement* statement, Table* table) {
+    uint64_t start = metrics_now_ns();
+    ExecuteResult result;
+    switch (statement->type) {
+        case (STATEMENT_INSERT):
+            result = execute_insert(statement, table);
+            break;
+        case (STATEMENT_INSERT_BATCH):
+            result = execute_insert_batch(table, statement->rows, statement->num_rows);
+            break;
+        case (STATEMENT_SELECT):
+            if (statement->explain != EXPLAIN_NONE) {
+                result = execute_explain(statement, table);
+            } else {
+                result = execute_select(statement, table);
+            }
+            break;
+        case STATEMENT_DELETE:
+            result = execute_delete(statement, table);
+            break;
+    }
+    metrics_record_statement(statement->type, metrics_now_ns() - start);
+    return result;
+}
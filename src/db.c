@@ -8,6 +8,13 @@
 #include "table.h"
 #include "btree.h"
 #include "pager.h"
+#include "database.h"
+#include "transfer.h"
+#include "backup.h"
+#include "rebuild.h"
+#include "parallel_scan.h"
+#include "metrics.h"
+#include "analyze.h"
 
 typedef struct {
     char* buffer;
@@ -15,11 +22,16 @@ typedef struct {
     ssize_t input_length;
 } InputBuffer;
 
-typedef enum {
-    EXECUTE_SUCCESS,
-    EXECUTE_DUPLICATE_KEY,
-    EXECUTE_TABLE_FULL
-} ExecuteResult;
+/*
+ * A backup and a rebuild taken in steps, one step after every command until
+ * they are complete, so statements run while they copy.
+ */
+typedef struct {
+    Backup* backup;
+    uint32_t backup_pages; // pages per step
+    Rebuild* rebuild;
+    uint32_t rebuild_leaves; // leaves per step
+} StepTasks;
 
 typedef enum {
     META_COMMAND_SUCCESS,
@@ -64,80 +76,376 @@ void close_input_buffer(InputBuffer* input_buffer) {
     free(input_buffer);
 }
 
-Table* db_open(const char* filename) {
-    Pager* pager = pager_open(filename);
+void print_constants(Table* table) {
+    printf("ROW_SIZE: %d\n", ROW_SIZE);
+    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", table->layout.leaf_space_for_cells);
+    printf("LEAF_NODE_MAX_CELLS: %d\n", table->layout.leaf_max_cells);
+}
+
+/*
+ * ".stats" prints the engine metrics, ".stats <json|prometheus> <path>"
+ * writes them to a file.
+ */
+MetaCommandResult do_stats_command(InputBuffer* input_buffer, Table* table) {
+    if (strcmp(input_buffer->buffer, ".stats") == 0) {
+        metrics_write(table, stdout, METRICS_TEXT);
+        return META_COMMAND_SUCCESS;
+    }
+
+    char* arguments = strdup(input_buffer->buffer);
+    strtok(arguments, " ");
+    char* format_name = strtok(NULL, " ");
+    char* path = strtok(NULL, " ");
+    MetricsFormat format;
+    if (format_name == NULL || path == NULL || strtok(NULL, " ") != NULL ||
+        !metrics_parse_format(format_name, &format)) {
+        free(arguments);
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+
+    FILE* output = fopen(path, "w");
+    if (output == NULL) {
+        printf("Error: could not write stats to '%s'.\n", path);
+    } else {
+        metrics_write(table, output, format);
+        fclose(output);
+        printf("Wrote stats to '%s'.\n", path);
+    }
+    free(arguments);
+    return META_COMMAND_SUCCESS;
+}
 
-    Table* table = malloc(sizeof(Table));
-    table->pager = pager;
-    table->root_page_num = 0;
+/*
+ * ".import <csv|binary> <path>" and ".export <csv|binary> <path>".
+ */
+MetaCommandResult do_transfer_command(InputBuffer* input_buffer, Table* table) {
+    // Tokenize a copy, the buffer is still printed for unrecognized commands
+    char* arguments = strdup(input_buffer->buffer);
+    char* command = strtok(arguments, " ");
+    char* format_name = strtok(NULL, " ");
+    char* path = strtok(NULL, " ");
+    TransferFormat format;
+    if (format_name == NULL || path == NULL || strtok(NULL, " ") != NULL ||
+        !transfer_parse_format(format_name, &format)) {
+        free(arguments);
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
 
-    if (pager->num_pages == 0) {
-        // New database file. Initialize page 0 as leaf node
-        void* root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
+    TransferStats stats;
+    if (strcmp(command, ".import") == 0) {
+        TransferResult result = table_import(table, path, format, &stats);
+        transfer_print_result("Imported", path, result, &stats);
+    } else {
+        TransferResult result = table_export(table, path, format, &stats);
+        transfer_print_result("Exported", path, result, &stats);
     }
+    free(arguments);
+    return META_COMMAND_SUCCESS;
+}
 
-    return table;
+void finish_backup(StepTasks* tasks, BackupResult result) {
+    Backup* backup = tasks->backup;
+    uint32_t num_pages = backup->num_pages;
+    char* path = strdup(backup->path);
+    if (backup_finish(backup) == BACKUP_DONE && result == BACKUP_DONE) {
+        printf("Backed up %u pages.\n", num_pages);
+    } else {
+        printf("Error: could not back up to '%s'.\n", path);
+    }
+    free(path);
+    tasks->backup = NULL;
 }
 
-void db_close(Table* table) {
-    Pager* pager = table->pager;
+void finish_rebuild(StepTasks* tasks, RebuildResult result) {
+    Rebuild* rebuild = tasks->rebuild;
+    if (result == REBUILD_DONE) {
+        // first_page_num is where the file ended when the last restart began
+        printf("Rebuilt tree in %u pages, was %u, after %u restarts.\n",
+               rebuild->table->pager->num_pages - 1, rebuild->first_page_num - 1, rebuild->num_restarts);
+    } else {
+        printf("Error: table full, no room to rebuild.\n");
+    }
+    rebuild_free(rebuild);
+    tasks->rebuild = NULL;
+}
 
-    for (uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
+// One step of whatever is running, or all that is left of it when finish is set
+void run_steps(StepTasks* tasks, bool finish) {
+    if (tasks->backup != NULL) {
+        BackupResult result = backup_step(tasks->backup, finish ? UINT32_MAX : tasks->backup_pages);
+        if (result != BACKUP_MORE) {
+            finish_backup(tasks, result);
+        }
+    }
+    if (tasks->rebuild != NULL) {
+        RebuildResult result = rebuild_step(tasks->rebuild, finish ? UINT32_MAX : tasks->rebuild_leaves);
+        if (result != REBUILD_MORE) {
+            finish_rebuild(tasks, result);
         }
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
     }
+}
 
-    int result = close(pager->file_descriptor);
-    if (result == -1) {
-        printf("Error closing db file.\n");
-        exit(EXIT_FAILURE);
+// Digits only, from 1 to UINT32_MAX, into value
+bool parse_step_size(char* text, uint32_t* value) {
+    char* end;
+    unsigned long number = strtoul(text, &end, 10);
+    if (*text < '0' || *text > '9' || *end != '\0' || number == 0 || number > UINT32_MAX) {
+        return false;
     }
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; ++i) {
-        void* page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
+    *value = number;
+    return true;
+}
+
+/*
+ * ".backup <path>" copies the database in one go, ".backup <path> <pages>"
+ * copies that many pages after each command from here on.
+ */
+MetaCommandResult do_backup_command(InputBuffer* input_buffer, Table* table, StepTasks* tasks) {
+    char* path = strdup(input_buffer->buffer + strlen(".backup "));
+    uint32_t step_pages = 0;
+    char* space = strrchr(path, ' ');
+    if (space != NULL) {
+        char* end;
+        unsigned long value = strtoul(space + 1, &end, 10);
+        if (space[1] >= '0' && space[1] <= '9' && *end == '\0') {
+            if (value == 0 || value > UINT32_MAX) {
+                printf("Error: pages per step must be from 1 to %u.\n", UINT32_MAX);
+                free(path);
+                return META_COMMAND_SUCCESS;
+            }
+            step_pages = value;
+            *space = '\0';
         }
     }
 
-    free(pager);
-    free(table);
+    if (step_pages == 0) {
+        uint32_t num_pages;
+        if (table_backup(table, path, &num_pages) == BACKUP_DONE) {
+            printf("Backed up %d pages.\n", num_pages);
+        } else {
+            printf("Error: could not back up to '%s'.\n", path);
+        }
+    } else {
+        // Refused while another backup runs
+        Backup* backup = backup_begin(table, path);
+        if (backup == NULL) {
+            printf("Error: could not back up to '%s'.\n", path);
+        } else {
+            tasks->backup = backup;
+            tasks->backup_pages = step_pages;
+            printf("Backing up %u pages, %u per step.\n", tasks->backup->num_pages, step_pages);
+        }
+    }
+    free(path);
+    return META_COMMAND_SUCCESS;
 }
 
-void print_constants() {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+/*
+ * ".rebuild [fill]" rebuilds the tree in one go, ".rebuild <fill> <leaves>"
+ * copies that many leaves after each command from here on.
+ */
+MetaCommandResult do_rebuild_command(InputBuffer* input_buffer, Table* table, StepTasks* tasks) {
+    uint32_t fill_percent = REBUILD_DEFAULT_FILL_PERCENT;
+    uint32_t step_leaves = 0;
+    if (input_buffer->buffer[strlen(".rebuild")] == ' ') {
+        char* fill = input_buffer->buffer + strlen(".rebuild ");
+        char* end;
+        unsigned long value = strtoul(fill, &end, 10);
+        if (*end == ' ' && !parse_step_size(end + 1, &step_leaves)) {
+            printf("Error: leaves per step must be from 1 to %u.\n", UINT32_MAX);
+            return META_COMMAND_SUCCESS;
+        }
+        // Anything but digits fails the range check below
+        bool digits = *fill >= '0' && *fill <= '9' && (*end == '\0' || *end == ' ');
+        fill_percent = digits && value <= 100 ? value : 0;
+    }
+    if (fill_percent < REBUILD_MIN_FILL_PERCENT || fill_percent > 100) {
+        printf("Error: fill must be from %u to 100 percent.\n", REBUILD_MIN_FILL_PERCENT);
+        return META_COMMAND_SUCCESS;
+    }
+    if (tasks->rebuild != NULL) {
+        // Both copy to the end of the file
+        printf("Error: a rebuild is already running.\n");
+        return META_COMMAND_SUCCESS;
+    }
+
+    if (step_leaves == 0) {
+        uint32_t num_pages = table->pager->num_pages;
+        if (table_rebuild(table, fill_percent) == REBUILD_DONE) {
+            printf("Rebuilt tree in %u pages, was %u.\n", table->pager->num_pages - 1, num_pages - 1);
+        } else {
+            printf("Error: table full, no room to rebuild.\n");
+        }
+    } else {
+        tasks->rebuild = rebuild_begin(table, fill_percent);
+        tasks->rebuild_leaves = step_leaves;
+        printf("Rebuilding tree, %u leaves per step.\n", step_leaves);
+    }
+    return META_COMMAND_SUCCESS;
 }
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table, StepTasks* tasks) {
     if (strcmp(input_buffer->buffer, ".exit") == 0) {
+        run_steps(tasks, true);
         close_input_buffer(input_buffer);
         db_close(table);
         exit(EXIT_SUCCESS);
     } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
         printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
+        print_tree(table->pager, table->root_page_num, 0);
         return META_COMMAND_SUCCESS;
     } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
         printf("Constants:\n");
-        print_constants();
+        print_constants(table);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".hashindex") == 0) {
+        create_hash_index(table);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".lazydelete on") == 0) {
+        table->lazy_delete = true;
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".lazydelete off") == 0) {
+        table->lazy_delete = false;
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".compression on") == 0) {
+        table->pager->compress = true;
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".compression off") == 0) {
+        table->pager->compress = false;
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".count") == 0) {
+        print_row_count(table_count_rows(table));
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".parallel ", strlen(".parallel ")) == 0) {
+        int num_threads = atoi(input_buffer->buffer + strlen(".parallel "));
+        if (num_threads < 1 || num_threads > SCAN_MAX_THREADS) {
+            printf("Error: scan threads must be from 1 to %d.\n", SCAN_MAX_THREADS);
+        } else {
+            table->scan_threads = num_threads;
+        }
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".analyze") == 0 ||
+               strcmp(input_buffer->buffer, ".analyze histogram") == 0) {
+        TreeHealth health;
+        analyze_tree(table, &health);
+        print_tree_health(&health, strcmp(input_buffer->buffer, ".analyze histogram") == 0);
         return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".compact") == 0) {
+        printf("Freed %d pages.\n", compact_tree(table));
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".rebuild") == 0 ||
+               strncmp(input_buffer->buffer, ".rebuild ", strlen(".rebuild ")) == 0) {
+        return do_rebuild_command(input_buffer, table, tasks);
+    } else if (strncmp(input_buffer->buffer, ".backup ", strlen(".backup ")) == 0) {
+        return do_backup_command(input_buffer, table, tasks);
+    } else if (strcmp(input_buffer->buffer, ".stats") == 0 ||
+               strncmp(input_buffer->buffer, ".stats ", strlen(".stats ")) == 0) {
+        return do_stats_command(input_buffer, table);
+    } else if (strncmp(input_buffer->buffer, ".import ", strlen(".import ")) == 0 ||
+               strncmp(input_buffer->buffer, ".export ", strlen(".export ")) == 0) {
+        return do_transfer_command(input_buffer, table);
     } else {
         return META_COMMAND_UNRECOGNIZED_COMMAND;
     }
 }
 
+char* skip_spaces(char* position) {
+    while (*position == ' ') {
+        position++;
+    }
+    return position;
+}
+
+/*
+ * Parse one "(id, username, email)" group and move position past it.
+ */
+PrepareResult parse_row_values(char** position, Row* row) {
+    char* p = skip_spaces(*position);
+    if (*p != '(') {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    p++;
+
+    char* fields[3];
+    for (uint32_t i = 0; i < 3; i++) {
+        fields[i] = skip_spaces(p);
+        p = strchr(fields[i], i < 2 ? ',' : ')');
+        if (p == NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        char* end = p;
+        while (end > fields[i] && end[-1] == ' ') {
+            end--;
+        }
+        *end = '\0';
+        if (end == fields[i]) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        p++;
+    }
+
+    int id = atoi(fields[0]);
+    if (id < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (strlen(fields[1]) > COLUMN_USERNAME_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    if (strlen(fields[2]) > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    row->id = id;
+    strcpy(row->username, fields[1]);
+    strcpy(row->email, fields[2]);
+    *position = p;
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * insert values (1, user1, person1@example.com), (2, user2, person2@example.com)
+ */
+PrepareResult prepare_insert_values(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_INSERT_BATCH;
+    statement->num_rows = 0;
+    uint32_t capacity = 16;
+    statement->rows = malloc(capacity * sizeof(Row));
+
+    char* position = input_buffer->buffer + strlen("insert values");
+    while (true) {
+        if (statement->num_rows == capacity) {
+            capacity *= 2;
+            statement->rows = realloc(statement->rows, capacity * sizeof(Row));
+        }
+
+        PrepareResult result = parse_row_values(&position, &statement->rows[statement->num_rows]);
+        if (result != PREPARE_SUCCESS) {
+            free(statement->rows);
+            return result;
+        }
+        statement->num_rows++;
+
+        position = skip_spaces(position);
+        if (*position == '\0') {
+            return PREPARE_SUCCESS;
+        }
+        if (*position != ',') {
+            free(statement->rows);
+            return PREPARE_SYNTAX_ERROR;
+        }
+        position++;
+    }
+}
+
 PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
+    if (strncmp(input_buffer->buffer, "insert values", strlen("insert values")) == 0) {
+        return prepare_insert_values(input_buffer, statement);
+    }
+
     statement->type = STATEMENT_INSERT;
 
     char* keyword = strtok(input_buffer->buffer, " ");
@@ -167,12 +475,78 @@ PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
     return PREPARE_SUCCESS;
 }
 
+bool parse_count(const char* text, uint32_t* count) {
+    char* end;
+    unsigned long value = strtoul(text, &end, 10);
+    if (*text < '0' || *text > '9' || *end != '\0' || value > UINT32_MAX) return false;
+    *count = value;
+    return true;
+}
+
+AggregateType parse_aggregate(char* column) {
+    if (column == NULL) return AGGREGATE_NONE;
+    if (strcmp(column, "count(*)") == 0) return AGGREGATE_COUNT;
+    if (strcmp(column, "min(id)") == 0) return AGGREGATE_MIN;
+    if (strcmp(column, "max(id)") == 0) return AGGREGATE_MAX;
+    if (strcmp(column, "sum(id)") == 0) return AGGREGATE_SUM;
+    return AGGREGATE_NONE;
+}
+
+/*
+ * Columns of a select: "*" or a comma separated list such as "id,email".
+ * Rows are always printed with their columns in table order.
+ */
+bool parse_columns(char* column_list, uint32_t* columns) {
+    *columns = 0;
+    if (column_list == NULL || strcmp(column_list, "*") == 0) {
+        *columns = COLUMN_ALL;
+        return true;
+    }
+
+    for (char* name = strtok(column_list, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (strcmp(name, "id") == 0) {
+            *columns |= COLUMN_ID;
+        } else if (strcmp(name, "username") == 0) {
+            *columns |= COLUMN_USERNAME;
+        } else if (strcmp(name, "email") == 0) {
+            *columns |= COLUMN_EMAIL;
+        } else {
+            return false;
+        }
+    }
+    return *columns != 0;
+}
+
 PrepareResult prepare_select(InputBuffer* inputBuffer, Statement* statement) {
     statement->type = STATEMENT_SELECT;
     char* keyword_select = strtok(inputBuffer->buffer, " "); //"select"
     char* column = strtok(NULL, " ");
-    char* keyword_where = strtok(NULL, " ");
-    char* where_clause = strtok(NULL, " ");
+
+    // Optional "where <clause>", "limit <n>" and "offset <n>", in any order
+    char* where_clause = NULL;
+    statement->limit = UINT32_MAX;
+    statement->offset = 0;
+    for (char* keyword = strtok(NULL, " "); keyword != NULL; keyword = strtok(NULL, " ")) {
+        char* value = strtok(NULL, " ");
+        if (value == NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (strcmp(keyword, "where") == 0) {
+            where_clause = value;
+        } else if (strcmp(keyword, "limit") == 0) {
+            if (!parse_count(value, &statement->limit)) return PREPARE_SYNTAX_ERROR;
+        } else if (strcmp(keyword, "offset") == 0) {
+            if (!parse_count(value, &statement->offset)) return PREPARE_SYNTAX_ERROR;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+
+    // Parsed last, it restarts strtok()
+    statement->aggregate = parse_aggregate(column);
+    if (statement->aggregate == AGGREGATE_NONE && !parse_columns(column, &statement->columns)) {
+        return PREPARE_SYNTAX_ERROR;
+    }
 
     if (where_clause != NULL) {
         apply_where(where_clause, statement);
@@ -201,7 +575,29 @@ PrepareResult prepare_delete(InputBuffer* inputBuffer, Statement* statement) {
     return PREPARE_SUCCESS;
 }
 
+/*
+ * "explain <select>" and "explain analyze <select>", see explain.h.
+ */
+PrepareResult prepare_explain(InputBuffer* input_buffer, Statement* statement) {
+    char* select = input_buffer->buffer + strlen("explain ");
+    statement->explain = EXPLAIN_PLAN;
+    if (strncmp(select, "analyze ", strlen("analyze ")) == 0) {
+        select += strlen("analyze ");
+        statement->explain = EXPLAIN_ANALYZE;
+    }
+    if (strncmp(select, "select", 6) != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    memmove(input_buffer->buffer, select, strlen(select) + 1);
+    return prepare_select(input_buffer, statement);
+}
+
 PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
+    statement->explain = EXPLAIN_NONE;
+    if (strncmp(input_buffer->buffer, "explain ", 8) == 0) {
+        return prepare_explain(input_buffer, statement);
+    }
     if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
         return prepare_insert(input_buffer, statement);
     }
@@ -215,93 +611,6 @@ PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement)
     return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-    Row* row_to_insert = &(statement->row_to_manipulate);
-    uint32_t key_to_insert = row_to_insert->id;
-    Cursor* cursor = table_find(table, key_to_insert);
-
-    void* node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
-
-    if (cursor->cell_num < num_cells) {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert) {
-            return EXECUTE_DUPLICATE_KEY;
-        }
-    }
-
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-
-    free(cursor);
-
-    return EXECUTE_SUCCESS;
-}
-
-void print_row(Row* row) {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
-
-ExecuteResult execute_select(Statement* statement, Table* table) {
-    Cursor* cursor;
-    if (statement->clause.type >= EQUAL) {
-        cursor = table_find(table, statement->clause.id);
-    } else {
-        cursor = table_start(table);
-    }
-
-    uint32_t row_count = 0;
-    Row* row = malloc(sizeof(Row));
-    while (!(cursor->end_of_table)) {
-        deserialize_row(cursor_value(cursor), row);
-        if (!where_constrain_satisfied(row, statement->clause)) break;
-        print_row(row);
-        row_count += 1;
-        cursor_advance(cursor);
-    }
-
-    if (row_count > 1) {
-        printf("%d rows\n", row_count);
-    } else {
-        printf("%d row\n", row_count);
-    }
-
-    free(cursor);
-    free(row);
-
-    return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_delete(Statement* statement, Table* table) {
-    Row* row_to_remove = &(statement->row_to_manipulate);
-    uint32_t key_to_remove = row_to_remove->id;
-    Cursor* cursor = table_find(table, key_to_remove);
-
-    void* node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
-
-    if (cursor->cell_num < num_cells) {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_remove) {
-            leaf_node_delete(cursor, key_to_remove);
-        }
-    }
-
-    free(cursor);
-
-    return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_statement(Statement* statement, Table* table) {
-  switch (statement->type) {
-    case (STATEMENT_INSERT):
-        return execute_insert(statement, table);
-    case (STATEMENT_SELECT):
-        return execute_select(statement, table);
-    case STATEMENT_DELETE:
-        return execute_delete(statement, table);
-  }
-}
-
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wmissing-noreturn"
 int main(int argc, char* argv[]) {
@@ -310,17 +619,43 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Only used when the file is created, apart from --direct-io and --huge-pages
+    DbOptions options;
+    db_options_init(&options);
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            options.page_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pax") == 0) {
+            options.leaf_format = LEAF_FORMAT_PAX;
+        } else if (strcmp(argv[i], "--counts") == 0) {
+            options.subtree_counts = true;
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            options.direct_io = true;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            options.huge_pages = true;
+        }
+    }
+    if (!page_size_valid(options.page_size)) {
+        printf("Page size must be a power of two from %d to %d.\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
     char* filename = argv[1];
-    Table* table = db_open(filename);
+    Table* table = db_open(filename, &options);
 
     InputBuffer* input_buffer = new_input_buffer();
+    StepTasks tasks = {NULL, 0, NULL, 0};
     while (true)
     {
+        run_steps(&tasks, false);
         print_prompt();
         read_input(input_buffer);
 
         if (input_buffer->buffer[0] == '.') {
-            switch (do_meta_command(input_buffer, table)) {
+            MetaCommandResult meta_result = do_meta_command(input_buffer, table, &tasks);
+            arena_reset(table->arena);
+
+            switch (meta_result) {
                 case (META_COMMAND_SUCCESS):
                     continue;
                 
@@ -349,7 +684,13 @@ int main(int argc, char* argv[]) {
                 continue;
         }
 
-        switch (execute_statement(&statement, table)) {
+        ExecuteResult result = execute_statement(&statement, table);
+        arena_reset(table->arena);
+        if (statement.type == STATEMENT_INSERT_BATCH) {
+            free(statement.rows);
+        }
+
+        switch (result) {
             case EXECUTE_SUCCESS:
                 printf("Executed.\n");
                 break;
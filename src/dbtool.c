@@ -0,0 +1,91 @@
+//
+// Created by aagu on 20-4-12.
+//
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zconf.h>
+#include "database.h"
+#include "transfer.h"
+#include "upgrade.h"
+
+/*
+ * Command line import and export without the REPL, e.g.
+ *   dbtool import mydb.db csv users.csv
+ * and conversion of files written before file headers, see upgrade.h:
+ *   dbtool upgrade old.db mydb.db
+ */
+void usage(const char* program) {
+    printf("Usage: %s import|export <database> csv|binary <file>\n", program);
+    printf("       %s upgrade <old database> <new database>\n", program);
+}
+
+int upgrade(const char* legacy_path, const char* path) {
+    if (access(path, F_OK) == 0) {
+        printf("Error: '%s' already exists.\n", path);
+        return EXIT_FAILURE;
+    }
+
+    DbOptions options;
+    db_options_init(&options);
+    Table* table = db_open(path, &options);
+    uint64_t num_rows;
+    UpgradeResult result = table_upgrade(table, legacy_path, &num_rows);
+    db_close(table);
+
+    switch (result) {
+        case UPGRADE_SUCCESS:
+            printf("Upgraded %" PRIu64 " rows into '%s'.\n", num_rows, path);
+            return EXIT_SUCCESS;
+        case UPGRADE_IO_ERROR:
+            printf("Error: could not read '%s'.\n", legacy_path);
+            break;
+        case UPGRADE_NOT_LEGACY:
+            printf("Error: '%s' is empty or already has a file header.\n", legacy_path);
+            break;
+        case UPGRADE_CORRUPT:
+            printf("Error: '%s' is corrupt after %" PRIu64 " rows.\n", legacy_path, num_rows);
+            break;
+        case UPGRADE_INSERT_FAILED:
+            printf("Error: could not insert the rows after the first %" PRIu64 ".\n", num_rows);
+            break;
+    }
+    unlink(path);
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 4 && strcmp(argv[1], "upgrade") == 0) {
+        return upgrade(argv[2], argv[3]);
+    }
+
+    TransferFormat format;
+    if (argc != 5 || !transfer_parse_format(argv[3], &format)) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    bool import = strcmp(argv[1], "import") == 0;
+    if (!import && strcmp(argv[1], "export") != 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    DbOptions options;
+    db_options_init(&options);
+    Table* table = db_open(argv[2], &options);
+    TransferStats stats;
+    TransferResult result;
+    if (import) {
+        result = table_import(table, argv[4], format, &stats);
+        transfer_print_result("Imported", argv[4], result, &stats);
+    } else {
+        result = table_export(table, argv[4], format, &stats);
+        transfer_print_result("Exported", argv[4], result, &stats);
+    }
+    db_close(table);
+
+    return result == TRANSFER_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
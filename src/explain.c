@@ -0,0 +1,135 @@
+//
+// Created by aagu on 20-4-20.
+//
+
+#include <inttypes.h>
+#include <stdio.h>
+#include "explain.h"
+#include "btree.h"
+#include "metrics.h"
+
+const char* where_operator(EqualType type) {
+    switch (type) {
+        case LESS:
+            return "<";
+        case LESS_OR_EQUAL:
+            return "<=";
+        case EQUAL:
+            return "=";
+        case EQUAL_OR_LARGER:
+            return ">=";
+        case LARGER:
+            return ">";
+        default:
+            return "";
+    }
+}
+
+const char* aggregate_name(AggregateType aggregate) {
+    switch (aggregate) {
+        case AGGREGATE_COUNT:
+            return "count(*)";
+        case AGGREGATE_MIN:
+            return "min(id)";
+        case AGGREGATE_MAX:
+            return "max(id)";
+        case AGGREGATE_SUM:
+            return "sum(id)";
+        default:
+            return "";
+    }
+}
+
+// Levels from the root down to the leaves, 1 when the root is a leaf
+uint32_t tree_height(Table* table) {
+    uint32_t height = 1;
+    void* node = get_page(table->pager, table->root_page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        node = get_page(table->pager, *internal_node_child(node, 0));
+        height++;
+    }
+    return height;
+}
+
+void print_plan(Statement* statement, Table* table) {
+    AccessPath path = select_access_path(statement, table);
+    WhereClause clause = statement->clause;
+    switch (path) {
+        case ACCESS_FULL_SCAN:
+            printf("plan: full scan from the first leaf\n");
+            break;
+        case ACCESS_SEEK:
+            printf("plan: seek to id %u, then scan the leaf chain\n", clause.id);
+            break;
+        case ACCESS_POINT_LOOKUP:
+            printf("plan: point lookup of id %u through %s\n", clause.id,
+                   table->hash_index != NULL ? "the hash index" : "a tree descent");
+            break;
+        case ACCESS_PARALLEL_SCAN:
+            printf("plan: parallel scan of the leaf chain across %u threads\n", table->scan_threads);
+            break;
+        case ACCESS_SUBTREE_COUNTS:
+            printf("plan: count from subtree counts\n");
+            break;
+        case ACCESS_RIGHTMOST_LEAF:
+            printf("plan: max from the rightmost leaf\n");
+            break;
+    }
+
+    bool scan = path == ACCESS_FULL_SCAN || path == ACCESS_SEEK || path == ACCESS_PARALLEL_SCAN;
+    if (scan && (clause.type == LESS || clause.type == LESS_OR_EQUAL)) {
+        printf("stop: at the first id not %s %u\n", where_operator(clause.type), clause.id);
+    }
+
+    if (statement->aggregate != AGGREGATE_NONE) {
+        printf("aggregate: %s\n", aggregate_name(statement->aggregate));
+    } else {
+        if (statement->offset > 0) {
+            const char* how = table->layout.subtree_counts ? "by rank" :
+                              table->num_tombstones == 0 ? "by whole leaves" : "one at a time";
+            printf("skip: %u rows %s\n", statement->offset, how);
+        }
+        if (statement->limit != UINT32_MAX) {
+            printf("limit: %u rows\n", statement->limit);
+        }
+        printf("columns:%s%s%s\n",
+               statement->columns & COLUMN_ID ? " id" : "",
+               statement->columns & COLUMN_USERNAME ? " username" : "",
+               statement->columns & COLUMN_EMAIL ? " email" : "");
+    }
+    printf("tree: height %u, %s leaves\n", tree_height(table),
+           table->layout.leaf_format == LEAF_FORMAT_PAX ? "pax" : "row");
+}
+
+ExecuteResult execute_explain(Statement* statement, Table* table) {
+    print_plan(statement, table);
+    if (statement->explain != EXPLAIN_ANALYZE) {
+        return EXECUTE_SUCCESS;
+    }
+
+    Pager* pager = table->pager;
+    QueryCounters before = table->counters;
+    uint64_t page_requests = pager->num_page_requests;
+    uint64_t page_reads = pager->num_page_reads;
+    uint64_t start = metrics_now_ns();
+
+    ExecuteResult result = execute_select(statement, table);
+
+    uint64_t elapsed = metrics_now_ns() - start;
+    QueryCounters* after = &table->counters;
+    page_requests = pager->num_page_requests - page_requests;
+    page_reads = pager->num_page_reads - page_reads;
+    double hit_ratio = page_requests > 0 ? 100.0 * (page_requests - page_reads) / page_requests : 100.0;
+
+    printf("rows: %" PRIu64 " returned, %" PRIu64 " examined\n",
+           after->rows_returned - before.rows_returned, after->rows_examined - before.rows_examined);
+    printf("pages: %" PRIu64 " requested, %" PRIu64 " read from the file, %.1f%% cache hits\n",
+           page_requests, page_reads, hit_ratio);
+    printf("descents: %" PRIu64 " through %" PRIu64 " internal nodes, "
+           "%" PRIu64 " hot leaf hits, %" PRIu64 " index lookups\n",
+           after->descents - before.descents, after->internal_nodes_visited - before.internal_nodes_visited,
+           after->hot_leaf_hits - before.hot_leaf_hits, after->index_lookups - before.index_lookups);
+    printf("leaves followed: %" PRIu64 "\n", after->leaves_visited - before.leaves_visited);
+    printf("time: %.3f ms\n", elapsed / 1e6);
+    return result;
+}
@@ -0,0 +1,246 @@
+//
+// Created by aagu on 20-4-02.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash_index.h"
+
+uint32_t* hash_index_level(void* header) {
+    return header + HASH_INDEX_LEVEL_OFFSET;
+}
+
+uint32_t* hash_index_next_split(void* header) {
+    return header + HASH_INDEX_NEXT_SPLIT_OFFSET;
+}
+
+uint32_t* hash_index_num_buckets(void* header) {
+    return header + HASH_INDEX_NUM_BUCKETS_OFFSET;
+}
+
+uint32_t* hash_index_num_entries(void* header) {
+    return header + HASH_INDEX_NUM_ENTRIES_OFFSET;
+}
+
+uint32_t* hash_index_directory(void* header, uint32_t bucket) {
+    return header + HASH_INDEX_DIRECTORY_OFFSET + bucket * sizeof(uint32_t);
+}
+
+uint32_t* hash_bucket_num_entries(void* bucket) {
+    return bucket + HASH_BUCKET_NUM_ENTRIES_OFFSET;
+}
+
+uint32_t* hash_bucket_overflow(void* bucket) {
+    return bucket + HASH_BUCKET_OVERFLOW_OFFSET;
+}
+
+uint32_t* hash_bucket_key(void* bucket, uint32_t entry_num) {
+    return bucket + HASH_BUCKET_HEADER_SIZE + entry_num * HASH_BUCKET_ENTRY_SIZE;
+}
+
+uint32_t* hash_bucket_page(void* bucket, uint32_t entry_num) {
+    return hash_bucket_key(bucket, entry_num) + 1;
+}
+
+// The directory fills the rest of the header page
+uint32_t hash_index_max_buckets(Pager* index) {
+    return (index->page_size - HASH_INDEX_DIRECTORY_OFFSET) / sizeof(uint32_t);
+}
+
+uint32_t hash_bucket_max_entries(Pager* index) {
+    return (index->page_size - HASH_BUCKET_HEADER_SIZE) / HASH_BUCKET_ENTRY_SIZE;
+}
+
+uint32_t hash_key(uint32_t key) {
+    // murmur3 finalizer, ids are often sequential
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+    return key;
+}
+
+/*
+ * Linear hashing: buckets before the split pointer have already been split
+ * in this round and are addressed with one more bit of the hash.
+ */
+uint32_t hash_index_bucket_of(void* header, uint32_t key) {
+    uint32_t hash = hash_key(key);
+    uint32_t buckets_in_level = HASH_INDEX_INITIAL_BUCKETS << *hash_index_level(header);
+    uint32_t bucket = hash % buckets_in_level;
+    if (bucket < *hash_index_next_split(header)) {
+        bucket = hash % (buckets_in_level * 2);
+    }
+    return bucket;
+}
+
+uint32_t hash_index_new_bucket_page(Pager* index) {
+    uint32_t page_num = get_unused_page_num(index);
+    void* bucket = get_page(index, page_num);
+    *hash_bucket_num_entries(bucket) = 0;
+    *hash_bucket_overflow(bucket) = 0; // 0 is the file header, so it marks the end of the chain
+    return page_num;
+}
+
+void hash_bucket_append(Pager* index, uint32_t bucket_page_num, uint32_t key, uint32_t page_num) {
+    void* bucket = get_page(index, bucket_page_num);
+    uint32_t max_entries = hash_bucket_max_entries(index);
+    while (*hash_bucket_num_entries(bucket) >= max_entries) {
+        uint32_t overflow_page_num = *hash_bucket_overflow(bucket);
+        if (overflow_page_num == 0) {
+            overflow_page_num = hash_index_new_bucket_page(index);
+            *hash_bucket_overflow(bucket) = overflow_page_num;
+        }
+        bucket = get_page(index, overflow_page_num);
+    }
+
+    uint32_t entry_num = *hash_bucket_num_entries(bucket);
+    *hash_bucket_key(bucket, entry_num) = key;
+    *hash_bucket_page(bucket, entry_num) = page_num;
+    *hash_bucket_num_entries(bucket) = entry_num + 1;
+}
+
+void hash_index_split(Pager* index) {
+    void* header = get_page(index, HASH_INDEX_HEADER_PAGE_NUM);
+    uint32_t split_bucket = *hash_index_next_split(header);
+    uint32_t new_bucket = *hash_index_num_buckets(header);
+    uint32_t buckets_in_level = HASH_INDEX_INITIAL_BUCKETS << *hash_index_level(header);
+
+    uint32_t new_bucket_page_num = hash_index_new_bucket_page(index);
+    *hash_index_directory(header, new_bucket) = new_bucket_page_num;
+    *hash_index_num_buckets(header) = new_bucket + 1;
+
+    *hash_index_next_split(header) = split_bucket + 1;
+    if (split_bucket + 1 == buckets_in_level) {
+        *hash_index_level(header) += 1;
+        *hash_index_next_split(header) = 0;
+    }
+
+    /*
+     * Pull every entry out of the split bucket's chain, then re-append each
+     * one using the new addressing. The chain pages are reused in place.
+     */
+    uint32_t num_entries = 0;
+    uint32_t chain_page_num = *hash_index_directory(header, split_bucket);
+    for (uint32_t page_num = chain_page_num; page_num != 0;) {
+        void* bucket = get_page(index, page_num);
+        num_entries += *hash_bucket_num_entries(bucket);
+        page_num = *hash_bucket_overflow(bucket);
+    }
+
+    uint32_t* entries = malloc(num_entries * HASH_BUCKET_ENTRY_SIZE);
+    uint32_t copied = 0;
+    for (uint32_t page_num = chain_page_num; page_num != 0;) {
+        void* bucket = get_page(index, page_num);
+        uint32_t bucket_entries = *hash_bucket_num_entries(bucket);
+        memcpy(entries + copied * 2, hash_bucket_key(bucket, 0), bucket_entries * HASH_BUCKET_ENTRY_SIZE);
+        copied += bucket_entries;
+        *hash_bucket_num_entries(bucket) = 0;
+        page_num = *hash_bucket_overflow(bucket);
+    }
+
+    for (uint32_t i = 0; i < num_entries; i++) {
+        uint32_t key = entries[i * 2];
+        uint32_t bucket_num = hash_index_bucket_of(header, key);
+        hash_bucket_append(index, *hash_index_directory(header, bucket_num), key, entries[i * 2 + 1]);
+    }
+
+    free(entries);
+}
+
+Pager* hash_index_open(const char* filename, uint32_t page_size) {
+    Pager* index = pager_open(filename, page_size, false);
+
+    uint32_t* root_page_num = file_header_root_page(get_page(index, FILE_HEADER_PAGE_NUM));
+    if (*root_page_num == 0) {
+        // New index file. Initialize header and the first round of buckets
+        *root_page_num = HASH_INDEX_HEADER_PAGE_NUM;
+        void* header = get_page(index, HASH_INDEX_HEADER_PAGE_NUM);
+        *hash_index_level(header) = 0;
+        *hash_index_next_split(header) = 0;
+        *hash_index_num_buckets(header) = HASH_INDEX_INITIAL_BUCKETS;
+        *hash_index_num_entries(header) = 0;
+        for (uint32_t i = 0; i < HASH_INDEX_INITIAL_BUCKETS; i++) {
+            *hash_index_directory(header, i) = hash_index_new_bucket_page(index);
+        }
+    }
+
+    return index;
+}
+
+void hash_index_close(Pager* index) {
+    pager_close(index);
+}
+
+bool hash_index_find(Pager* index, uint32_t key, uint32_t* page_num) {
+    void* header = get_page(index, HASH_INDEX_HEADER_PAGE_NUM);
+    uint32_t bucket_num = hash_index_bucket_of(header, key);
+
+    for (uint32_t bucket_page_num = *hash_index_directory(header, bucket_num); bucket_page_num != 0;) {
+        void* bucket = get_page(index, bucket_page_num);
+        uint32_t num_entries = *hash_bucket_num_entries(bucket);
+        for (uint32_t i = 0; i < num_entries; i++) {
+            if (*hash_bucket_key(bucket, i) == key) {
+                *page_num = *hash_bucket_page(bucket, i);
+                return true;
+            }
+        }
+        bucket_page_num = *hash_bucket_overflow(bucket);
+    }
+
+    return false;
+}
+
+/*
+ * Insert key, or point an existing key at a new leaf page after the row moved.
+ */
+void hash_index_put(Pager* index, uint32_t key, uint32_t page_num) {
+    void* header = get_page(index, HASH_INDEX_HEADER_PAGE_NUM);
+    uint32_t bucket_num = hash_index_bucket_of(header, key);
+    uint32_t head_page_num = *hash_index_directory(header, bucket_num);
+
+    for (uint32_t bucket_page_num = head_page_num; bucket_page_num != 0;) {
+        void* bucket = get_page(index, bucket_page_num);
+        uint32_t num_entries = *hash_bucket_num_entries(bucket);
+        for (uint32_t i = 0; i < num_entries; i++) {
+            if (*hash_bucket_key(bucket, i) == key) {
+                *hash_bucket_page(bucket, i) = page_num;
+                return;
+            }
+        }
+        bucket_page_num = *hash_bucket_overflow(bucket);
+    }
+
+    hash_bucket_append(index, head_page_num, key, page_num);
+    *hash_index_num_entries(header) += 1;
+
+    // Keep the average chain under 3/4 of a page
+    uint32_t num_buckets = *hash_index_num_buckets(header);
+    if (*hash_index_num_entries(header) > num_buckets * hash_bucket_max_entries(index) / 4 * 3 &&
+        num_buckets < hash_index_max_buckets(index)) {
+        hash_index_split(index);
+    }
+}
+
+void hash_index_remove(Pager* index, uint32_t key) {
+    void* header = get_page(index, HASH_INDEX_HEADER_PAGE_NUM);
+    uint32_t bucket_num = hash_index_bucket_of(header, key);
+
+    for (uint32_t bucket_page_num = *hash_index_directory(header, bucket_num); bucket_page_num != 0;) {
+        void* bucket = get_page(index, bucket_page_num);
+        uint32_t num_entries = *hash_bucket_num_entries(bucket);
+        for (uint32_t i = 0; i < num_entries; i++) {
+            if (*hash_bucket_key(bucket, i) == key) {
+                // Fill the hole with the last entry of this page
+                *hash_bucket_key(bucket, i) = *hash_bucket_key(bucket, num_entries - 1);
+                *hash_bucket_page(bucket, i) = *hash_bucket_page(bucket, num_entries - 1);
+                *hash_bucket_num_entries(bucket) = num_entries - 1;
+                *hash_index_num_entries(header) -= 1;
+                return;
+            }
+        }
+        bucket_page_num = *hash_bucket_overflow(bucket);
+    }
+}
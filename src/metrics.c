@@ -0,0 +1,296 @@
+//
+// Created by aagu on 20-4-21.
+//
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+
+static MetricsShard* metrics_shards[METRICS_MAX_SHARDS];
+static uint32_t metrics_num_shards = 0;
+static _Thread_local MetricsShard* metrics_thread_shard = NULL;
+
+static const char* STATEMENT_TYPE_NAMES[METRICS_NUM_STATEMENT_TYPES] = {
+        "insert", "insert_values", "select", "delete"
+};
+
+static const char* COUNTER_NAMES[METRIC_NUM_COUNTERS] = {
+        "leaf_splits", "internal_splits", "leaf_merges", "internal_merges",
+        "leaf_borrows", "internal_borrows", "root_collapses", "compactions",
+        "rebuilds"
+};
+
+uint64_t metrics_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The calling thread's shard, taken on its first update. Shards are never
+ * given back, a thread that records is expected to live long.
+ */
+MetricsShard* metrics_shard() {
+    if (metrics_thread_shard != NULL) {
+        return metrics_thread_shard;
+    }
+
+    uint32_t shard_num = __atomic_fetch_add(&metrics_num_shards, 1, __ATOMIC_RELAXED);
+    if (shard_num >= METRICS_MAX_SHARDS - 1) {
+        shard_num = METRICS_MAX_SHARDS - 1;
+    }
+    MetricsShard* shard = __atomic_load_n(&metrics_shards[shard_num], __ATOMIC_ACQUIRE);
+    if (shard == NULL) {
+        MetricsShard* new_shard = aligned_alloc(64, sizeof(MetricsShard));
+        memset(new_shard, 0, sizeof(MetricsShard));
+        new_shard->shared = shard_num == METRICS_MAX_SHARDS - 1;
+        // Only the overflow shard can be raced for
+        if (__atomic_compare_exchange_n(&metrics_shards[shard_num], &shard, new_shard, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            shard = new_shard;
+        } else {
+            free(new_shard);
+        }
+    }
+    metrics_thread_shard = shard;
+    return shard;
+}
+
+void metrics_add(MetricsShard* shard, uint64_t* value, uint64_t delta) {
+    if (shard->shared) {
+        __atomic_fetch_add(value, delta, __ATOMIC_RELAXED);
+    } else {
+        *value += delta;
+    }
+}
+
+void metrics_count(MetricCounter counter, uint64_t value) {
+    MetricsShard* shard = metrics_shard();
+    metrics_add(shard, &shard->counters[counter], value);
+}
+
+uint32_t histogram_bucket(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+    uint32_t exponent = 63 - __builtin_clzll(value);
+    if (exponent > HISTOGRAM_MAX_EXPONENT) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    uint32_t sub_bucket = (value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub_bucket;
+}
+
+// Largest value that falls in the bucket
+uint64_t histogram_bucket_limit(uint32_t bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+    uint32_t exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub_bucket = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    uint64_t width = 1ULL << (exponent - HISTOGRAM_SUB_BITS);
+    return (((1ULL << HISTOGRAM_SUB_BITS) + sub_bucket) << (exponent - HISTOGRAM_SUB_BITS)) + width - 1;
+}
+
+void metrics_record_statement(StatementType type, uint64_t elapsed_ns) {
+    MetricsShard* shard = metrics_shard();
+    Histogram* histogram = &shard->statements[type];
+    metrics_add(shard, &histogram->count, 1);
+    metrics_add(shard, &histogram->sum_ns, elapsed_ns);
+    metrics_add(shard, &histogram->buckets[histogram_bucket(elapsed_ns)], 1);
+    if (elapsed_ns > histogram->max_ns) {
+        // A lost race on the overflow shard only loses a maximum
+        histogram->max_ns = elapsed_ns;
+    }
+}
+
+/*
+ * Add up every shard into total.
+ */
+void metrics_sum(MetricsShard* total) {
+    memset(total, 0, sizeof(MetricsShard));
+    for (uint32_t i = 0; i < METRICS_MAX_SHARDS; i++) {
+        MetricsShard* shard = __atomic_load_n(&metrics_shards[i], __ATOMIC_ACQUIRE);
+        if (shard == NULL) continue;
+
+        for (uint32_t c = 0; c < METRIC_NUM_COUNTERS; c++) {
+            total->counters[c] += __atomic_load_n(&shard->counters[c], __ATOMIC_RELAXED);
+        }
+        for (uint32_t t = 0; t < METRICS_NUM_STATEMENT_TYPES; t++) {
+            Histogram* from = &shard->statements[t];
+            Histogram* to = &total->statements[t];
+            to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+            to->sum_ns += __atomic_load_n(&from->sum_ns, __ATOMIC_RELAXED);
+            uint64_t max_ns = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+            if (max_ns > to->max_ns) to->max_ns = max_ns;
+            for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                to->buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/*
+ * Value at the given percentile (0 to 100), as the largest value of its
+ * bucket but never above the largest value recorded.
+ */
+uint64_t histogram_percentile(Histogram* histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->count + 0.5);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen >= rank) {
+            uint64_t limit = histogram_bucket_limit(b);
+            return limit < histogram->max_ns ? limit : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
+
+bool metrics_parse_format(const char* name, MetricsFormat* format) {
+    if (strcmp(name, "json") == 0) {
+        *format = METRICS_JSON;
+    } else if (strcmp(name, "prometheus") == 0) {
+        *format = METRICS_PROMETHEUS;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    uint64_t requests;
+    uint64_t reads;
+    uint64_t writes;
+} PageTotals;
+
+// Pages of the table and of its hash index
+void page_totals(Table* table, PageTotals* totals) {
+    totals->requests = table->pager->num_page_requests;
+    totals->reads = table->pager->num_page_reads;
+    totals->writes = table->pager->num_page_writes;
+    if (table->hash_index != NULL) {
+        totals->requests += table->hash_index->num_page_requests;
+        totals->reads += table->hash_index->num_page_reads;
+        totals->writes += table->hash_index->num_page_writes;
+    }
+}
+
+double cache_hit_ratio(PageTotals* pages) {
+    return pages->requests > 0 ? (double) (pages->requests - pages->reads) / pages->requests : 1.0;
+}
+
+void metrics_write_text(MetricsShard* total, PageTotals* pages, FILE* output) {
+    fprintf(output, "%-14s %10s %10s %10s %10s %10s %10s\n",
+            "statement", "count", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    for (uint32_t t = 0; t < METRICS_NUM_STATEMENT_TYPES; t++) {
+        Histogram* histogram = &total->statements[t];
+        double mean = histogram->count > 0 ? (double) histogram->sum_ns / histogram->count : 0;
+        fprintf(output, "%-14s %10" PRIu64 " %10.2f %10.2f %10.2f %10.2f %10.2f\n", STATEMENT_TYPE_NAMES[t],
+                histogram->count, mean / 1e3,
+                histogram_percentile(histogram, 50) / 1e3, histogram_percentile(histogram, 90) / 1e3,
+                histogram_percentile(histogram, 99) / 1e3, histogram->max_ns / 1e3);
+    }
+    fprintf(output, "pages: %" PRIu64 " requested, %" PRIu64 " read, %" PRIu64 " written, %.1f%% cache hits\n",
+            pages->requests, pages->reads, pages->writes, 100.0 * cache_hit_ratio(pages));
+    fprintf(output, "tree:");
+    for (uint32_t c = 0; c < METRIC_NUM_COUNTERS; c++) {
+        fprintf(output, "%s %" PRIu64 " %s", c > 0 ? "," : "", total->counters[c], COUNTER_NAMES[c]);
+    }
+    fprintf(output, "\n");
+}
+
+void metrics_write_json(MetricsShard* total, PageTotals* pages, FILE* output) {
+    fprintf(output, "{\"statements\": {");
+    for (uint32_t t = 0; t < METRICS_NUM_STATEMENT_TYPES; t++) {
+        Histogram* histogram = &total->statements[t];
+        fprintf(output, "%s\n  \"%s\": {\"count\": %" PRIu64 ", \"sum_ns\": %" PRIu64 ", "
+                        "\"p50_ns\": %" PRIu64 ", \"p90_ns\": %" PRIu64 ", "
+                        "\"p99_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}",
+                t > 0 ? "," : "", STATEMENT_TYPE_NAMES[t], histogram->count, histogram->sum_ns,
+                histogram_percentile(histogram, 50), histogram_percentile(histogram, 90),
+                histogram_percentile(histogram, 99), histogram->max_ns);
+    }
+    fprintf(output, "\n}, \"pages\": {\"requests\": %" PRIu64 ", \"reads\": %" PRIu64 ", "
+                    "\"writes\": %" PRIu64 ", \"cache_hit_ratio\": %.4f},\n",
+            pages->requests, pages->reads, pages->writes, cache_hit_ratio(pages));
+    fprintf(output, "\"tree\": {");
+    for (uint32_t c = 0; c < METRIC_NUM_COUNTERS; c++) {
+        fprintf(output, "%s\"%s\": %" PRIu64, c > 0 ? ", " : "", COUNTER_NAMES[c], total->counters[c]);
+    }
+    fprintf(output, "}}\n");
+}
+
+/*
+ * Prometheus text exposition format. Histogram buckets are cumulative and
+ * end at every power of two nanoseconds from 1 us to about 17 s.
+ */
+void metrics_write_prometheus(MetricsShard* total, PageTotals* pages, FILE* output) {
+    fprintf(output, "# HELP sqlmini_statements_total Statements executed, by type.\n"
+                    "# TYPE sqlmini_statements_total counter\n");
+    for (uint32_t t = 0; t < METRICS_NUM_STATEMENT_TYPES; t++) {
+        fprintf(output, "sqlmini_statements_total{type=\"%s\"} %" PRIu64 "\n",
+                STATEMENT_TYPE_NAMES[t], total->statements[t].count);
+    }
+
+    fprintf(output, "# HELP sqlmini_statement_duration_seconds Time to execute a statement, by type.\n"
+                    "# TYPE sqlmini_statement_duration_seconds histogram\n");
+    for (uint32_t t = 0; t < METRICS_NUM_STATEMENT_TYPES; t++) {
+        Histogram* histogram = &total->statements[t];
+        uint64_t cumulative = 0;
+        uint32_t bucket = 0;
+        for (uint32_t exponent = 10; exponent <= 34; exponent++) {
+            uint64_t bound = 1ULL << exponent;
+            // The buckets below bound end exactly at bound - 1
+            for (; bucket < HISTOGRAM_BUCKETS && histogram_bucket_limit(bucket) < bound; bucket++) {
+                cumulative += histogram->buckets[bucket];
+            }
+            fprintf(output, "sqlmini_statement_duration_seconds_bucket{type=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+                    STATEMENT_TYPE_NAMES[t], bound / 1e9, cumulative);
+        }
+        fprintf(output, "sqlmini_statement_duration_seconds_bucket{type=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+                STATEMENT_TYPE_NAMES[t], histogram->count);
+        fprintf(output, "sqlmini_statement_duration_seconds_sum{type=\"%s\"} %.9f\n",
+                STATEMENT_TYPE_NAMES[t], histogram->sum_ns / 1e9);
+        fprintf(output, "sqlmini_statement_duration_seconds_count{type=\"%s\"} %" PRIu64 "\n",
+                STATEMENT_TYPE_NAMES[t], histogram->count);
+    }
+
+    fprintf(output, "# HELP sqlmini_page_requests_total Pages asked of the page cache.\n"
+                    "# TYPE sqlmini_page_requests_total counter\n"
+                    "sqlmini_page_requests_total %" PRIu64 "\n", pages->requests);
+    fprintf(output, "# HELP sqlmini_page_reads_total Pages read from the file on a cache miss.\n"
+                    "# TYPE sqlmini_page_reads_total counter\n"
+                    "sqlmini_page_reads_total %" PRIu64 "\n", pages->reads);
+    fprintf(output, "# HELP sqlmini_page_writes_total Pages written to the file.\n"
+                    "# TYPE sqlmini_page_writes_total counter\n"
+                    "sqlmini_page_writes_total %" PRIu64 "\n", pages->writes);
+    fprintf(output, "# HELP sqlmini_tree_events_total Structural changes to the B+tree, by kind.\n"
+                    "# TYPE sqlmini_tree_events_total counter\n");
+    for (uint32_t c = 0; c < METRIC_NUM_COUNTERS; c++) {
+        fprintf(output, "sqlmini_tree_events_total{event=\"%s\"} %" PRIu64 "\n", COUNTER_NAMES[c], total->counters[c]);
+    }
+}
+
+void metrics_write(Table* table, FILE* output, MetricsFormat format) {
+    MetricsShard* total = aligned_alloc(64, sizeof(MetricsShard));
+    metrics_sum(total);
+    PageTotals pages;
+    page_totals(table, &pages);
+
+    if (format == METRICS_JSON) {
+        metrics_write_json(total, &pages, output);
+    } else if (format == METRICS_PROMETHEUS) {
+        metrics_write_prometheus(total, &pages, output);
+    } else {
+        metrics_write_text(total, &pages, output);
+    }
+    free(total);
+}
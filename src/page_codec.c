@@ -0,0 +1,99 @@
+//
+// Created by aagu on 20-4-16.
+//
+
+#include <string.h>
+#include "page_codec.h"
+
+uint32_t zero_run_length(const uint8_t* source, uint32_t position, uint32_t size) {
+    uint32_t end = position;
+    while (end < size && source[end] == 0) {
+        end++;
+    }
+    return end - position;
+}
+
+/*
+ * Compress size bytes into destination, which has room for size bytes.
+ * Returns the compressed length, or size when the page does not get
+ * smaller; the caller then stores it as it is.
+ */
+uint32_t page_compress(const uint8_t* source, uint32_t size, uint8_t* destination) {
+    uint32_t length = 0;
+    uint32_t position = 0;
+
+    while (position < size) {
+        uint32_t zeros = zero_run_length(source, position, size);
+        if (zeros >= PAGE_CODEC_MIN_ZERO_RUN) {
+            while (zeros > 0) {
+                uint32_t run = zeros;
+                if (run <= PAGE_CODEC_MAX_SHORT_ZEROS) {
+                    if (length + 1 > size) return size;
+                    destination[length++] = PAGE_CODEC_SHORT_ZEROS + run - 1;
+                } else {
+                    if (run > PAGE_CODEC_MAX_LONG_ZEROS) run = PAGE_CODEC_MAX_LONG_ZEROS;
+                    if (length + 3 > size) return size;
+                    destination[length++] = PAGE_CODEC_LONG_ZEROS;
+                    destination[length++] = run & 0xFF;
+                    destination[length++] = run >> 8;
+                }
+                position += run;
+                zeros -= run;
+            }
+            continue;
+        }
+
+        // Literal up to the next zero run worth encoding
+        uint32_t end = position;
+        while (end < size && end - position < PAGE_CODEC_MAX_LITERAL) {
+            if (source[end] == 0 && zero_run_length(source, end, size) >= PAGE_CODEC_MIN_ZERO_RUN) break;
+            end++;
+        }
+        uint32_t count = end - position;
+        if (length + 1 + count > size) return size;
+        destination[length++] = count - 1;
+        memcpy(destination + length, source + position, count);
+        length += count;
+        position = end;
+    }
+
+    return length < size ? length : size;
+}
+
+/*
+ * Undo page_compress(). A length equal to size means the page was stored
+ * uncompressed. Returns false when the data does not decode to exactly size
+ * bytes.
+ */
+bool page_decompress(const uint8_t* source, uint32_t length, uint8_t* destination, uint32_t size) {
+    if (length == size) {
+        memcpy(destination, source, size);
+        return true;
+    }
+
+    uint32_t position = 0;
+    uint32_t written = 0;
+    while (position < length) {
+        uint8_t token = source[position++];
+        uint32_t count;
+        if (token < PAGE_CODEC_SHORT_ZEROS) {
+            count = token + 1;
+            if (position + count > length || written + count > size) return false;
+            memcpy(destination + written, source + position, count);
+            position += count;
+        } else {
+            if (token == PAGE_CODEC_LONG_ZEROS) {
+                if (position + 2 > length) return false;
+                count = source[position] | (source[position + 1] << 8);
+                position += 2;
+            } else {
+                count = token - PAGE_CODEC_SHORT_ZEROS + 1;
+            }
+            if (written + count > size) return false;
+            memset(destination + written, 0, count);
+        }
+        written += count;
+    }
+
+    return written == size;
+}
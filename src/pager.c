@@ -2,6 +2,7 @@
 // Created by aagu on 20-3-17.
 //
 
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,31 +10,157 @@
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 #include "pager.h"
+#include "page_codec.h"
+
+void* pager_alloc_frame(Pager* pager) {
+    if (pager->num_free_frames > 0) {
+        uint32_t frame_num = pager->free_frames[--pager->num_free_frames];
+        void* frame = pager->frames + (size_t) frame_num * pager->page_size;
+        memset(frame, 0, pager->page_size);
+        return frame;
+    }
+
+    // Untouched frames are still zero-filled from mmap
+    return pager->frames + (size_t) (pager->num_frames_used++) * pager->page_size;
+}
+
+void pager_release_frame(Pager* pager, uint32_t page_num) {
+    // The page is about to be dropped, changed or cut off the file
+    if (pager->snapshot != NULL) {
+        pager_snapshot_save(pager, page_num);
+    }
+    void* page = pager->pages[page_num];
+    if (page == NULL) {
+        return;
+    }
+    pager->free_frames[pager->num_free_frames++] = (page - pager->frames) / pager->page_size;
+    pager->pages[page_num] = NULL;
+}
+
+uint64_t* file_header_free_map(void* header) {
+    return header + FILE_HEADER_FREE_MAP_OFFSET;
+}
+
+// The header page stays cached from pager_open() on
+bool pager_page_is_free(Pager* pager, uint32_t page_num) {
+    uint64_t* free_map = file_header_free_map(pager->pages[FILE_HEADER_PAGE_NUM]);
+    return (free_map[page_num / 64] >> (page_num % 64)) & 1;
+}
+
+void pager_set_page_free(Pager* pager, uint32_t page_num, bool free) {
+    uint64_t* free_map = file_header_free_map(pager->pages[FILE_HEADER_PAGE_NUM]);
+    if (free) {
+        free_map[page_num / 64] |= (uint64_t) 1 << (page_num % 64);
+    } else {
+        free_map[page_num / 64] &= ~((uint64_t) 1 << (page_num % 64));
+    }
+}
+
+uint32_t pager_num_free_pages(Pager* pager) {
+    uint64_t* free_map = file_header_free_map(pager->pages[FILE_HEADER_PAGE_NUM]);
+    uint32_t num_free = 0;
+    for (uint32_t i = 0; i < TABLE_MAX_PAGES / 64; i++) {
+        num_free += __builtin_popcountll(free_map[i]);
+    }
+    return num_free;
+}
+
+/*
+ * Drop a page that is no longer part of the tree and recycle its frame.
+ * The page itself goes back to the free map for pager_allocate_near().
+ */
+void pager_free_page(Pager* pager, uint32_t page_num) {
+    pager_release_frame(pager, page_num);
+    pager_set_page_free(pager, page_num, true);
+}
+
+/*
+ * Hand the cached page from_page_num over to to_page_num, dropping whatever
+ * to_page_num held. No bytes are copied.
+ */
+void pager_move_page(Pager* pager, uint32_t from_page_num, uint32_t to_page_num) {
+    // to_page_num is saved as its frame is released
+    if (pager->snapshot != NULL) {
+        pager_snapshot_save(pager, from_page_num);
+    }
+    pager_release_frame(pager, to_page_num);
+    pager_set_page_free(pager, to_page_num, false);
+    pager->pages[to_page_num] = pager->pages[from_page_num];
+    pager->pages[from_page_num] = NULL;
+}
+
+/*
+ * Drop every page from num_pages on, from the cache and from the end of the
+ * file. Pages allocated later start out zeroed again.
+ */
+void pager_truncate(Pager* pager, uint32_t num_pages) {
+    for (uint32_t i = num_pages; i < pager->num_pages; i++) {
+        pager_release_frame(pager, i);
+        pager_set_page_free(pager, i, false);
+    }
+    pager->num_pages = num_pages;
+
+    if (pager->extents != NULL) {
+        // Rewritten when the pager is closed
+        if (pager->num_extents > num_pages) {
+            pager->num_extents = num_pages;
+        }
+    } else if (lseek(pager->file_descriptor, 0, SEEK_END) > (off_t) num_pages * pager->page_size) {
+        if (ftruncate(pager->file_descriptor, (off_t) num_pages * pager->page_size) == -1) {
+            printf("Error truncating db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->file_length = num_pages * pager->page_size;
+    }
+}
+
+void pager_read_extent(Pager* pager, uint32_t page_num, void* page) {
+    PageExtent* extent = &pager->extents[page_num];
+    ssize_t bytes_read = pread(pager->file_descriptor, pager->compressed_buffer, extent->length, extent->offset);
+    if (bytes_read != extent->length ||
+        !page_decompress(pager->compressed_buffer, extent->length, page, pager->page_size)) {
+        printf("Error reading compressed page %d. Corrupt file.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pager->num_page_reads += 1;
+}
 
 void* get_page(Pager* pager, uint32_t page_num) {
-    if (page_num > TABLE_MAX_PAGES) {
+    pager->num_page_requests += 1;
+
+    if (page_num >= TABLE_MAX_PAGES) {
         printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
         exit(EXIT_FAILURE);
     }
 
     if (pager->pages[page_num] == NULL) {
-        //Cache miss. Allocate memory and load from file.
-        void* page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
+        //Cache miss. Take a frame and load from file.
+        void* page = pager_alloc_frame(pager);
+        uint32_t num_pages = pager->file_length / pager->page_size;
 
         //We might save a partial page at the end of the file
-        if (pager->file_length % PAGE_SIZE) {
+        if (pager->file_length % pager->page_size) {
             num_pages += 1;
         }
 
-        if (page_num <= num_pages) {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
+        if (pager->extents != NULL) {
+            if (page_num < pager->num_extents) {
+                pager_read_extent(pager, page_num, page);
+            }
+        } else if (page_num < num_pages) {
+            lseek(pager->file_descriptor, (off_t) page_num * pager->page_size, SEEK_SET);
+            ssize_t bytes_read = read(pager->file_descriptor, page, pager->page_size);
             if (bytes_read == -1) {
                 printf("Error reading file; %d\n", errno);
                 exit(EXIT_FAILURE);
             }
+            pager->num_page_reads += 1;
         }
 
         pager->pages[page_num] = page;
@@ -43,9 +170,147 @@ void* get_page(Pager* pager, uint32_t page_num) {
         }
     }
 
+    // The caller may be about to change the page
+    if (pager->snapshot != NULL) {
+        pager_snapshot_save(pager, page_num);
+    }
     return pager->pages[page_num];
 }
 
+/*
+ * Read-only page access for scan threads. A cached page is shared, any
+ * other page is read into the caller's buffer, leaving the cache and the
+ * counters to the thread that owns the pager. compressed_buffer is one page
+ * of the caller's own scratch, only used for compressed files.
+ */
+void* pager_read_page(Pager* pager, uint32_t page_num, void* buffer, void* compressed_buffer) {
+    if (page_num >= TABLE_MAX_PAGES) {
+        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
+        exit(EXIT_FAILURE);
+    }
+    if (pager->pages[page_num] != NULL) {
+        return pager->pages[page_num];
+    }
+
+    memset(buffer, 0, pager->page_size);
+    if (pager->extents != NULL) {
+        if (page_num < pager->num_extents) {
+            PageExtent* extent = &pager->extents[page_num];
+            ssize_t bytes_read = pread(pager->file_descriptor, compressed_buffer, extent->length, extent->offset);
+            if (bytes_read != extent->length ||
+                !page_decompress(compressed_buffer, extent->length, buffer, pager->page_size)) {
+                printf("Error reading compressed page %d. Corrupt file.\n", page_num);
+                exit(EXIT_FAILURE);
+            }
+        }
+    } else if ((uint64_t) page_num * pager->page_size < pager->file_length) {
+        if (pread(pager->file_descriptor, buffer, pager->page_size, (off_t) page_num * pager->page_size) == -1) {
+            printf("Error reading file; %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return buffer;
+}
+
+uint32_t* file_header_version(void* header) {
+    return header + FILE_HEADER_VERSION_OFFSET;
+}
+
+uint32_t* file_header_page_size(void* header) {
+    return header + FILE_HEADER_PAGE_SIZE_OFFSET;
+}
+
+// 0 until the owner of the file creates its first page
+uint32_t* file_header_root_page(void* header) {
+    return header + FILE_HEADER_ROOT_PAGE_OFFSET;
+}
+
+uint32_t* file_header_flags(void* header) {
+    return header + FILE_HEADER_FLAGS_OFFSET;
+}
+
+// Byte offset of the extent map in a compressed file
+uint32_t* file_header_extent_map(void* header) {
+    return header + FILE_HEADER_EXTENT_MAP_OFFSET;
+}
+
+uint32_t* file_header_num_extents(void* header) {
+    return header + FILE_HEADER_NUM_EXTENTS_OFFSET;
+}
+
+/*
+ * Table.data_version as of the last close. A hash index file keeps the one
+ * of the database it was last in step with.
+ */
+uint32_t* file_header_data_version(void* header) {
+    return header + FILE_HEADER_DATA_VERSION_OFFSET;
+}
+
+void pager_init_header(Pager* pager) {
+    void* header = get_page(pager, FILE_HEADER_PAGE_NUM);
+    memcpy(header + FILE_HEADER_MAGIC_OFFSET, FILE_HEADER_MAGIC, sizeof(FILE_HEADER_MAGIC));
+    *file_header_version(header) = FILE_FORMAT_VERSION;
+    *file_header_page_size(header) = pager->page_size;
+    *file_header_root_page(header) = 0;
+    *file_header_flags(header) = 0;
+    *file_header_extent_map(header) = 0;
+    *file_header_num_extents(header) = 0;
+    *file_header_data_version(header) = 0;
+}
+
+bool page_size_valid(uint32_t page_size) {
+    return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE && (page_size & (page_size - 1)) == 0;
+}
+
+/*
+ * Read the start of the file header straight from the file, before there is
+ * a page size to load pages with.
+ */
+void pager_read_header(int fd, char* header) {
+    if (pread(fd, header, FILE_HEADER_METADATA_OFFSET, 0) != FILE_HEADER_METADATA_OFFSET ||
+        memcmp(header + FILE_HEADER_MAGIC_OFFSET, FILE_HEADER_MAGIC, sizeof(FILE_HEADER_MAGIC)) != 0) {
+        printf("Not a sqlmini file, or written before file headers (convert it with dbtool upgrade). Corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (*file_header_version(header) != FILE_FORMAT_VERSION) {
+        printf("Unsupported file format version %d.\n", *file_header_version(header));
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t page_size = *file_header_page_size(header);
+    if (!page_size_valid(page_size)) {
+        printf("Bad page size %d in file header. Corrupt file.\n", page_size);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void pager_read_extent_map(Pager* pager, uint32_t map_offset, uint32_t num_extents) {
+    size_t map_size = (size_t) num_extents * sizeof(PageExtent);
+    pager->extents = malloc(map_size);
+    pager->num_extents = num_extents;
+    if (num_extents == 0 || num_extents > TABLE_MAX_PAGES ||
+        pread(pager->file_descriptor, pager->extents, map_size, map_offset) != (ssize_t) map_size) {
+        printf("Error reading extent map. Corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < num_extents; i++) {
+        PageExtent* extent = &pager->extents[i];
+        if (extent->length > pager->page_size || extent->offset + extent->length > pager->file_length) {
+            printf("Extent of page %d is out of bounds. Corrupt file.\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void pager_validate_header(Pager* pager) {
+    void* header = get_page(pager, FILE_HEADER_PAGE_NUM);
+    if (*file_header_root_page(header) >= pager->num_pages) {
+        printf("Root page %d is past the end of the file. Corrupt file.\n", *file_header_root_page(header));
+        exit(EXIT_FAILURE);
+    }
+}
+
 void serialize_row(Row* source, void* destination) {
     memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
     memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
@@ -56,13 +321,171 @@ uint32_t get_unused_page_num(Pager* pager) {
     return pager->num_pages;
 }
 
+// First free page in [first, last), 0 when there is none
+uint32_t pager_find_free_page(Pager* pager, uint32_t first, uint32_t last) {
+    uint64_t* free_map = file_header_free_map(pager->pages[FILE_HEADER_PAGE_NUM]);
+    for (uint32_t page_num = first; page_num < last;) {
+        uint64_t word = free_map[page_num / 64] >> (page_num % 64);
+        if (word != 0) {
+            page_num += __builtin_ctzll(word);
+            return page_num < last ? page_num : 0;
+        }
+        page_num = (page_num / 64 + 1) * 64;
+    }
+    return 0;
+}
+
+uint32_t pager_extent_pages(Pager* pager) {
+    uint32_t extent_pages = pager->num_pages / 8;
+    if (extent_pages < PAGER_MIN_EXTENT_PAGES) {
+        return PAGER_MIN_EXTENT_PAGES;
+    }
+    return extent_pages > PAGER_EXTENT_PAGES ? PAGER_EXTENT_PAGES : extent_pages;
+}
+
+/*
+ * Take a page for a new leaf that will sit next to near_page_num in the leaf
+ * chain: the first free page after it within PAGER_EXTENT_PAGES, else the
+ * closest one before it. Failing that, the newest extent is filled up before
+ * any older free page is reused, and only then is a fresh extent reserved at
+ * the end of the file. The page comes back zeroed and cached.
+ */
+uint32_t pager_allocate_near(Pager* pager, uint32_t near_page_num) {
+    uint32_t page_num = 0;
+    for (uint32_t distance = 1; distance <= PAGER_EXTENT_PAGES && page_num == 0; distance++) {
+        if (near_page_num + distance < pager->num_pages && pager_page_is_free(pager, near_page_num + distance)) {
+            page_num = near_page_num + distance;
+        }
+    }
+    for (uint32_t distance = 1; distance <= PAGER_EXTENT_PAGES && page_num == 0; distance++) {
+        if (distance < near_page_num && pager_page_is_free(pager, near_page_num - distance)) {
+            page_num = near_page_num - distance;
+        }
+    }
+    if (page_num == 0 && pager->num_pages > PAGER_EXTENT_PAGES) {
+        page_num = pager_find_free_page(pager, pager->num_pages - PAGER_EXTENT_PAGES, pager->num_pages);
+    }
+    if (page_num == 0) {
+        page_num = pager_find_free_page(pager, 1, pager->num_pages);
+    }
+
+    if (page_num == 0) {
+        page_num = pager->num_pages;
+        uint32_t extent_end = page_num + pager_extent_pages(pager);
+        if (extent_end > TABLE_MAX_PAGES) {
+            extent_end = TABLE_MAX_PAGES;
+        }
+        if (page_num >= extent_end) {
+            // Out of pages, get_page() reports it
+            return page_num;
+        }
+        for (uint32_t i = page_num; i < extent_end; i++) {
+            pager_set_page_free(pager, i, true);
+        }
+        pager->num_pages = extent_end;
+
+#ifdef __linux__
+        // Grow the file by the whole extent now instead of a page per flush
+        if (pager->extents == NULL &&
+            posix_fallocate(pager->file_descriptor, (off_t) page_num * pager->page_size,
+                            (off_t) (extent_end - page_num) * pager->page_size) == 0 &&
+            pager->file_length < (uint64_t) extent_end * pager->page_size) {
+            pager->file_length = extent_end * pager->page_size;
+        }
+#endif
+    }
+
+    pager_set_page_free(pager, page_num, false);
+    // Free pages hold nothing worth reading back
+    pager_release_frame(pager, page_num);
+    pager->pages[page_num] = pager_alloc_frame(pager);
+    return page_num;
+}
+
 void deserialize_row(void* source, Row* destination) {
     memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
     memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
     memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
 }
 
-Pager *pager_open(const char *filename) {
+/*
+ * Spread the frames over all memory nodes the process may use. Any worker
+ * thread may touch any cached page, so no node is local to the cache as a
+ * whole, and interleaving keeps one node's memory bandwidth from being the
+ * limit. A policy set from outside, say by numactl, is left alone.
+ */
+bool pager_interleave_frames(void* frames, size_t frames_size) {
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+    int mode;
+    if (syscall(SYS_get_mempolicy, &mode, NULL, 0, NULL, 0) != 0 || mode != MPOL_DEFAULT) {
+        return false;
+    }
+    unsigned long nodes[16] = {0};
+    unsigned long max_node = sizeof(nodes) * 8;
+    if (syscall(SYS_get_mempolicy, NULL, nodes, max_node, NULL, MPOL_F_MEMS_ALLOWED) != 0) {
+        return false;
+    }
+    uint32_t num_nodes = 0;
+    for (uint32_t i = 0; i < sizeof(nodes) / sizeof(nodes[0]); i++) {
+        num_nodes += __builtin_popcountl(nodes[i]);
+    }
+    if (num_nodes < 2) {
+        return false;
+    }
+    return syscall(SYS_mbind, frames, frames_size, MPOL_INTERLEAVE, nodes, max_node, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Reserve address space for every frame the pager may need. Frames get
+ * backed by memory as they are first touched.
+ *
+ * With huge_pages the region is asked of the hugetlbfs pool first. That
+ * pool has to be set aside by the administrator (vm.nr_hugepages), and the
+ * whole region is reserved from it now: a hugetlb fault that finds the pool
+ * empty kills the process instead of failing. When the pool is too small,
+ * or without huge_pages, the region is ordinary memory aligned for
+ * transparent huge pages, over-reserved by one huge page to align the start.
+ */
+void pager_map_frames(Pager* pager, bool huge_pages) {
+    size_t frames_size = ((size_t) TABLE_MAX_PAGES * pager->page_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    pager->huge_tlb = false;
+#ifdef MAP_HUGETLB
+    if (huge_pages) {
+        void* region = mmap(NULL, frames_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) {
+            pager->frames_region = region;
+            pager->frames_region_size = frames_size;
+            pager->frames = region;
+            pager->huge_tlb = true;
+        }
+    }
+#endif
+    if (!pager->huge_tlb) {
+        pager->frames_region_size = frames_size + HUGE_PAGE_SIZE;
+        pager->frames_region = mmap(NULL, pager->frames_region_size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (pager->frames_region == MAP_FAILED) {
+            printf("Unable to reserve page frames: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->frames = (void*)(((uintptr_t)pager->frames_region + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+#ifdef MADV_HUGEPAGE
+        madvise(pager->frames, frames_size, MADV_HUGEPAGE);
+#endif
+    }
+    pager->interleaved = pager_interleave_frames(pager->frames, frames_size);
+}
+
+/*
+ * Open filename. page_size is only used when the file is new, an existing
+ * file keeps the page size recorded in its header. huge_pages is passed on
+ * to pager_map_frames().
+ */
+Pager *pager_open(const char *filename, uint32_t page_size, bool huge_pages) {
     int fd = open(filename,
                   O_RDWR | // Read/Write mode
                   O_CREAT,       // Create file if it does not exist
@@ -77,12 +500,30 @@ Pager *pager_open(const char *filename) {
 
     off_t file_length = lseek(fd, 0, SEEK_END);
 
+    char header[FILE_HEADER_METADATA_OFFSET];
+    bool compressed = false;
+    if (file_length > 0) {
+        pager_read_header(fd, header);
+        page_size = *file_header_page_size(header);
+        compressed = (*file_header_flags(header) & FILE_FLAG_COMPRESSED) != 0;
+    }
+
     Pager* pager = malloc(sizeof(Pager));
     pager->file_descriptor = fd;
+    pager->page_size = page_size;
     pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
+    pager->num_pages = (file_length / page_size);
+    pager->compress = compressed;
+    pager->direct_io = false;
+    pager->extents = NULL;
+    pager->num_extents = 0;
+    pager->compressed_buffer = malloc(page_size);
+    pager->snapshot = NULL;
 
-    if (file_length % PAGE_SIZE != 0) {
+    if (compressed) {
+        pager_read_extent_map(pager, *file_header_extent_map(header), *file_header_num_extents(header));
+        pager->num_pages = pager->num_extents;
+    } else if (file_length % page_size != 0) {
         printf("Db file is not a whole number of pages. Corrupt file.\n");
         exit(EXIT_FAILURE);
     }
@@ -91,6 +532,24 @@ Pager *pager_open(const char *filename) {
         pager->pages[i] = NULL;
     }
 
+    pager_map_frames(pager, huge_pages);
+    pager->num_frames_used = 0;
+    pager->num_free_frames = 0;
+    pager->num_page_requests = 0;
+    pager->num_page_reads = 0;
+    pager->num_page_writes = 0;
+
+    if (pager->num_pages == 0) {
+        pager_init_header(pager);
+    } else {
+        pager_validate_header(pager);
+    }
+
+    // A reservation the file never grew to cover is not there to hand out
+    for (uint32_t i = pager->num_pages; i < TABLE_MAX_PAGES; i++) {
+        pager_set_page_free(pager, i, false);
+    }
+
     return pager;
 }
 
@@ -100,7 +559,7 @@ void pager_flush(Pager* pager, uint32_t page_num) {
         exit(EXIT_FAILURE);
     }
 
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+    off_t offset = lseek(pager->file_descriptor, (off_t) page_num * pager->page_size, SEEK_SET);
 
     if (offset == -1) {
         printf("Error seeking: %d\n", errno);
@@ -108,10 +567,334 @@ void pager_flush(Pager* pager, uint32_t page_num) {
     }
 
     ssize_t bytes_written =
-            write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+            write(pager->file_descriptor, pager->pages[page_num], pager->page_size);
 
     if (bytes_written == -1) {
         printf("Error writing: %d\n", errno);
         exit(EXIT_FAILURE);
     }
-}
\ No newline at end of file
+    pager->num_page_writes += 1;
+}
+
+void pager_write(Pager* pager, const void* data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t bytes_written = pwrite(pager->file_descriptor, data, size, offset);
+        if (bytes_written <= 0) {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        data += bytes_written;
+        size -= bytes_written;
+        offset += bytes_written;
+    }
+}
+
+/*
+ * Write every page compressed, packed one after another behind the header
+ * page, followed by the extent map. Writes go through a large buffer so the
+ * file is written sequentially.
+ */
+void pager_write_compressed(Pager* pager) {
+    uint32_t page_size = pager->page_size;
+    PageExtent* extents = malloc(pager->num_pages * sizeof(PageExtent));
+    size_t buffer_size = (size_t) PAGE_WRITE_BUFFER_PAGES * page_size;
+    uint8_t* buffer = malloc(buffer_size);
+    size_t buffered = 0;
+    off_t buffer_offset = page_size;
+
+    extents[0].offset = 0;
+    extents[0].length = page_size;
+    for (uint32_t i = 1; i < pager->num_pages; i++) {
+        uint32_t length = page_compress(pager->pages[i], page_size, pager->compressed_buffer);
+        const void* data = length < page_size ? pager->compressed_buffer : pager->pages[i];
+
+        if (buffered + length > buffer_size) {
+            pager_write(pager, buffer, buffered, buffer_offset);
+            buffer_offset += buffered;
+            buffered = 0;
+        }
+        memcpy(buffer + buffered, data, length);
+        extents[i].offset = buffer_offset + buffered;
+        extents[i].length = length;
+        buffered += length;
+        pager->num_page_writes += 1;
+    }
+    pager_write(pager, buffer, buffered, buffer_offset);
+    uint32_t map_offset = buffer_offset + buffered;
+    size_t map_size = pager->num_pages * sizeof(PageExtent);
+    pager_write(pager, extents, map_size, map_offset);
+
+    void* header = pager->pages[FILE_HEADER_PAGE_NUM];
+    *file_header_flags(header) |= FILE_FLAG_COMPRESSED;
+    *file_header_extent_map(header) = map_offset;
+    *file_header_num_extents(header) = pager->num_pages;
+    pager_flush(pager, FILE_HEADER_PAGE_NUM);
+
+    if (ftruncate(pager->file_descriptor, map_offset + map_size) == -1) {
+        printf("Error truncating db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    free(buffer);
+    free(extents);
+}
+
+/*
+ * Write a compressed file back as plain pages, or a plain file compressed.
+ * The new layout overwrites where the old one kept pages, so every page is
+ * loaded first.
+ */
+void pager_rewrite(Pager* pager) {
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        get_page(pager, i);
+    }
+
+    if (pager->compress) {
+        pager_write_compressed(pager);
+        return;
+    }
+
+    void* header = pager->pages[FILE_HEADER_PAGE_NUM];
+    *file_header_flags(header) &= ~FILE_FLAG_COMPRESSED;
+    *file_header_extent_map(header) = 0;
+    *file_header_num_extents(header) = 0;
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        pager_flush(pager, i);
+    }
+    if (ftruncate(pager->file_descriptor, (off_t) pager->num_pages * pager->page_size) == -1) {
+        printf("Error truncating db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Write the cached pages of a file that is compressed and stays compressed.
+ * A page that compresses to what its extent already holds is left where it
+ * is. Any other page, and a new extent map, are appended to the end of the
+ * file and synced to disk, and only then does the header switch to the new
+ * map, so until that last write the file still reads as it did when it was
+ * opened. The space of replaced extents is reclaimed by rewriting the file
+ * whole once it is more than half dead.
+ */
+void pager_append_compressed(Pager* pager) {
+    uint32_t page_size = pager->page_size;
+    PageExtent* extents = malloc(pager->num_pages * sizeof(PageExtent));
+    void* old_data = malloc(page_size);
+    size_t buffer_size = (size_t) PAGE_WRITE_BUFFER_PAGES * page_size;
+    uint8_t* buffer = malloc(buffer_size);
+    size_t buffered = 0;
+    off_t buffer_offset = pager->file_length;
+    uint64_t live_bytes = page_size;
+    bool changed = pager->num_pages != pager->num_extents;
+
+    extents[0].offset = 0;
+    extents[0].length = page_size;
+    for (uint32_t i = 1; i < pager->num_pages; i++) {
+        if (i < pager->num_extents && pager->pages[i] == NULL) {
+            extents[i] = pager->extents[i];
+            live_bytes += extents[i].length;
+            continue;
+        }
+
+        void* page = get_page(pager, i);
+        uint32_t length = page_compress(page, page_size, pager->compressed_buffer);
+        const void* data = length < page_size ? pager->compressed_buffer : page;
+        live_bytes += length;
+        if (i < pager->num_extents && pager->extents[i].length == length &&
+            pread(pager->file_descriptor, old_data, length, pager->extents[i].offset) == (ssize_t) length &&
+            memcmp(old_data, data, length) == 0) {
+            extents[i] = pager->extents[i];
+            continue;
+        }
+
+        if (buffered + length > buffer_size) {
+            pager_write(pager, buffer, buffered, buffer_offset);
+            buffer_offset += buffered;
+            buffered = 0;
+        }
+        memcpy(buffer + buffered, data, length);
+        extents[i].offset = buffer_offset + buffered;
+        extents[i].length = length;
+        buffered += length;
+        pager->num_page_writes += 1;
+        changed = true;
+    }
+    free(old_data);
+    if (!changed) {
+        free(buffer);
+        free(extents);
+        pager_flush(pager, FILE_HEADER_PAGE_NUM);
+        return;
+    }
+
+    pager_write(pager, buffer, buffered, buffer_offset);
+    free(buffer);
+    uint32_t map_offset = buffer_offset + buffered;
+    size_t map_size = pager->num_pages * sizeof(PageExtent);
+    pager_write(pager, extents, map_size, map_offset);
+    if (fdatasync(pager->file_descriptor) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    void* header = pager->pages[FILE_HEADER_PAGE_NUM];
+    *file_header_extent_map(header) = map_offset;
+    *file_header_num_extents(header) = pager->num_pages;
+    pager_flush(pager, FILE_HEADER_PAGE_NUM);
+    pager->file_length = map_offset + map_size;
+
+    free(pager->extents);
+    pager->extents = extents;
+    pager->num_extents = pager->num_pages;
+
+    if (pager->file_length > 2 * (live_bytes + map_size)) {
+        pager_rewrite(pager);
+    }
+}
+
+/*
+ * Read and write pages with O_DIRECT, past the OS page cache, so a page is
+ * only ever cached once, in the pager's frames. Frames are page aligned and
+ * pages sit at multiples of the page size, as O_DIRECT wants. Compressed
+ * pages have no such place in the file, so a compressed file keeps going
+ * through the OS. Returns false when the file or platform can't do it; the
+ * pager then carries on as before.
+ */
+bool pager_set_direct_io(Pager* pager, bool direct_io) {
+#ifdef O_DIRECT
+    if (direct_io && pager->extents != NULL) {
+        return false;
+    }
+    int flags = fcntl(pager->file_descriptor, F_GETFL);
+    if (flags == -1) {
+        return false;
+    }
+    flags = direct_io ? flags | O_DIRECT : flags & ~O_DIRECT;
+    if (fcntl(pager->file_descriptor, F_SETFL, flags) == -1) {
+        return false;
+    }
+    pager->direct_io = direct_io;
+    return true;
+#else
+    return !direct_io;
+#endif
+}
+
+/*
+ * Start keeping the pages as they are now for a reader, see PagerSnapshot.
+ * Returns false when a snapshot is already being kept.
+ */
+bool pager_snapshot_begin(Pager* pager) {
+    if (pager->snapshot != NULL) {
+        return false;
+    }
+    PagerSnapshot* snapshot = malloc(sizeof(PagerSnapshot));
+    snapshot->num_pages = pager->num_pages;
+    snapshot->pending = calloc(TABLE_MAX_PAGES / 64, sizeof(uint64_t));
+    snapshot->saved = calloc(TABLE_MAX_PAGES, sizeof(void*));
+    snapshot->num_saved = 0;
+    for (uint32_t i = 0; i < snapshot->num_pages; i++) {
+        snapshot->pending[i / 64] |= (uint64_t) 1 << (i % 64);
+    }
+    pager->snapshot = snapshot;
+
+    // The free map in the header is changed without going through get_page()
+    pager_snapshot_save(pager, FILE_HEADER_PAGE_NUM);
+    return true;
+}
+
+bool pager_snapshot_pending(PagerSnapshot* snapshot, uint32_t page_num) {
+    return page_num < snapshot->num_pages && ((snapshot->pending[page_num / 64] >> (page_num % 64)) & 1);
+}
+
+void pager_snapshot_save(Pager* pager, uint32_t page_num) {
+    PagerSnapshot* snapshot = pager->snapshot;
+    if (!pager_snapshot_pending(snapshot, page_num) || snapshot->saved[page_num] != NULL) {
+        return;
+    }
+    void* image;
+    // Aligned for a file opened with O_DIRECT
+    if (posix_memalign(&image, pager->page_size, pager->page_size) != 0) {
+        printf("Unable to save a page for a backup.\n");
+        exit(EXIT_FAILURE);
+    }
+    void* page = pager_read_page(pager, page_num, image, pager->compressed_buffer);
+    if (page != image) {
+        memcpy(image, page, pager->page_size);
+    }
+    snapshot->saved[page_num] = image;
+    snapshot->num_saved += 1;
+}
+
+// Whether the snapshot image of page_num is what the file holds at its place
+bool pager_snapshot_in_file(Pager* pager, uint32_t page_num) {
+    return pager->extents == NULL && pager->pages[page_num] == NULL && pager->snapshot->saved[page_num] == NULL;
+}
+
+/*
+ * The snapshot image of page_num: a saved image, the cached page, which has
+ * not been handed out since the snapshot began, or the page read from the
+ * file into buffer.
+ */
+void* pager_snapshot_page(Pager* pager, uint32_t page_num, void* buffer) {
+    if (pager->snapshot->saved[page_num] != NULL) {
+        return pager->snapshot->saved[page_num];
+    }
+    return pager_read_page(pager, page_num, buffer, pager->compressed_buffer);
+}
+
+// The reader has the pages from first to last, their images can go
+void pager_snapshot_taken(Pager* pager, uint32_t first, uint32_t last) {
+    PagerSnapshot* snapshot = pager->snapshot;
+    for (uint32_t i = first; i < last; i++) {
+        snapshot->pending[i / 64] &= ~((uint64_t) 1 << (i % 64));
+        if (snapshot->saved[i] != NULL) {
+            free(snapshot->saved[i]);
+            snapshot->saved[i] = NULL;
+            snapshot->num_saved -= 1;
+        }
+    }
+}
+
+void pager_snapshot_end(Pager* pager) {
+    PagerSnapshot* snapshot = pager->snapshot;
+    if (snapshot == NULL) {
+        return;
+    }
+    pager_snapshot_taken(pager, 0, snapshot->num_pages);
+    free(snapshot->pending);
+    free(snapshot->saved);
+    free(snapshot);
+    pager->snapshot = NULL;
+}
+
+void pager_close(Pager* pager) {
+    pager_snapshot_end(pager);
+    if (pager->compress && pager->extents != NULL) {
+        pager_append_compressed(pager);
+    } else if (pager->compress || pager->extents != NULL) {
+        // Extents are written at any offset and length
+        pager_set_direct_io(pager, false);
+        pager_rewrite(pager);
+    } else {
+        for (uint32_t i = 0; i < pager->num_pages; i++) {
+            if (pager->pages[i] == NULL) {
+                continue;
+            }
+            pager_flush(pager, i);
+        }
+    }
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        pager->pages[i] = NULL;
+    }
+
+    int result = close(pager->file_descriptor);
+    if (result == -1) {
+        printf("Error closing db file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    munmap(pager->frames_region, pager->frames_region_size);
+    free(pager->extents);
+    free(pager->compressed_buffer);
+    free(pager);
+}
@@ -0,0 +1,233 @@
+//
+// Created by aagu on 20-4-19.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parallel_scan.h"
+#include "database.h"
+#include "btree.h"
+#include "utils.h"
+
+/*
+ * Split the leaves into at most num_threads runs and return how many of
+ * them can hold rows the where clause selects. Runs are in key order.
+ */
+uint32_t scan_partition(Table* table, WhereClause clause, uint32_t num_threads, ScanRun* runs) {
+    Pager* pager = table->pager;
+    // Subtrees of one level in key order and the largest key each may hold
+    uint32_t* pages = arena_alloc(table->arena, sizeof(uint32_t) * SCAN_MAX_SUBTREES);
+    uint32_t* upper = arena_alloc(table->arena, sizeof(uint32_t) * SCAN_MAX_SUBTREES);
+    uint32_t* next_pages = arena_alloc(table->arena, sizeof(uint32_t) * SCAN_MAX_SUBTREES);
+    uint32_t* next_upper = arena_alloc(table->arena, sizeof(uint32_t) * SCAN_MAX_SUBTREES);
+    uint32_t num_subtrees = 1;
+    pages[0] = table->root_page_num;
+    upper[0] = UINT32_MAX;
+
+    while (num_subtrees < num_threads * SCAN_SUBTREES_PER_THREAD &&
+           get_node_type(get_page(pager, pages[0])) == NODE_INTERNAL) {
+        uint32_t num_children = 0;
+        for (uint32_t i = 0; i < num_subtrees; i++) {
+            num_children += *internal_node_num_keys(get_page(pager, pages[i])) + 1;
+        }
+        if (num_children > SCAN_MAX_SUBTREES) break;
+        table->counters.internal_nodes_visited += num_subtrees;
+
+        num_children = 0;
+        for (uint32_t i = 0; i < num_subtrees; i++) {
+            void* node = get_page(pager, pages[i]);
+            uint32_t num_keys = *internal_node_num_keys(node);
+            for (uint32_t child = 0; child <= num_keys; child++) {
+                next_pages[num_children] = *internal_node_child(node, child);
+                next_upper[num_children] = child < num_keys ? *internal_node_key(node, child) : upper[i];
+                num_children++;
+            }
+        }
+        uint32_t* swap = pages;
+        pages = next_pages;
+        next_pages = swap;
+        swap = upper;
+        upper = next_upper;
+        next_upper = swap;
+        num_subtrees = num_children;
+    }
+
+    // A lower bound starts the run it falls in from a descent, like a serial scan
+    Cursor* start = NULL;
+    if (clause.type >= EQUAL) {
+        start = table_find(table, clause.id);
+    }
+
+    uint32_t num_runs = num_threads < num_subtrees ? num_threads : num_subtrees;
+    uint32_t num_kept = 0;
+    for (uint32_t r = 0; r < num_runs; r++) {
+        uint32_t first = (uint64_t) r * num_subtrees / num_runs;
+        uint32_t last = (uint64_t) (r + 1) * num_subtrees / num_runs - 1;
+        // Keys of the run are above lower and at most upper[last]
+        bool has_lower = first > 0;
+        uint32_t lower = has_lower ? upper[first - 1] : 0;
+
+        if (start != NULL && upper[last] < clause.id) continue;
+        if (clause.type == LESS || clause.type == LESS_OR_EQUAL) {
+            if (has_lower && (lower == UINT32_MAX || !where_key_satisfied(lower + 1, clause))) continue;
+        }
+
+        ScanRun* run = &runs[num_kept++];
+        memset(run, 0, sizeof(ScanRun));
+        run->table = table;
+        run->clause = clause;
+        if (start != NULL && (!has_lower || lower < clause.id)) {
+            run->first_page_num = start->end_of_table ? 0 : start->page_num;
+            run->first_cell_num = start->cell_num;
+        } else {
+            run->first_page_num = leftmost_leaf(table, pages[first]);
+        }
+        run->end_page_num = last + 1 < num_subtrees ? leftmost_leaf(table, pages[last + 1]) : 0;
+    }
+    return num_kept;
+}
+
+/*
+ * Body of a worker: walk the leaves of one run, totalling keys and printing
+ * rows into the run's own buffer.
+ */
+void* scan_run(void* argument) {
+    ScanRun* run = argument;
+    Table* table = run->table;
+    Pager* pager = table->pager;
+    // Page aligned for a pager doing direct I/O
+    void* buffer;
+    if (posix_memalign(&buffer, pager->page_size, pager->page_size) != 0) {
+        printf("Unable to allocate a scan buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+    void* compressed_buffer = pager->extents != NULL ? malloc(pager->page_size) : NULL;
+    if (run->columns != 0) {
+        run->output = open_memstream(&run->output_buffer, &run->output_size);
+        if (run->output == NULL) {
+            printf("Error: could not buffer scan output.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ScanTotals* totals = &run->totals;
+    uint32_t page_num = run->first_page_num;
+    uint32_t cell_num = run->first_cell_num;
+    bool done = false;
+    Row row;
+    while (page_num != 0 && page_num != run->end_page_num && !done) {
+        void* node = pager_read_page(pager, page_num, buffer, compressed_buffer);
+        run->num_page_requests += 1;
+        if (node == buffer) {
+            run->num_page_reads += 1;
+        }
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        if (run->count_only && table->num_tombstones == 0 && cell_num < num_cells &&
+            where_key_satisfied(layout_leaf_key(&table->layout, node, num_cells - 1), run->clause)) {
+            totals->count += num_cells - cell_num;
+            run->rows_examined += num_cells - cell_num;
+            cell_num = num_cells;
+        }
+        for (; cell_num < num_cells; cell_num++) {
+            if (layout_leaf_is_tombstone(&table->layout, node, cell_num)) continue;
+            uint32_t key = layout_leaf_key(&table->layout, node, cell_num);
+            run->rows_examined += 1;
+            if (!where_key_satisfied(key, run->clause)) {
+                done = true;
+                break;
+            }
+            if (totals->count == 0) totals->min_key = key;
+            totals->max_key = key;
+            totals->count += 1;
+            totals->sum += key;
+            if (run->columns != 0) {
+                leaf_node_read_row(node, cell_num, &row, run->columns);
+                fprint_row_columns(run->output, &row, run->columns);
+            }
+        }
+        page_num = *leaf_node_next_leaf(node);
+        cell_num = 0;
+        // Counted like a serial scan, which follows the chain into the next run too
+        if (page_num != 0 && !done) {
+            run->leaves_visited += 1;
+        }
+    }
+
+    if (run->output != NULL) {
+        fclose(run->output);
+    }
+    free(buffer);
+    free(compressed_buffer);
+    return NULL;
+}
+
+/*
+ * Start a worker for every run but the first, which the calling thread
+ * scans itself. Runs are then finished in key order with scan_finish().
+ */
+uint32_t scan_start(Table* table, WhereClause clause, bool count_only, uint32_t columns, ScanRun* runs) {
+    uint32_t num_runs = scan_partition(table, clause, table->scan_threads, runs);
+    for (uint32_t i = 0; i < num_runs; i++) {
+        runs[i].count_only = count_only;
+        runs[i].columns = columns;
+    }
+    for (uint32_t i = 1; i < num_runs; i++) {
+        runs[i].started = pthread_create(&runs[i].thread, NULL, scan_run, &runs[i]) == 0;
+    }
+    if (num_runs > 0) {
+        scan_run(&runs[0]);
+    }
+    return num_runs;
+}
+
+// A run whose thread could not be started is scanned here instead
+void scan_finish(Table* table, ScanRun* runs, uint32_t run_num) {
+    ScanRun* run = &runs[run_num];
+    if (run->started) {
+        pthread_join(run->thread, NULL);
+    } else if (run_num > 0) {
+        scan_run(run);
+    }
+    table->pager->num_page_requests += run->num_page_requests;
+    table->pager->num_page_reads += run->num_page_reads;
+    table->counters.leaves_visited += run->leaves_visited;
+    table->counters.rows_examined += run->rows_examined;
+}
+
+void parallel_aggregate(Table* table, WhereClause clause, bool count_only, ScanTotals* totals) {
+    ScanRun* runs = arena_alloc(table->arena, sizeof(ScanRun) * SCAN_MAX_THREADS);
+    uint32_t num_runs = scan_start(table, clause, count_only, 0, runs);
+
+    memset(totals, 0, sizeof(ScanTotals));
+    for (uint32_t i = 0; i < num_runs; i++) {
+        scan_finish(table, runs, i);
+        ScanTotals* part = &runs[i].totals;
+        if (part->count == 0) continue;
+        if (totals->count == 0) totals->min_key = part->min_key;
+        totals->max_key = part->max_key;
+        totals->count += part->count;
+        totals->sum += part->sum;
+    }
+}
+
+/*
+ * Print the rows the where clause selects to output, or only format them
+ * when output is NULL, and return how many there were. The output of each
+ * run is written out as soon as the runs before it are.
+ */
+uint64_t parallel_select(Table* table, WhereClause clause, uint32_t columns, FILE* output) {
+    ScanRun* runs = arena_alloc(table->arena, sizeof(ScanRun) * SCAN_MAX_THREADS);
+    uint32_t num_runs = scan_start(table, clause, false, columns, runs);
+
+    uint64_t num_rows = 0;
+    for (uint32_t i = 0; i < num_runs; i++) {
+        scan_finish(table, runs, i);
+        if (output != NULL) {
+            fwrite(runs[i].output_buffer, 1, runs[i].output_size, output);
+        }
+        free(runs[i].output_buffer);
+        num_rows += runs[i].totals.count;
+    }
+    return num_rows;
+}
@@ -0,0 +1,296 @@
+//
+// Created by aagu on 20-4-23.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "rebuild.h"
+#include "btree.h"
+#include "pager.h"
+#include "metrics.h"
+
+/*
+ * Move the source position to the next live cell of the old leaf chain,
+ * starting at the current one.
+ */
+void rebuild_skip_to_live_cell(Rebuild* rebuild) {
+    Pager* pager = rebuild->table->pager;
+    while (rebuild->source_page_num != 0) {
+        void* source = get_page(pager, rebuild->source_page_num);
+        uint32_t num_cells = *leaf_node_num_cells(source);
+        while (rebuild->source_cell_num < num_cells && layout_leaf_is_tombstone(&rebuild->table->layout, source, rebuild->source_cell_num)) {
+            rebuild->source_cell_num++;
+        }
+        if (rebuild->source_cell_num < num_cells) return;
+        rebuild->source_page_num = *leaf_node_next_leaf(source);
+        rebuild->source_cell_num = 0;
+    }
+}
+
+/*
+ * Drop the new pages, which nothing points to yet. The file is only cut
+ * back when no other page was allocated after them.
+ */
+void rebuild_discard(Rebuild* rebuild) {
+    Pager* pager = rebuild->table->pager;
+    if (rebuild->num_leaves == 0) return;
+    if (pager->num_pages == rebuild->first_page_num + rebuild->num_leaves) {
+        pager_truncate(pager, rebuild->first_page_num);
+    } else {
+        for (uint32_t i = 0; i < rebuild->num_leaves; i++) {
+            pager_free_page(pager, rebuild->pages[i]);
+        }
+    }
+    rebuild->num_leaves = 0;
+}
+
+void rebuild_restart(Rebuild* rebuild) {
+    Table* table = rebuild->table;
+    rebuild_discard(rebuild);
+    rebuild->data_version = table->data_version;
+    rebuild->source_page_num = leftmost_leaf(table, table->root_page_num);
+    rebuild->source_cell_num = 0;
+    rebuild_skip_to_live_cell(rebuild);
+    rebuild->first_page_num = get_unused_page_num(table->pager);
+}
+
+/*
+ * Start rebuilding the tree of table with leaves and internal nodes filled
+ * to fill_percent, but never below the minimum a node may hold.
+ */
+Rebuild* rebuild_begin(Table* table, uint32_t fill_percent) {
+    NodeLayout* layout = &table->layout;
+    Rebuild* rebuild = malloc(sizeof(Rebuild));
+    rebuild->table = table;
+
+    rebuild->leaf_cells = layout->leaf_max_cells * fill_percent / 100;
+    if (rebuild->leaf_cells < layout->leaf_min_cells) {
+        rebuild->leaf_cells = layout->leaf_min_cells;
+    }
+    if (rebuild->leaf_cells < 1) {
+        rebuild->leaf_cells = 1;
+    }
+    // Below this, evening out the last two nodes of a level could leave one short
+    uint32_t min_children = 2 * (layout->internal_min_keys + 1) - 1;
+    rebuild->internal_children = (layout->internal_max_cells + 1) * fill_percent / 100;
+    if (rebuild->internal_children < min_children) {
+        rebuild->internal_children = min_children;
+    }
+
+    rebuild->capacity = 64;
+    rebuild->pages = malloc(rebuild->capacity * sizeof(uint32_t));
+    rebuild->max_keys = malloc(rebuild->capacity * sizeof(uint32_t));
+    rebuild->counts = layout->subtree_counts ? malloc(rebuild->capacity * sizeof(uint32_t)) : NULL;
+    rebuild->num_leaves = 0;
+    rebuild->num_restarts = 0;
+    rebuild->first_page_num = get_unused_page_num(table->pager);
+    rebuild_restart(rebuild);
+    return rebuild;
+}
+
+/*
+ * Take the next page at the end of the file for a new leaf. Returns 0 when
+ * the table has no pages left.
+ */
+uint32_t rebuild_add_leaf(Rebuild* rebuild) {
+    Table* table = rebuild->table;
+    uint32_t page_num = get_unused_page_num(table->pager);
+    if (page_num >= TABLE_MAX_PAGES) return 0;
+
+    if (rebuild->num_leaves == rebuild->capacity) {
+        rebuild->capacity *= 2;
+        rebuild->pages = realloc(rebuild->pages, rebuild->capacity * sizeof(uint32_t));
+        rebuild->max_keys = realloc(rebuild->max_keys, rebuild->capacity * sizeof(uint32_t));
+        if (rebuild->counts != NULL) {
+            rebuild->counts = realloc(rebuild->counts, rebuild->capacity * sizeof(uint32_t));
+        }
+    }
+
+    void* leaf = get_page(table->pager, page_num);
+    initialize_leaf_node(leaf, &table->layout);
+    if (rebuild->num_leaves > 0) {
+        *leaf_node_next_leaf(get_page(table->pager, rebuild->pages[rebuild->num_leaves - 1])) = page_num;
+    }
+    rebuild->pages[rebuild->num_leaves++] = page_num;
+    return page_num;
+}
+
+void rebuild_finish_leaf(Rebuild* rebuild, uint32_t index) {
+    void* leaf = get_page(rebuild->table->pager, rebuild->pages[index]);
+    uint32_t num_cells = *leaf_node_num_cells(leaf);
+    rebuild->max_keys[index] = num_cells > 0 ? *leaf_node_key(leaf, num_cells - 1) : 0;
+    if (rebuild->counts != NULL) {
+        rebuild->counts[index] = num_cells;
+    }
+}
+
+/*
+ * A short last leaf is merged into the one before it when they fit in one
+ * leaf, otherwise the two are evened out.
+ */
+void rebuild_balance_last_leaf(Rebuild* rebuild) {
+    Table* table = rebuild->table;
+    if (rebuild->num_leaves < 2) return;
+    uint32_t last_page_num = rebuild->pages[rebuild->num_leaves - 1];
+    void* last = get_page(table->pager, last_page_num);
+    uint32_t last_cells = *leaf_node_num_cells(last);
+    if (last_cells >= table->layout.leaf_min_cells) return;
+
+    uint32_t previous_index = rebuild->num_leaves - 2;
+    void* previous = get_page(table->pager, rebuild->pages[previous_index]);
+    uint32_t previous_cells = *leaf_node_num_cells(previous);
+    uint32_t total = previous_cells + last_cells;
+    if (total <= table->layout.leaf_max_cells) {
+        leaf_node_copy_cells(previous, previous_cells, last, 0, last_cells);
+        *leaf_node_num_cells(previous) = total;
+        *leaf_node_next_leaf(previous) = 0;
+        rebuild->num_leaves--;
+        // The last leaf is the last page of the file
+        pager_truncate(table->pager, last_page_num);
+    } else {
+        uint32_t count = total / 2 - last_cells;
+        leaf_node_copy_cells(last, count, last, 0, last_cells);
+        leaf_node_copy_cells(last, 0, previous, previous_cells - count, count);
+        *leaf_node_num_cells(previous) = previous_cells - count;
+        *leaf_node_num_cells(last) = last_cells + count;
+        rebuild_finish_leaf(rebuild, previous_index + 1);
+    }
+    rebuild_finish_leaf(rebuild, previous_index);
+}
+
+/*
+ * Build internal levels bottom-up over the new leaves. Returns the new
+ * root, or 0 when the table has no pages left.
+ */
+uint32_t rebuild_internal_levels(Rebuild* rebuild) {
+    InternalPageSupply supply = {0, NULL, 0, 0};
+    return build_internal_levels(rebuild->table, rebuild->pages, rebuild->max_keys, rebuild->counts,
+                                 rebuild->num_leaves, rebuild->internal_children, &supply);
+}
+
+/*
+ * Make the new tree the table's tree, then move it down to start at page 1
+ * in the same order. The new pages run without gaps from first_page_num to
+ * the end of the file, and every one of them moves to a lower page number,
+ * so moving them in ascending order never overwrites one still to be moved.
+ */
+void rebuild_swap(Rebuild* rebuild, uint32_t root_page_num) {
+    Table* table = rebuild->table;
+    Pager* pager = table->pager;
+    uint32_t shift = rebuild->first_page_num - 1;
+    uint32_t end = pager->num_pages;
+
+    for (uint32_t page_num = rebuild->first_page_num; page_num < end; page_num++) {
+        void* node = get_page(pager, page_num);
+        if (get_node_type(node) == NODE_LEAF) {
+            if (*leaf_node_next_leaf(node) != 0) {
+                *leaf_node_next_leaf(node) -= shift;
+            }
+        } else {
+            uint32_t num_keys = *internal_node_num_keys(node);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                *internal_node_child(node, i) -= shift;
+            }
+            *internal_node_right_child(node) -= shift;
+        }
+        if (shift > 0) {
+            pager_move_page(pager, page_num, page_num - shift);
+        }
+    }
+    pager_truncate(pager, end - shift);
+
+    root_page_num -= shift;
+    set_node_root(get_page(pager, root_page_num), true);
+    table->root_page_num = root_page_num;
+    *file_header_root_page(get_page(pager, FILE_HEADER_PAGE_NUM)) = root_page_num;
+
+    // The leaves came first, so they are now pages 1 to num_leaves
+    for (uint32_t i = 0; i < rebuild->num_leaves; i++) {
+        leaf_node_reindex(table, i + 1);
+    }
+    table->num_tombstones = 0;
+    table->hot_leaf_page_num = 0;
+    table->data_version += 1;
+    table->tree_version += 1;
+    metrics_count(METRIC_REBUILDS, 1);
+}
+
+/*
+ * Copy up to max_leaves more leaves. Returns REBUILD_MORE while cells are
+ * left to copy, REBUILD_DONE once the new tree is in place.
+ */
+RebuildResult rebuild_step(Rebuild* rebuild, uint32_t max_leaves) {
+    Table* table = rebuild->table;
+    Pager* pager = table->pager;
+
+    if (rebuild->data_version != table->data_version ||
+        pager->num_pages != rebuild->first_page_num + rebuild->num_leaves) {
+        // Cells already copied may be stale now, or other pages were taken after them
+        rebuild->num_restarts += 1;
+        rebuild_restart(rebuild);
+    }
+
+    for (uint32_t n = 0; n < max_leaves && rebuild->source_page_num != 0; n++) {
+        uint32_t page_num = rebuild_add_leaf(rebuild);
+        if (page_num == 0) {
+            rebuild_discard(rebuild);
+            return REBUILD_TABLE_FULL;
+        }
+        void* leaf = get_page(pager, page_num);
+        uint32_t num_cells = 0;
+        while (num_cells < rebuild->leaf_cells && rebuild->source_page_num != 0) {
+            // Copy the run of live cells that starts here
+            void* source = get_page(pager, rebuild->source_page_num);
+            uint32_t source_cells = *leaf_node_num_cells(source);
+            uint32_t from = rebuild->source_cell_num;
+            uint32_t count = 0;
+            while (num_cells + count < rebuild->leaf_cells && from + count < source_cells &&
+                   !layout_leaf_is_tombstone(&rebuild->table->layout, source, from + count)) {
+                count++;
+            }
+            leaf_node_copy_cells(leaf, num_cells, source, from, count);
+            num_cells += count;
+            rebuild->source_cell_num += count;
+            rebuild_skip_to_live_cell(rebuild);
+        }
+        *leaf_node_num_cells(leaf) = num_cells;
+        rebuild_finish_leaf(rebuild, rebuild->num_leaves - 1);
+    }
+    if (rebuild->source_page_num != 0) {
+        return REBUILD_MORE;
+    }
+
+    if (rebuild->num_leaves == 0) {
+        // An empty table still has a root leaf
+        if (rebuild_add_leaf(rebuild) == 0) {
+            return REBUILD_TABLE_FULL;
+        }
+        rebuild_finish_leaf(rebuild, 0);
+    }
+    rebuild_balance_last_leaf(rebuild);
+    uint32_t root_page_num = rebuild_internal_levels(rebuild);
+    if (root_page_num == 0) {
+        pager_truncate(pager, rebuild->first_page_num);
+        rebuild->num_leaves = 0;
+        return REBUILD_TABLE_FULL;
+    }
+    rebuild_swap(rebuild, root_page_num);
+    return REBUILD_DONE;
+}
+
+void rebuild_free(Rebuild* rebuild) {
+    free(rebuild->pages);
+    free(rebuild->max_keys);
+    free(rebuild->counts);
+    free(rebuild);
+}
+
+/*
+ * Rebuild the whole tree in one go, between two statements.
+ */
+RebuildResult table_rebuild(Table* table, uint32_t fill_percent) {
+    Rebuild* rebuild = rebuild_begin(table, fill_percent);
+    RebuildResult result = rebuild_step(rebuild, UINT32_MAX);
+    rebuild_free(rebuild);
+    return result;
+}
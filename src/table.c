@@ -4,6 +4,7 @@
 
 #include "table.h"
 #include "btree.h"
+#include "hash_index.h"
 
 Cursor* table_start(Table* table) {
     Cursor* cursor = table_find(table, 0);
@@ -11,22 +12,325 @@ Cursor* table_start(Table* table) {
     void* node = get_page(table->pager, cursor->page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
     cursor->end_of_table = (num_cells == 0);
+    cursor_skip_tombstones(cursor);
 
     return cursor;
 }
 
+/*
+ * First leaf under page_num. Unlike table_start() it stops at a leaf even
+ * when all its cells are tombstones, so walks that must see every leaf
+ * start here.
+ */
+uint32_t leftmost_leaf(Table* table, uint32_t page_num) {
+    Pager* pager = table->pager;
+    table->counters.descents += 1;
+    void* node = get_page(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        table->counters.internal_nodes_visited += 1;
+        page_num = *internal_node_child(node, 0);
+        node = get_page(pager, page_num);
+    }
+    return page_num;
+}
+
+/*
+ * Whether key belongs in the cached leaf, checked against the leaf itself:
+ * either it falls between the leaf's first and last key, or the leaf is the
+ * rightmost one and key is past its end (an append).
+ */
+bool hot_leaf_covers(Table* table, uint32_t key) {
+    uint32_t page_num = table->hot_leaf_page_num;
+    if (page_num == 0 || page_num >= table->pager->num_pages) return false;
+    // A split or merge since the descent may have moved the leaf to another parent
+    if (table->hot_leaf_version != table->tree_version) return false;
+
+    void* node = get_page(table->pager, page_num);
+    if (get_node_type(node) != NODE_LEAF) return false;
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells == 0) return false;
+
+    uint32_t min_key = *leaf_node_key(node, 0);
+    uint32_t max_key = *leaf_node_key(node, num_cells - 1);
+    if (key >= min_key && key <= max_key) return true;
+    return key > max_key && *leaf_node_next_leaf(node) == 0;
+}
+
 /*
  * Return the position of the give key.
  * If the key is not present, return the position where it should be inserted.
  */
 Cursor* table_find(Table* table, uint32_t key) {
+    if (hot_leaf_covers(table, key)) {
+        table->counters.hot_leaf_hits += 1;
+        Cursor* cursor = leaf_node_find(table, table->hot_leaf_page_num, key);
+        cursor->path = table->hot_leaf_path;
+        return cursor;
+    }
+
     uint32_t root_page_num = table->root_page_num;
     void* root_node = get_page(table->pager, root_page_num);
 
     if (get_node_type(root_node) == NODE_LEAF) {
+        table->counters.descents += 1;
         return leaf_node_find(table, root_page_num, key);
     } else {
-        return internal_node_find(table, root_page_num, key);
+        Cursor* cursor = internal_node_find(table, root_page_num, key);
+        table->hot_leaf_page_num = cursor->page_num;
+        table->hot_leaf_path = cursor->path;
+        table->hot_leaf_version = table->tree_version;
+        return cursor;
+    }
+}
+
+Cursor* table_end(Table* table) {
+    Cursor* cursor = arena_alloc(table->arena, sizeof(Cursor));
+    cursor->table = table;
+    cursor->page_num = table->root_page_num;
+    cursor->cell_num = 0;
+    cursor->end_of_table = true;
+    cursor->path.depth = 0;
+    return cursor;
+}
+
+/*
+ * The live row with key as the hash index places it, or NULL. An entry is
+ * only trusted once the leaf it names is seen to hold the key, and a missing
+ * entry proves nothing: the tree is authoritative.
+ */
+Cursor* table_index_find(Table* table, uint32_t key) {
+    uint32_t page_num;
+    table->counters.index_lookups += 1;
+    if (!hash_index_find(table->hash_index, key, &page_num) || page_num >= table->pager->num_pages) {
+        return NULL;
+    }
+
+    void* node = get_page(table->pager, page_num);
+    if (get_node_type(node) != NODE_LEAF) {
+        return NULL;
+    }
+    Cursor* cursor = leaf_node_find(table, page_num, key);
+    if (cursor->cell_num < *leaf_node_num_cells(node) &&
+        *leaf_node_key(node, cursor->cell_num) == key &&
+        !leaf_node_is_tombstone(node, cursor->cell_num)) {
+        return cursor;
+    }
+    return NULL;
+}
+
+/*
+ * Point lookup. A key the filter has never seen costs no page at all. With
+ * the hash index enabled an existing key costs a single leaf page. Anything
+ * else is table_find(). Cursors found through the index carry no path, so
+ * they are for reading only.
+ */
+Cursor* table_lookup(Table* table, uint32_t key) {
+    if (!bloom_filter_may_contain(table->key_filter, key)) {
+        return table_end(table);
+    }
+
+    if (table->hash_index != NULL) {
+        Cursor* cursor = table_index_find(table, key);
+        if (cursor != NULL) {
+            return cursor;
+        }
+    }
+
+    return table_find(table, key);
+}
+
+/*
+ * Largest live key, read from the rightmost leaf. Only when lazy deletes
+ * left that leaf without live cells are the leaves walked instead.
+ */
+bool table_max_key(Table* table, uint32_t* key) {
+    table->counters.descents += 1;
+    void* node = get_page(table->pager, table->root_page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        table->counters.internal_nodes_visited += 1;
+        node = get_page(table->pager, *internal_node_right_child(node));
+    }
+    for (uint32_t i = *leaf_node_num_cells(node); i > 0; i--) {
+        if (!leaf_node_is_tombstone(node, i - 1)) {
+            *key = *leaf_node_key(node, i - 1);
+            return true;
+        }
+    }
+
+    bool found = false;
+    for (uint32_t page_num = table_start(table)->page_num; page_num != 0;) {
+        table->counters.leaves_visited += 1;
+        node = get_page(table->pager, page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        for (uint32_t i = 0; i < num_cells; i++) {
+            if (leaf_node_is_tombstone(node, i)) continue;
+            *key = *leaf_node_key(node, i);
+            found = true;
+        }
+        page_num = *leaf_node_next_leaf(node);
+    }
+    return found;
+}
+
+/*
+ * Number of live rows. With subtree counts the root already knows;
+ * otherwise every leaf is visited once but no cell is read.
+ */
+uint64_t table_count_rows(Table* table) {
+    if (table->layout.subtree_counts) {
+        return node_subtree_count(table, table->root_page_num);
+    }
+
+    uint64_t num_cells = 0;
+    for (uint32_t page_num = leftmost_leaf(table, table->root_page_num); page_num != 0;) {
+        table->counters.leaves_visited += 1;
+        void* node = get_page(table->pager, page_num);
+        num_cells += *leaf_node_num_cells(node);
+        page_num = *leaf_node_next_leaf(node);
+    }
+    return num_cells - table->num_tombstones;
+}
+
+/*
+ * Number of live rows with an id below key, in O(height). Needs subtree
+ * counts.
+ */
+uint64_t table_rank(Table* table, uint32_t key) {
+    uint64_t rank = 0;
+    table->counters.descents += 1;
+    void* node = get_page(table->pager, table->root_page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        table->counters.internal_nodes_visited += 1;
+        uint32_t child_index = internal_node_find_child(node, key);
+        for (uint32_t i = 0; i < child_index; i++) {
+            rank += *internal_node_count(&table->layout, node, i);
+        }
+        node = get_page(table->pager, *internal_node_child(node, child_index));
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t i = 0; i < num_cells && layout_leaf_key(&table->layout, node, i) < key; i++) {
+        if (!layout_leaf_is_tombstone(&table->layout, node, i)) rank++;
+    }
+    return rank;
+}
+
+/*
+ * Cursor at the live row with the given rank (0 is the smallest id), at end
+ * of table when there are not that many rows. Needs subtree counts.
+ */
+Cursor* table_seek_rank(Table* table, uint64_t rank) {
+    TreePath path;
+    path.depth = 0;
+
+    uint32_t page_num = table->root_page_num;
+    table->counters.descents += 1;
+    void* node = get_page(table->pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        table->counters.internal_nodes_visited += 1;
+        uint32_t num_keys = *internal_node_num_keys(node);
+        uint32_t child_index = 0;
+        // Past the last child's rows the right child takes the rest, ending the table
+        while (child_index < num_keys && rank >= *internal_node_count(&table->layout, node, child_index)) {
+            rank -= *internal_node_count(&table->layout, node, child_index);
+            child_index++;
+        }
+        path.page_num[path.depth] = page_num;
+        path.child_index[path.depth] = child_index;
+        path.depth++;
+
+        page_num = *internal_node_child(node, child_index);
+        node = get_page(table->pager, page_num);
+    }
+
+    Cursor* cursor = arena_alloc(table->arena, sizeof(Cursor));
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->path = path;
+    cursor->end_of_table = false;
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t cell_num = 0;
+    for (; cell_num < num_cells; cell_num++) {
+        if (layout_leaf_is_tombstone(&table->layout, node, cell_num)) continue;
+        if (rank == 0) break;
+        rank--;
+    }
+    cursor->cell_num = cell_num;
+    cursor_skip_tombstones(cursor);
+    return cursor;
+}
+
+/*
+ * Move forward over num_rows live rows. With subtree counts this is two
+ * descents whatever the distance; otherwise whole leaves are skipped by
+ * their cell counts while the table has no tombstones.
+ */
+void cursor_skip_rows(Cursor* cursor, uint64_t num_rows) {
+    Table* table = cursor->table;
+    if (num_rows == 0 || cursor->end_of_table) return;
+
+    void* node = get_page(table->pager, cursor->page_num);
+    if (table->layout.subtree_counts) {
+        uint64_t rank = table_rank(table, *leaf_node_key(node, cursor->cell_num));
+        *cursor = *table_seek_rank(table, rank + num_rows);
+        return;
+    }
+
+    while (table->num_tombstones == 0 && !cursor->end_of_table) {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        if (cursor->cell_num + num_rows < num_cells) {
+            cursor->cell_num += num_rows;
+            return;
+        }
+        num_rows -= num_cells - cursor->cell_num;
+        cursor->cell_num = num_cells;
+        cursor_skip_tombstones(cursor); // moves on to the next leaf
+        node = get_page(table->pager, cursor->page_num);
+        if (num_rows == 0) return;
+    }
+
+    for (; num_rows > 0 && !cursor->end_of_table; num_rows--) {
+        cursor_advance(cursor);
+    }
+}
+
+/*
+ * Build the in-memory key filter from the leaves, sized for twice the
+ * current number of rows so it survives a while before the next rebuild.
+ */
+void table_rebuild_filter(Table* table) {
+    uint32_t first_leaf_page_num = leftmost_leaf(table, table->root_page_num);
+
+    uint32_t num_rows = 0;
+    table->num_tombstones = 0;
+    for (uint32_t page_num = first_leaf_page_num; page_num != 0;) {
+        void* node = get_page(table->pager, page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        for (uint32_t i = 0; i < num_cells; i++) {
+            if (layout_leaf_is_tombstone(&table->layout, node, i)) {
+                table->num_tombstones += 1;
+            } else {
+                num_rows += 1;
+            }
+        }
+        page_num = *leaf_node_next_leaf(node);
+    }
+
+    if (table->key_filter != NULL) {
+        bloom_filter_free(table->key_filter);
+    }
+    table->key_filter = bloom_filter_new(num_rows * 2);
+
+    for (uint32_t page_num = first_leaf_page_num; page_num != 0;) {
+        void* node = get_page(table->pager, page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        for (uint32_t i = 0; i < num_cells; i++) {
+            if (layout_leaf_is_tombstone(&table->layout, node, i)) continue;
+            bloom_filter_add(table->key_filter, layout_leaf_key(&table->layout, node, i));
+        }
+        page_num = *leaf_node_next_leaf(node);
     }
 }
 
@@ -41,28 +345,41 @@ Cursor* table_find(Table* table, uint32_t key) {
 //    }
 //}
 
-void* cursor_value(Cursor* cursor) {
-    uint32_t page_num = cursor->page_num;
-    void* page = get_page(cursor->table->pager, page_num);
-    return leaf_node_value(page, cursor->cell_num);
+/*
+ * Read the columns asked for from the cell under the cursor, see
+ * leaf_node_read_row().
+ */
+void cursor_read_row(Cursor* cursor, Row* row, uint32_t columns) {
+    void* page = get_page(cursor->table->pager, cursor->page_num);
+    leaf_node_read_row(page, cursor->cell_num, row, columns);
 }
 
-void cursor_advance(Cursor* cursor) {
-    uint32_t page_num = cursor->page_num;
-    void* node = get_page(cursor->table->pager, page_num);
+/*
+ * Move forward past cells deleted lazily, onto later leaves if needed.
+ */
+void cursor_skip_tombstones(Cursor* cursor) {
+    void* node = get_page(cursor->table->pager, cursor->page_num);
+    while (!cursor->end_of_table) {
+        if (cursor->cell_num < *leaf_node_num_cells(node)) {
+            if (!layout_leaf_is_tombstone(&cursor->table->layout, node, cursor->cell_num)) return;
+            cursor->cell_num += 1;
+            continue;
+        }
 
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-        /*
-         * Advance to next leaf node
-         */
         uint32_t next_page_num = *leaf_node_next_leaf(node);
         if (next_page_num == 0) {
             // This was rightmost leaf
             cursor->end_of_table = true;
         } else {
+            cursor->table->counters.leaves_visited += 1;
             cursor->page_num = next_page_num;
             cursor->cell_num = 0;
+            node = get_page(cursor->table->pager, next_page_num);
         }
     }
 }
+
+void cursor_advance(Cursor* cursor) {
+    cursor->cell_num += 1;
+    cursor_skip_tombstones(cursor);
+}
@@ -0,0 +1,405 @@
+//
+// Created by aagu on 20-4-12.
+//
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zconf.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "transfer.h"
+#include "btree.h"
+#include "database.h"
+
+static const int CSV_FIELD_ERROR = -2;
+
+typedef struct {
+    int file_descriptor;
+    char* buffer;
+    uint32_t length; // bytes currently in buffer
+    uint32_t position;
+    bool failed;
+} TransferReader;
+
+typedef struct {
+    int file_descriptor;
+    char* buffer;
+    uint32_t length;
+    bool failed;
+} TransferWriter;
+
+bool transfer_parse_format(const char* name, TransferFormat* format) {
+    if (strcmp(name, "csv") == 0) {
+        *format = TRANSFER_CSV;
+        return true;
+    }
+    if (strcmp(name, "binary") == 0) {
+        *format = TRANSFER_BINARY;
+        return true;
+    }
+    return false;
+}
+
+bool reader_fill(TransferReader* reader) {
+    ssize_t bytes_read = read(reader->file_descriptor, reader->buffer, TRANSFER_BUFFER_SIZE);
+    if (bytes_read < 0) {
+        reader->failed = true;
+        return false;
+    }
+    reader->length = bytes_read;
+    reader->position = 0;
+    return bytes_read > 0;
+}
+
+// Next byte of the file, or -1 at the end
+int reader_next(TransferReader* reader) {
+    if (reader->position == reader->length && !reader_fill(reader)) {
+        return -1;
+    }
+    return (unsigned char) reader->buffer[reader->position++];
+}
+
+bool reader_at_end(TransferReader* reader) {
+    return reader->position == reader->length && !reader_fill(reader);
+}
+
+bool reader_read(TransferReader* reader, void* destination, uint32_t size) {
+    while (size > 0) {
+        if (reader_at_end(reader)) {
+            return false;
+        }
+        uint32_t available = reader->length - reader->position;
+        uint32_t count = size < available ? size : available;
+        memcpy(destination, reader->buffer + reader->position, count);
+        reader->position += count;
+        destination = (char*) destination + count;
+        size -= count;
+    }
+    return true;
+}
+
+void writer_flush(TransferWriter* writer) {
+    uint32_t written = 0;
+    while (written < writer->length && !writer->failed) {
+        ssize_t bytes_written = write(writer->file_descriptor, writer->buffer + written, writer->length - written);
+        if (bytes_written <= 0) {
+            writer->failed = true;
+        } else {
+            written += bytes_written;
+        }
+    }
+    writer->length = 0;
+}
+
+// Only for small pieces, a row at most
+void writer_write(TransferWriter* writer, const void* data, uint32_t size) {
+    if (writer->length + size > TRANSFER_BUFFER_SIZE) {
+        writer_flush(writer);
+    }
+    memcpy(writer->buffer + writer->length, data, size);
+    writer->length += size;
+}
+
+/*
+ * Read one CSV field into destination, at most capacity bytes and not
+ * terminated. Returns what ended it: ',' or '\n', -1 at the end of the file,
+ * or CSV_FIELD_ERROR for an unterminated quote or an overlong field.
+ */
+int csv_read_field(TransferReader* reader, char* destination, uint32_t capacity, uint32_t* length) {
+    *length = 0;
+    int c = reader_next(reader);
+    bool quoted = (c == '"');
+    if (quoted) {
+        c = reader_next(reader);
+    }
+
+    while (true) {
+        if (quoted) {
+            if (c == -1) {
+                return CSV_FIELD_ERROR;
+            }
+            if (c == '"') {
+                c = reader_next(reader);
+                if (c != '"') {
+                    // Closing quote, c is whatever follows it
+                    quoted = false;
+                    continue;
+                }
+            }
+        } else {
+            if (c == ',' || c == '\n' || c == -1) {
+                return c;
+            }
+            if (c == '\r') {
+                c = reader_next(reader);
+                continue;
+            }
+        }
+
+        if (*length == capacity) {
+            return CSV_FIELD_ERROR;
+        }
+        destination[(*length)++] = (char) c;
+        c = reader_next(reader);
+    }
+}
+
+// Ids take the same range as in insert statements
+bool csv_parse_id(const char* text, uint32_t length, uint32_t* id) {
+    if (length == 0 || length > 10) {
+        return false;
+    }
+
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return false;
+        }
+        value = value * 10 + (text[i] - '0');
+    }
+    if (value > INT32_MAX) {
+        return false;
+    }
+
+    *id = value;
+    return true;
+}
+
+TransferResult import_batch(Table* table, Row* rows, uint32_t num_rows, TransferStats* stats) {
+    if (num_rows == 0) {
+        return TRANSFER_SUCCESS;
+    }
+
+    ExecuteResult result = execute_insert_batch(table, rows, num_rows);
+    arena_reset(table->arena);
+    if (result == EXECUTE_DUPLICATE_KEY) {
+        return TRANSFER_DUPLICATE_KEY;
+    }
+
+    stats->num_rows += num_rows;
+    return TRANSFER_SUCCESS;
+}
+
+TransferResult import_csv(Table* table, TransferReader* reader, Row* rows, TransferStats* stats) {
+    char field[COLUMN_EMAIL_SIZE];
+    uint32_t length;
+    uint32_t num_rows = 0;
+
+    while (true) {
+        stats->line += 1;
+        Row* row = &rows[num_rows];
+
+        int end = csv_read_field(reader, field, sizeof(field), &length);
+        if (end == -1 && length == 0) break;
+        if (end == '\n' && length == 0) continue;
+        if (end != ',') {
+            return TRANSFER_PARSE_ERROR;
+        }
+        bool is_header = (stats->line == 1 && length == 2 && memcmp(field, "id", 2) == 0);
+        if (!is_header && !csv_parse_id(field, length, &row->id)) {
+            return TRANSFER_PARSE_ERROR;
+        }
+
+        end = csv_read_field(reader, row->username, COLUMN_USERNAME_SIZE, &length);
+        if (end != ',') {
+            return TRANSFER_PARSE_ERROR;
+        }
+        row->username[length] = '\0';
+
+        end = csv_read_field(reader, row->email, COLUMN_EMAIL_SIZE, &length);
+        if (end != '\n' && end != -1) {
+            return TRANSFER_PARSE_ERROR;
+        }
+        row->email[length] = '\0';
+
+        if (!is_header && ++num_rows == TRANSFER_BATCH_ROWS) {
+            TransferResult result = import_batch(table, rows, num_rows, stats);
+            if (result != TRANSFER_SUCCESS) {
+                return result;
+            }
+            num_rows = 0;
+        }
+        if (end == -1) break;
+    }
+
+    return import_batch(table, rows, num_rows, stats);
+}
+
+TransferResult import_binary(Table* table, TransferReader* reader, Row* rows, TransferStats* stats) {
+    char magic[sizeof(TRANSFER_BINARY_MAGIC)];
+    if (!reader_read(reader, magic, sizeof(magic)) ||
+        memcmp(magic, TRANSFER_BINARY_MAGIC, sizeof(magic)) != 0) {
+        return TRANSFER_PARSE_ERROR;
+    }
+
+    uint32_t num_rows = 0;
+    while (!reader_at_end(reader)) {
+        stats->line += 1;
+        Row* row = &rows[num_rows];
+        uint8_t length;
+
+        if (!reader_read(reader, &row->id, sizeof(row->id))) {
+            return TRANSFER_PARSE_ERROR;
+        }
+        if (!reader_read(reader, &length, sizeof(length)) || length > COLUMN_USERNAME_SIZE ||
+            !reader_read(reader, row->username, length)) {
+            return TRANSFER_PARSE_ERROR;
+        }
+        row->username[length] = '\0';
+        if (!reader_read(reader, &length, sizeof(length)) || !reader_read(reader, row->email, length)) {
+            return TRANSFER_PARSE_ERROR;
+        }
+        row->email[length] = '\0';
+
+        if (++num_rows == TRANSFER_BATCH_ROWS) {
+            TransferResult result = import_batch(table, rows, num_rows, stats);
+            if (result != TRANSFER_SUCCESS) {
+                return result;
+            }
+            num_rows = 0;
+        }
+    }
+
+    return import_batch(table, rows, num_rows, stats);
+}
+
+TransferResult table_import(Table* table, const char* path, TransferFormat format, TransferStats* stats) {
+    stats->num_rows = 0;
+    stats->line = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return TRANSFER_IO_ERROR;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    TransferReader reader;
+    reader.file_descriptor = fd;
+    reader.buffer = malloc(TRANSFER_BUFFER_SIZE);
+    reader.length = 0;
+    reader.position = 0;
+    reader.failed = false;
+    Row* rows = malloc(sizeof(Row) * TRANSFER_BATCH_ROWS);
+
+    TransferResult result;
+    if (format == TRANSFER_CSV) {
+        result = import_csv(table, &reader, rows, stats);
+    } else {
+        result = import_binary(table, &reader, rows, stats);
+    }
+    if (reader.failed) {
+        result = TRANSFER_IO_ERROR;
+    }
+
+    free(rows);
+    free(reader.buffer);
+    close(fd);
+    return result;
+}
+
+uint32_t format_uint(uint32_t value, char* destination) {
+    char digits[10];
+    uint32_t num_digits = 0;
+    do {
+        digits[num_digits++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    for (uint32_t i = 0; i < num_digits; i++) {
+        destination[i] = digits[num_digits - 1 - i];
+    }
+    return num_digits;
+}
+
+void csv_write_field(TransferWriter* writer, const char* text) {
+    if (strpbrk(text, ",\"\r\n") == NULL) {
+        writer_write(writer, text, strlen(text));
+        return;
+    }
+
+    writer_write(writer, "\"", 1);
+    for (const char* c = text; *c != '\0'; c++) {
+        if (*c == '"') {
+            writer_write(writer, "\"\"", 2);
+        } else {
+            writer_write(writer, c, 1);
+        }
+    }
+    writer_write(writer, "\"", 1);
+}
+
+TransferResult table_export(Table* table, const char* path, TransferFormat format, TransferStats* stats) {
+    stats->num_rows = 0;
+    stats->line = 0;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        return TRANSFER_IO_ERROR;
+    }
+
+    TransferWriter writer;
+    writer.file_descriptor = fd;
+    writer.buffer = malloc(TRANSFER_BUFFER_SIZE);
+    writer.length = 0;
+    writer.failed = false;
+
+    if (format == TRANSFER_CSV) {
+        writer_write(&writer, "id,username,email\n", strlen("id,username,email\n"));
+    } else {
+        writer_write(&writer, TRANSFER_BINARY_MAGIC, sizeof(TRANSFER_BINARY_MAGIC));
+    }
+
+    Row row;
+    char number[10];
+    for (Cursor* cursor = table_start(table); !cursor->end_of_table; cursor_advance(cursor)) {
+        cursor_read_row(cursor, &row, COLUMN_ALL);
+
+        if (format == TRANSFER_CSV) {
+            writer_write(&writer, number, format_uint(row.id, number));
+            writer_write(&writer, ",", 1);
+            csv_write_field(&writer, row.username);
+            writer_write(&writer, ",", 1);
+            csv_write_field(&writer, row.email);
+            writer_write(&writer, "\n", 1);
+        } else {
+            uint8_t username_length = strlen(row.username);
+            uint8_t email_length = strlen(row.email);
+            writer_write(&writer, &row.id, sizeof(row.id));
+            writer_write(&writer, &username_length, sizeof(username_length));
+            writer_write(&writer, row.username, username_length);
+            writer_write(&writer, &email_length, sizeof(email_length));
+            writer_write(&writer, row.email, email_length);
+        }
+        stats->num_rows += 1;
+    }
+
+    writer_flush(&writer);
+    free(writer.buffer);
+    if (close(fd) == -1 || writer.failed) {
+        return TRANSFER_IO_ERROR;
+    }
+    return TRANSFER_SUCCESS;
+}
+
+void transfer_print_result(const char* verb, const char* path, TransferResult result, TransferStats* stats) {
+    switch (result) {
+        case TRANSFER_SUCCESS:
+            printf("%s %" PRIu64 " rows.\n", verb, stats->num_rows);
+            break;
+        case TRANSFER_IO_ERROR:
+            printf("Error: could not access '%s'. %s %" PRIu64 " rows.\n", path, verb, stats->num_rows);
+            break;
+        case TRANSFER_PARSE_ERROR:
+            printf("Error: bad row %" PRIu64 " in '%s'. %s %" PRIu64 " rows.\n",
+                   stats->line, path, verb, stats->num_rows);
+            break;
+        case TRANSFER_DUPLICATE_KEY:
+            printf("Error: Duplicate key. %s %" PRIu64 " rows.\n", verb, stats->num_rows);
+            break;
+    }
+}
@@ -0,0 +1,119 @@
+//
+// Created by aagu on 20-4-27.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zconf.h>
+#include <fcntl.h>
+#include "upgrade.h"
+#include "btree.h"
+#include "database.h"
+#include "transfer.h"
+
+bool legacy_read_page(int fd, uint32_t page_num, uint32_t num_pages, void* page) {
+    return page_num < num_pages &&
+           pread(fd, page, LEGACY_PAGE_SIZE, (off_t) page_num * LEGACY_PAGE_SIZE) == (ssize_t) LEGACY_PAGE_SIZE;
+}
+
+uint32_t legacy_u32(void* page, uint32_t offset) {
+    uint32_t value;
+    memcpy(&value, page + offset, sizeof(value));
+    return value;
+}
+
+UpgradeResult upgrade_batch(Table* table, Row* rows, uint32_t batch_rows, uint64_t* num_rows) {
+    ExecuteResult result = execute_insert_batch(table, rows, batch_rows);
+    arena_reset(table->arena);
+    if (result != EXECUTE_SUCCESS) {
+        return UPGRADE_INSERT_FAILED;
+    }
+    *num_rows += batch_rows;
+    return UPGRADE_SUCCESS;
+}
+
+/*
+ * Copy the rows of the legacy file at legacy_path into table. The old tree
+ * is only read, from its root at page 0 down the leftmost children and then
+ * along the leaf chain. Internal node splits of the old code could leave the
+ * chain out of key order, so rows are taken in chain order and left to
+ * execute_insert_batch() to sort.
+ */
+UpgradeResult table_upgrade(Table* table, const char* legacy_path, uint64_t* num_rows) {
+    *num_rows = 0;
+    int fd = open(legacy_path, O_RDONLY);
+    if (fd == -1) {
+        return UPGRADE_IO_ERROR;
+    }
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    uint32_t num_pages = file_length / LEGACY_PAGE_SIZE;
+    void* page = malloc(LEGACY_PAGE_SIZE);
+    uint32_t cell_size = sizeof(uint32_t) + ROW_SIZE;
+    uint32_t max_cells = (LEGACY_PAGE_SIZE - LEGACY_LEAF_NODE_HEADER_SIZE) / cell_size;
+    Row* rows = malloc(sizeof(Row) * TRANSFER_BATCH_ROWS);
+    uint32_t batch_rows = 0;
+    UpgradeResult result = UPGRADE_SUCCESS;
+
+    ssize_t header_length = pread(fd, page, LEGACY_PAGE_SIZE, 0);
+    if (file_length == 0 || (header_length >= (ssize_t) sizeof(FILE_HEADER_MAGIC) &&
+                             memcmp(page + FILE_HEADER_MAGIC_OFFSET, FILE_HEADER_MAGIC, sizeof(FILE_HEADER_MAGIC)) == 0)) {
+        result = UPGRADE_NOT_LEGACY;
+    } else if (file_length % LEGACY_PAGE_SIZE != 0 || header_length != (ssize_t) LEGACY_PAGE_SIZE) {
+        result = UPGRADE_CORRUPT;
+    }
+
+    // Down the leftmost children, at most one visit per page
+    uint32_t page_num = 0;
+    uint32_t num_visited = 0;
+    while (result == UPGRADE_SUCCESS && get_node_type(page) == NODE_INTERNAL) {
+        uint32_t num_keys = legacy_u32(page, LEGACY_INTERNAL_NODE_NUM_KEYS_OFFSET);
+        page_num = num_keys > 0 ? legacy_u32(page, LEGACY_INTERNAL_NODE_HEADER_SIZE)
+                                : legacy_u32(page, LEGACY_INTERNAL_NODE_NUM_KEYS_OFFSET + sizeof(uint32_t));
+        if (++num_visited > num_pages || !legacy_read_page(fd, page_num, num_pages, page)) {
+            result = UPGRADE_CORRUPT;
+        }
+    }
+
+    while (result == UPGRADE_SUCCESS) {
+        uint32_t num_cells = legacy_u32(page, LEGACY_LEAF_NODE_NUM_CELLS_OFFSET);
+        if (get_node_type(page) != NODE_LEAF || num_cells > max_cells) {
+            result = UPGRADE_CORRUPT;
+            break;
+        }
+        for (uint32_t i = 0; i < num_cells && result == UPGRADE_SUCCESS; i++) {
+            void* cell = page + LEGACY_LEAF_NODE_HEADER_SIZE + i * cell_size;
+            Row* row = &rows[batch_rows];
+            deserialize_row(cell + sizeof(uint32_t), row);
+            row->username[COLUMN_USERNAME_SIZE] = '\0';
+            row->email[COLUMN_EMAIL_SIZE] = '\0';
+            if (row->id != legacy_u32(cell, 0)) {
+                result = UPGRADE_CORRUPT;
+                continue;
+            }
+            if (++batch_rows == TRANSFER_BATCH_ROWS) {
+                result = upgrade_batch(table, rows, batch_rows, num_rows);
+                batch_rows = 0;
+            }
+        }
+
+        // 0 ends the chain, page 0 being the root
+        page_num = legacy_u32(page, LEGACY_LEAF_NODE_NEXT_LEAF_OFFSET);
+        if (result != UPGRADE_SUCCESS || page_num == 0) {
+            break;
+        }
+        if (++num_visited > num_pages || !legacy_read_page(fd, page_num, num_pages, page)) {
+            result = UPGRADE_CORRUPT;
+        }
+    }
+
+    if (result == UPGRADE_SUCCESS && batch_rows > 0) {
+        result = upgrade_batch(table, rows, batch_rows, num_rows);
+    }
+
+    free(rows);
+    free(page);
+    close(fd);
+    return result;
+}